@@ -40,6 +40,8 @@
 #include <linux/hashtable.h>
 #include <linux/mount.h>
 #include <linux/dcache.h>
+#include <linux/proc_fs.h>
+#include <linux/string.h>
 
 #include <uapi/linux/dma-buf.h>
 #include <uapi/linux/magic.h>
@@ -75,6 +77,76 @@ static void dmabuf_dent_put(struct dma_buf *dmabuf)
 }
 
 
+/*
+ * Memory accounting for /proc/dma_buf/.
+ *
+ * Exporter totals are kept up to date from export to release.  Per-process
+ * usage is worked out on read from the tasks' file tables (see
+ * dma_buf_procs_show()), so fds that arrive through dup(), fork() or fd
+ * passing count like any other.
+ */
+struct dma_buf_exporter {
+	const char *name;
+	atomic_long_t size;
+	atomic_t count;
+	struct list_head node;
+};
+
+static DEFINE_MUTEX(dma_buf_exporters_lock);
+static LIST_HEAD(dma_buf_exporters);
+
+static struct dma_buf_exporter *dma_buf_exporter_get(const char *name)
+{
+	struct dma_buf_exporter *exp;
+
+	if (!name)
+		name = "unknown";
+
+	mutex_lock(&dma_buf_exporters_lock);
+	list_for_each_entry(exp, &dma_buf_exporters, node)
+		if (!strcmp(exp->name, name))
+			goto out;
+
+	/* exporters are few and long lived, so these are never freed */
+	exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+	if (!exp)
+		goto out;
+
+	exp->name = kstrdup_const(name, GFP_KERNEL);
+	if (!exp->name) {
+		kfree(exp);
+		exp = NULL;
+		goto out;
+	}
+	list_add_tail(&exp->node, &dma_buf_exporters);
+out:
+	mutex_unlock(&dma_buf_exporters_lock);
+	return exp;
+}
+
+static void dma_buf_exporter_charge(struct dma_buf *dmabuf)
+{
+	struct dma_buf_exporter *exp = dma_buf_exporter_get(dmabuf->exp_name);
+
+	dmabuf->exp_stats = exp;
+	if (!exp)
+		return;
+
+	atomic_long_add(dmabuf->size, &exp->size);
+	atomic_inc(&exp->count);
+}
+
+static void dma_buf_exporter_uncharge(struct dma_buf *dmabuf)
+{
+	struct dma_buf_exporter *exp = dmabuf->exp_stats;
+
+	if (!exp)
+		return;
+
+	atomic_long_sub(dmabuf->size, &exp->size);
+	atomic_dec(&exp->count);
+}
+
 static char *dmabuffs_dname(struct dentry *dentry, char *buffer, int buflen)
 {
 	struct dma_buf *dmabuf;
@@ -151,6 +223,8 @@ static int dma_buf_file_release(struct inode *inode, struct file *file)
 	list_del(&dmabuf->list_node);
 	mutex_unlock(&db_list.lock);
 
+	dma_buf_exporter_uncharge(dmabuf);
+
 	return 0;
 }
 
@@ -665,6 +739,8 @@ struct dma_buf *dma_buf_export(const struct dma_buf_export_info *exp_info)
 	dma_buf_ref_init(dmabuf);
 	dma_buf_ref_mod(dmabuf, 1);
 
+	dma_buf_exporter_charge(dmabuf);
+
 	mutex_lock(&db_list.lock);
 	list_add(&dmabuf->list_node, &db_list.head);
 	mutex_unlock(&db_list.lock);
@@ -1618,6 +1694,124 @@ static inline void dma_buf_uninit_debugfs(void)
 }
 #endif
 
+#ifdef CONFIG_PROC_FS
+struct dma_buf_proc_usage {
+	u64 stamp;
+	size_t size;
+	unsigned int count;
+};
+
+/* serialises readers of procs, which own dma_buf::acct_stamp while walking */
+static DEFINE_MUTEX(dma_buf_procs_lock);
+static u64 dma_buf_procs_stamp;
+
+static int dma_buf_proc_usage_add(const void *data, struct file *file,
+				  unsigned int n)
+{
+	struct dma_buf_proc_usage *usage = (struct dma_buf_proc_usage *)data;
+	struct dma_buf *dmabuf;
+
+	if (!is_dma_buf_file(file))
+		return 0;
+
+	/* already counted through another fd of this process */
+	dmabuf = file->private_data;
+	if (dmabuf->acct_stamp == usage->stamp)
+		return 0;
+
+	dmabuf->acct_stamp = usage->stamp;
+	usage->size += dmabuf->size;
+	usage->count++;
+	return 0;
+}
+
+/*
+ * Unlike dmaprocs this neither allocates nor takes file references: a
+ * buffer seen twice in one process is recognised by its stamp, which is
+ * unique to the process being walked.
+ */
+static int dma_buf_procs_show(struct seq_file *s, void *unused)
+{
+	struct task_struct *task, *thread;
+	struct dma_buf_proc_usage usage;
+	char comm[TASK_COMM_LEN];
+
+	seq_printf(s, "%-16s %8s %8s %12s\n", "comm", "pid", "count",
+		   "size (KB)");
+
+	mutex_lock(&dma_buf_procs_lock);
+	rcu_read_lock();
+	for_each_process(task) {
+		usage.stamp = ++dma_buf_procs_stamp;
+		usage.size = 0;
+		usage.count = 0;
+
+		for_each_thread(task, thread) {
+			task_lock(thread);
+			if (thread->files && (thread == task ||
+					      thread->files != task->files))
+				iterate_fd(thread->files, 0,
+					   dma_buf_proc_usage_add, &usage);
+			task_unlock(thread);
+		}
+		if (!usage.count)
+			continue;
+
+		get_task_comm(comm, task);
+		seq_printf(s, "%-16s %8d %8u %12zu\n", comm, task->tgid,
+			   usage.count, usage.size / SZ_1K);
+	}
+	rcu_read_unlock();
+	mutex_unlock(&dma_buf_procs_lock);
+
+	return 0;
+}
+
+static int dma_buf_exporters_show(struct seq_file *s, void *unused)
+{
+	struct dma_buf_exporter *exp;
+	unsigned long total_size = 0;
+	unsigned int total_count = 0;
+
+	seq_printf(s, "%-24s %8s %12s\n", "exporter", "count", "size (KB)");
+
+	mutex_lock(&dma_buf_exporters_lock);
+	list_for_each_entry(exp, &dma_buf_exporters, node) {
+		unsigned long size = atomic_long_read(&exp->size);
+		unsigned int count = atomic_read(&exp->count);
+
+		seq_printf(s, "%-24s %8u %12lu\n", exp->name, count,
+			   size / SZ_1K);
+		total_size += size;
+		total_count += count;
+	}
+	mutex_unlock(&dma_buf_exporters_lock);
+
+	seq_printf(s, "%-24s %8u %12lu\n", "total", total_count,
+		   total_size / SZ_1K);
+	return 0;
+}
+
+static void dma_buf_init_procfs(void)
+{
+	struct proc_dir_entry *dir;
+
+	dir = proc_mkdir("dma_buf", NULL);
+	if (!dir) {
+		pr_debug("dma_buf: failed to create /proc/dma_buf\n");
+		return;
+	}
+
+	/* lists which processes hold which amount, so root only */
+	proc_create_single("procs", 0400, dir, dma_buf_procs_show);
+	proc_create_single("exporters", 0444, dir, dma_buf_exporters_show);
+}
+#else
+static inline void dma_buf_init_procfs(void)
+{
+}
+#endif
+
 static int __init dma_buf_init(void)
 {
 	dma_buf_mnt = kern_mount(&dma_buf_fs_type);
@@ -1627,6 +1821,7 @@ static int __init dma_buf_init(void)
 	mutex_init(&db_list.lock);
 	INIT_LIST_HEAD(&db_list.head);
 	dma_buf_init_debugfs();
+	dma_buf_init_procfs();
 	return 0;
 }
 subsys_initcall(dma_buf_init);
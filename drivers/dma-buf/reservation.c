@@ -104,52 +104,52 @@ reservation_object_add_shared_inplace(struct reservation_object *obj,
 				      struct reservation_object_list *fobj,
 				      struct dma_fence *fence)
 {
-	struct dma_fence *signaled = NULL;
-	u32 i, signaled_idx;
+	struct dma_fence *old_fence = NULL;
+	u32 i, idx = fobj->shared_count;
 
 	dma_fence_get(fence);
 
-	preempt_disable();
-	write_seqcount_begin(&obj->seq);
-
+	/*
+	 * Pick the slot before entering the write side: the list can't change
+	 * under us since obj->lock is held, and dma_fence_is_signaled() may
+	 * call into the driver, which readers shouldn't have to spin on.
+	 */
 	for (i = 0; i < fobj->shared_count; ++i) {
-		struct dma_fence *old_fence;
+		struct dma_fence *check;
 
-		old_fence = rcu_dereference_protected(fobj->shared[i],
+		check = rcu_dereference_protected(fobj->shared[i],
 						reservation_object_held(obj));
 
-		if (old_fence->context == fence->context) {
-			/* memory barrier is added by write_seqcount_begin */
-			RCU_INIT_POINTER(fobj->shared[i], fence);
-			write_seqcount_end(&obj->seq);
-			preempt_enable();
-
-			dma_fence_put(old_fence);
-			return;
+		if (check->context == fence->context) {
+			old_fence = check;
+			idx = i;
+			break;
 		}
 
-		if (!signaled && dma_fence_is_signaled(old_fence)) {
-			signaled = old_fence;
-			signaled_idx = i;
+		if (!old_fence && dma_fence_is_signaled(check)) {
+			old_fence = check;
+			idx = i;
 		}
 	}
 
+	BUG_ON(idx == fobj->shared_count &&
+	       fobj->shared_count >= fobj->shared_max);
+
+	preempt_disable();
+	write_seqcount_begin(&obj->seq);
+
 	/*
 	 * memory barrier is added by write_seqcount_begin,
 	 * fobj->shared_count is protected by this lock too
 	 */
-	if (signaled) {
-		RCU_INIT_POINTER(fobj->shared[signaled_idx], fence);
-	} else {
-		BUG_ON(fobj->shared_count >= fobj->shared_max);
-		RCU_INIT_POINTER(fobj->shared[fobj->shared_count], fence);
+	RCU_INIT_POINTER(fobj->shared[idx], fence);
+	if (idx == fobj->shared_count)
 		fobj->shared_count++;
-	}
 
 	write_seqcount_end(&obj->seq);
 	preempt_enable();
 
-	dma_fence_put(signaled);
+	dma_fence_put(old_fence);
 }
 
 static void
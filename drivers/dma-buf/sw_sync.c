@@ -200,33 +200,47 @@ static const struct dma_fence_ops timeline_fence_ops = {
  */
 static void sync_timeline_signal(struct sync_timeline *obj, unsigned int inc)
 {
+	struct dma_fence *fences[16];
 	struct sync_pt *pt, *next;
+	unsigned int i, count;
 
 	trace_sync_timeline(obj);
 
 	spin_lock_irq(&obj->lock);
-
 	obj->value += inc;
+	spin_unlock_irq(&obj->lock);
 
-	list_for_each_entry_safe(pt, next, &obj->pt_list, link) {
-		if (!timeline_fence_signaled(&pt->base))
-			break;
-
-		list_del_init(&pt->link);
-		rb_erase(&pt->node, &obj->pt_tree);
-
-		/*
-		 * A signal callback may release the last reference to this
-		 * fence, causing it to be freed. That operation has to be
-		 * last to avoid a use after free inside this loop, and must
-		 * be after we remove the fence from the timeline in order to
-		 * prevent deadlocking on timeline->lock inside
-		 * timeline_fence_release().
-		 */
-		dma_fence_signal_locked(&pt->base);
-	}
+	do {
+		count = 0;
+
+		spin_lock_irq(&obj->lock);
+		list_for_each_entry_safe(pt, next, &obj->pt_list, link) {
+			if (count == ARRAY_SIZE(fences) ||
+			    !timeline_fence_signaled(&pt->base))
+				break;
+
+			list_del_init(&pt->link);
+			rb_erase(&pt->node, &obj->pt_tree);
+
+			/*
+			 * Hold a reference so a signal callback can't free the
+			 * fence under us. A fence whose last reference is
+			 * already gone is waiting in timeline_fence_release()
+			 * for our lock and has nobody left to signal.
+			 */
+			fences[count] = dma_fence_get_rcu(&pt->base);
+			if (fences[count])
+				count++;
+		}
+		spin_unlock_irq(&obj->lock);
 
-	spin_unlock_irq(&obj->lock);
+		/* fence->lock is obj->lock, taken once for the whole batch */
+		dma_fence_signal_batch(fences, count);
+
+		/* the final put takes obj->lock in timeline_fence_release() */
+		for (i = 0; i < count; i++)
+			dma_fence_put(fences[i]);
+	} while (count == ARRAY_SIZE(fences));
 }
 
 /**
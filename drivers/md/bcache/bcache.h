@@ -372,6 +372,8 @@ struct cached_dev {
 	unsigned int		partial_stripes_expensive:1;
 	unsigned int		writeback_metadata:1;
 	unsigned int		writeback_running:1;
+	unsigned int		writeback_merge:1;
+	unsigned int		writeback_idle_burst:1;
 	unsigned char		writeback_percent;
 	unsigned int		writeback_delay;
 
@@ -15,6 +15,7 @@
 #include <linux/sched/clock.h>
 #include <linux/random.h>
 #include <linux/prefetch.h>
+#include <linux/rcupdate.h>
 
 #ifdef CONFIG_BCACHE_DEBUG
 
@@ -287,23 +288,30 @@ static inline size_t bset_prev_bytes(struct btree_keys *b)
 
 /* Memory allocation */
 
-void bch_btree_keys_free(struct btree_keys *b)
+static void __bch_btree_keys_free(void *prev, size_t prev_bytes,
+				  void *tree, size_t tree_bytes,
+				  void *data, unsigned int page_order)
 {
-	struct bset_tree *t = b->set;
-
-	if (bset_prev_bytes(b) < PAGE_SIZE)
-		kfree(t->prev);
+	if (prev_bytes < PAGE_SIZE)
+		kfree(prev);
 	else
-		free_pages((unsigned long) t->prev,
-			   get_order(bset_prev_bytes(b)));
+		free_pages((unsigned long) prev, get_order(prev_bytes));
 
-	if (bset_tree_bytes(b) < PAGE_SIZE)
-		kfree(t->tree);
+	if (tree_bytes < PAGE_SIZE)
+		kfree(tree);
 	else
-		free_pages((unsigned long) t->tree,
-			   get_order(bset_tree_bytes(b)));
+		free_pages((unsigned long) tree, get_order(tree_bytes));
+
+	free_pages((unsigned long) data, page_order);
+}
+
+void bch_btree_keys_free(struct btree_keys *b)
+{
+	struct bset_tree *t = b->set;
 
-	free_pages((unsigned long) t->data, b->page_order);
+	__bch_btree_keys_free(t->prev, bset_prev_bytes(b),
+			      t->tree, bset_tree_bytes(b),
+			      t->data, b->page_order);
 
 	t->prev = NULL;
 	t->tree = NULL;
@@ -311,6 +319,48 @@ void bch_btree_keys_free(struct btree_keys *b)
 }
 EXPORT_SYMBOL(bch_btree_keys_free);
 
+struct btree_keys_rcu_free {
+	struct rcu_head		rcu;
+	void			*prev;
+	void			*tree;
+	size_t			prev_bytes;
+	size_t			tree_bytes;
+	unsigned int		page_order;
+};
+
+static void bch_btree_keys_free_rcu_cb(struct rcu_head *rcu)
+{
+	struct btree_keys_rcu_free *f =
+		container_of(rcu, struct btree_keys_rcu_free, rcu);
+
+	__bch_btree_keys_free(f->prev, f->prev_bytes, f->tree, f->tree_bytes,
+			      f, f->page_order);
+}
+
+/*
+ * Like bch_btree_keys_free(), but the memory only goes away after an RCU grace
+ * period, for nodes lockless readers may still be looking at. The btree_keys
+ * can be reused right away. As with bset_free_rcu(), the bookkeeping lives in
+ * the keys buffer itself.
+ */
+void bch_btree_keys_free_rcu(struct btree_keys *b)
+{
+	struct bset_tree *t = b->set;
+	struct btree_keys_rcu_free *f = (void *) t->data;
+
+	f->prev		= t->prev;
+	f->tree		= t->tree;
+	f->prev_bytes	= bset_prev_bytes(b);
+	f->tree_bytes	= bset_tree_bytes(b);
+	f->page_order	= b->page_order;
+	call_rcu(&f->rcu, bch_btree_keys_free_rcu_cb);
+
+	t->prev = NULL;
+	t->tree = NULL;
+	t->data = NULL;
+}
+EXPORT_SYMBOL(bch_btree_keys_free_rcu);
+
 int bch_btree_keys_alloc(struct btree_keys *b,
 			 unsigned int page_order,
 			 gfp_t gfp)
@@ -1102,6 +1152,205 @@ struct bkey *__bch_bset_search(struct btree_keys *b, struct bset_tree *t,
 }
 EXPORT_SYMBOL(__bch_bset_search);
 
+/*
+ * Lockless search
+ *
+ * bch_bset_search_unlocked() is for readers that don't hold the btree node
+ * lock (see bch_btree_lookup_unlocked()). The node can be modified underneath
+ * us, so every key pointer derived from node memory is checked against the
+ * node's buffer before it's dereferenced, keys are copied out before being
+ * looked at, and the result only means something if the caller afterwards
+ * finds the node's sequence number unchanged. Until then the copied key may
+ * be torn, so nothing but key comparisons may be done with it here - in
+ * particular no bch_ptr_bad(), which treats an invalid key as a cache set
+ * error.
+ *
+ * The buffer itself can't go away under us: the shrinker frees it only after
+ * an RCU grace period, and when __btree_sort() swaps in a new buffer the old
+ * one is freed with call_rcu().
+ */
+
+static bool bkey_copy_unlocked(struct bkey *dst, const struct bkey *src,
+			       void *lo, void *hi)
+{
+	unsigned int i;
+
+	if ((void *) src < lo || (void *) (src + 1) > hi)
+		return false;
+
+	dst->high = READ_ONCE(src->high);
+	if (bkey_u64s(dst) > BKEY_PAD ||
+	    (void *) bkey_idx(src, bkey_u64s(dst)) > hi)
+		return false;
+
+	for (i = 1; i < bkey_u64s(dst); i++)
+		((u64 *) dst)[i] = READ_ONCE(((u64 *) src)[i]);
+
+	return true;
+}
+
+static struct bkey *bkey_check_unlocked(struct bkey *k, void *lo, void *hi)
+{
+	return (void *) k >= lo && (void *) (k + 1) <= hi ? k : NULL;
+}
+
+static bool bset_search_tree_unlocked(struct bset_tree *t,
+				      const struct bkey *search,
+				      struct bset_search_iter *i,
+				      void *lo, void *hi)
+{
+	struct bkey_float *f;
+	struct bkey *k;
+	unsigned int inorder, j, n = 1;
+
+	do {
+		j = n;
+		f = &t->tree[j];
+
+		if (likely(f->exponent != 127)) {
+			n = j * 2 + (((unsigned int)
+				      (f->mantissa -
+				       bfloat_mantissa(search, f))) >> 31);
+		} else {
+			k = bkey_check_unlocked(tree_to_bkey(t, j), lo, hi);
+			if (!k)
+				return false;
+
+			n = bkey_cmp(k, search) > 0
+				? j * 2
+				: j * 2 + 1;
+		}
+	} while (n < t->size);
+
+	inorder = to_inorder(j, t);
+
+	if (n & 1) {
+		i->l = cacheline_to_bkey(t, inorder, f->m);
+
+		if (++inorder != t->size) {
+			f = &t->tree[inorder_next(j, t->size)];
+			i->r = cacheline_to_bkey(t, inorder, f->m);
+		} else
+			i->r = bset_bkey_last(t->data);
+	} else {
+		i->r = cacheline_to_bkey(t, inorder, f->m);
+
+		if (--inorder) {
+			f = &t->tree[inorder_prev(j, t->size)];
+			i->l = cacheline_to_bkey(t, inorder, f->m);
+		} else
+			i->l = t->data->start;
+	}
+
+	return true;
+}
+
+static bool bset_search_write_set_unlocked(struct bset_tree *t,
+					   const struct bkey *search,
+					   struct bset_search_iter *i,
+					   void *lo, void *hi)
+{
+	unsigned int li = 0, ri = t->size;
+	struct bkey *k;
+
+	while (li + 1 < ri) {
+		unsigned int m = (li + ri) >> 1;
+
+		k = bkey_check_unlocked(table_to_bkey(t, m), lo, hi);
+		if (!k)
+			return false;
+
+		if (bkey_cmp(k, search) > 0)
+			ri = m;
+		else
+			li = m;
+	}
+
+	i->l = table_to_bkey(t, li);
+	i->r = ri < t->size ? table_to_bkey(t, ri) : bset_bkey_last(t->data);
+	return true;
+}
+
+/*
+ * Copies the first key in set @set that is strictly greater than @search to
+ * @out, which must be BKEY_PADDED.
+ *
+ * Returns 1 if a key was found, 0 if there is none in this set, or -EAGAIN if
+ * the set couldn't be searched consistently.
+ */
+int bch_bset_search_unlocked(struct btree_keys *b, unsigned int set,
+			     const struct bkey *search, struct bkey *out)
+{
+	struct bset_tree *src = b->set + set, t;
+	struct bset_search_iter i;
+	struct bkey *k, *end, *first;
+	void *lo, *hi;
+	size_t max_size;
+
+	lo = READ_ONCE(b->set[0].data);
+	if (!lo)
+		return -EAGAIN;
+	hi = lo + btree_keys_bytes(b);
+
+	t.size	= READ_ONCE(src->size);
+	t.extra	= READ_ONCE(src->extra);
+	t.tree	= READ_ONCE(src->tree);
+	t.prev	= READ_ONCE(src->prev);
+	t.data	= READ_ONCE(src->data);
+	t.end	= src->end;
+
+	if ((void *) t.data < lo || (void *) (t.data + 1) > hi)
+		return -EAGAIN;
+
+	/* The aux trees of all sets share the allocation made for set 0 */
+	if (t.tree < b->set->tree ||
+	    t.tree > b->set->tree + btree_keys_cachelines(b) ||
+	    t.prev - b->set->prev != t.tree - b->set->tree)
+		return -EAGAIN;
+
+	max_size = b->set->tree + btree_keys_cachelines(b) - t.tree;
+	if (t.size > max_size)
+		return -EAGAIN;
+
+	end = bset_bkey_last(t.data);
+	if ((void *) end > hi)
+		return -EAGAIN;
+
+	first = t.data->start;
+	i.l = first;
+	i.r = end;
+
+	if (t.size < 2) {
+		/* linear search over the whole set */
+	} else if (bset_written(b, src)) {
+		if (bkey_cmp(search, &t.end) >= 0)
+			return 0;
+
+		k = bkey_check_unlocked(first, lo, hi);
+		if (k && bkey_cmp(search, k) >= 0 &&
+		    !bset_search_tree_unlocked(&t, search, &i, lo, hi))
+			return -EAGAIN;
+	} else {
+		if (!bset_search_write_set_unlocked(&t, search, &i, lo, hi))
+			return -EAGAIN;
+	}
+
+	if (i.l < first || i.l > end)
+		return -EAGAIN;
+
+	/* Step through the keys in the node using the size of our copy */
+	for (k = i.l; k < end; k = bkey_idx(k, bkey_u64s(out))) {
+		if (!bkey_copy_unlocked(out, k, lo, hi))
+			return -EAGAIN;
+
+		if (bkey_cmp(out, search) > 0)
+			return 1;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL(bch_bset_search_unlocked);
+
 /* Btree iterator */
 
 typedef bool (btree_iter_cmp_fn)(struct btree_iter_set,
@@ -1262,6 +1511,30 @@ static void btree_mergesort(struct btree_keys *b, struct bset *out,
 	pr_debug("sorted %i keys", out->keys);
 }
 
+struct bset_rcu_free {
+	struct rcu_head		rcu;
+	unsigned int		order;
+};
+
+static void bset_free_rcu_cb(struct rcu_head *rcu)
+{
+	struct bset_rcu_free *f = container_of(rcu, struct bset_rcu_free, rcu);
+
+	free_pages((unsigned long) f, f->order);
+}
+
+/*
+ * The rcu_head lives in the buffer being freed: readers still in it only see
+ * garbage, which they already have to cope with.
+ */
+static void bset_free_rcu(struct bset *i, unsigned int order)
+{
+	struct bset_rcu_free *f = (void *) i;
+
+	f->order = order;
+	call_rcu(&f->rcu, bset_free_rcu_cb);
+}
+
 static void __btree_sort(struct btree_keys *b, struct btree_iter *iter,
 			 unsigned int start, unsigned int order, bool fixup,
 			 struct bset_sort_state *state)
@@ -1286,27 +1559,29 @@ static void __btree_sort(struct btree_keys *b, struct btree_iter *iter,
 	btree_mergesort(b, out, iter, fixup, false);
 	b->nsets = start;
 
-	if (!start && order == b->page_order) {
+	if (!start && order == b->page_order && !used_mempool) {
 		/*
 		 * Our temporary buffer is the same size as the btree node's
 		 * buffer, we can just swap buffers instead of doing a big
-		 * memcpy()
+		 * memcpy(). Lockless readers may still be looking at the old
+		 * buffer, so it's freed after a grace period.
 		 */
 
 		out->magic	= b->set->data->magic;
 		out->seq	= b->set->data->seq;
 		out->version	= b->set->data->version;
 		swap(out, b->set->data);
+		bset_free_rcu(out, order);
 	} else {
 		b->set[start].data->keys = out->keys;
 		memcpy(b->set[start].data->start, out->start,
 		       (void *) bset_bkey_last(out) - (void *) out->start);
-	}
 
-	if (used_mempool)
-		mempool_free(virt_to_page(out), &state->pool);
-	else
-		free_pages((unsigned long) out, order);
+		if (used_mempool)
+			mempool_free(virt_to_page(out), &state->pool);
+		else
+			free_pages((unsigned long) out, order);
+	}
 
 	bch_bset_build_written_tree(b);
 
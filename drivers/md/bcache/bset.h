@@ -290,6 +290,7 @@ static inline struct bset *bset_next_set(struct btree_keys *b,
 }
 
 void bch_btree_keys_free(struct btree_keys *b);
+void bch_btree_keys_free_rcu(struct btree_keys *b);
 int bch_btree_keys_alloc(struct btree_keys *b, unsigned int page_order,
 			 gfp_t gfp);
 void bch_btree_keys_init(struct btree_keys *b, const struct btree_keys_ops *ops,
@@ -339,6 +340,8 @@ struct bkey *bch_btree_iter_init(struct btree_keys *b,
 
 struct bkey *__bch_bset_search(struct btree_keys *b, struct bset_tree *t,
 			       const struct bkey *search);
+int bch_bset_search_unlocked(struct btree_keys *b, unsigned int set,
+			     const struct bkey *search, struct bkey *out);
 
 /*
  * Returns the first key that is strictly greater than search
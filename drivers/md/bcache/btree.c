@@ -576,6 +576,17 @@ static void mca_data_free(struct btree *b)
 	list_move(&b->list, &b->c->btree_cache_freed);
 }
 
+/* For the shrinker: lockless readers may still be in the node's data */
+static void mca_data_free_rcu(struct btree *b)
+{
+	BUG_ON(b->io_mutex.count != 1);
+
+	bch_btree_keys_free_rcu(&b->keys);
+
+	b->c->btree_cache_used--;
+	list_move(&b->list, &b->c->btree_cache_freed);
+}
+
 static void mca_bucket_free(struct btree *b)
 {
 	BUG_ON(btree_node_dirty(b));
@@ -635,6 +646,8 @@ static int mca_reap(struct btree *b, unsigned int min_order, bool flush)
 	if (!down_write_trylock(&b->lock))
 		return -ENOMEM;
 
+	btree_node_seq_write_begin(b);
+
 	BUG_ON(btree_node_dirty(b) && !b->keys.set[0].data);
 
 	if (b->keys.page_order < min_order)
@@ -725,7 +738,7 @@ static unsigned long bch_mca_scan(struct shrinker *shrink,
 
 		if (++i > 3 &&
 		    !mca_reap(b, 0, false)) {
-			mca_data_free(b);
+			mca_data_free_rcu(b);
 			rw_unlock(true, b);
 			freed++;
 		}
@@ -742,7 +755,7 @@ static unsigned long bch_mca_scan(struct shrinker *shrink,
 		if (!b->accessed &&
 		    !mca_reap(b, 0, false)) {
 			mca_bucket_free(b);
-			mca_data_free(b);
+			mca_data_free_rcu(b);
 			rw_unlock(true, b);
 			freed++;
 		} else
@@ -965,6 +978,7 @@ static struct btree *mca_alloc(struct cache_set *c, struct btree_op *op,
 		goto err;
 
 	BUG_ON(!down_write_trylock(&b->lock));
+	btree_node_seq_write_begin(b);
 	if (!b->keys.set->data)
 		goto err;
 out:
@@ -1035,8 +1049,10 @@ struct btree *bch_btree_node_get(struct cache_set *c, struct btree_op *op,
 
 		bch_btree_node_read(b);
 
-		if (!write)
+		if (!write) {
+			btree_node_seq_write_end(b);
 			downgrade_write(&b->lock);
+		}
 	} else {
 		rw_lock(write, b, level);
 		if (PTR_HASH(c, &b->key) != PTR_HASH(c, k)) {
@@ -2448,6 +2464,100 @@ int bch_btree_map_keys(struct btree_op *op, struct cache_set *c,
 	return btree_root(map_keys_recurse, c, op, from, fn, flags);
 }
 
+/* Lockless lookup */
+
+static int btree_node_search_unlocked(struct btree *b, struct bkey *search,
+				      struct bkey *out)
+{
+	BKEY_PADDED(key) tmp;
+	unsigned int i, nsets = READ_ONCE(b->keys.nsets);
+	int ret, found = 0;
+
+	if (nsets >= MAX_BSETS)
+		return -EAGAIN;
+
+	for (i = 0; i <= nsets; i++) {
+		ret = bch_bset_search_unlocked(&b->keys, i, search, &tmp.key);
+		if (ret < 0)
+			return ret;
+
+		if (ret && (!found || bkey_cmp(&tmp.key, out) < 0)) {
+			bkey_copy(out, &tmp.key);
+			found = 1;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Optimistic lookup for the read path: walks from the root down to the leaf
+ * covering @search without taking any node locks, validating each node with
+ * its sequence number (see btree_node_seq_read_begin()).
+ *
+ * On success the first key after @search is copied to @out (which must be
+ * BKEY_PADDED) and the leaf it was found in is returned in @leaf; the leaf is
+ * not locked and may only be used to get at the cache set. Returns -EAGAIN if
+ * the lookup raced with a writer, the path isn't fully cached, there is no key
+ * after @search in the leaf, or the first key found on the way down is bad:
+ * callers then use bch_btree_map_keys().
+ */
+int bch_btree_lookup_unlocked(struct cache_set *c, struct bkey *search,
+			      struct btree **leaf, struct bkey *out)
+{
+	struct btree *b, *child;
+	unsigned long seq, child_seq;
+	int level, ret = -EAGAIN;
+
+	rcu_read_lock();
+
+	b = READ_ONCE(c->root);
+	if (!b)
+		goto out;
+
+	seq = btree_node_seq_read_begin(b);
+	if (seq & 1)
+		goto out;
+
+	level = READ_ONCE(b->level);
+
+	while (1) {
+		if (btree_node_io_error(b) ||
+		    btree_node_search_unlocked(b, search, out) <= 0)
+			goto out;
+
+		/* @out may be torn until the node is revalidated */
+		if (btree_node_seq_read_retry(b, seq) ||
+		    bch_ptr_bad(&b->keys, out))
+			goto out;
+
+		if (!level)
+			break;
+
+		child = mca_find(c, out);
+		if (!child)
+			goto out;
+
+		child_seq = btree_node_seq_read_begin(child);
+		if (btree_node_seq_read_retry(b, seq) ||
+		    (child_seq & 1) ||
+		    PTR_HASH(c, &child->key) != PTR_HASH(c, out) ||
+		    READ_ONCE(child->level) != level - 1)
+			goto out;
+
+		b = child;
+		seq = child_seq;
+		level--;
+	}
+
+	b->accessed = 1;
+	*leaf = b;
+	ret = 0;
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
 /* Keybuf code */
 
 static inline int keybuf_cmp(struct keybuf_key *l, struct keybuf_key *r)
@@ -225,18 +225,50 @@ static inline void bch_btree_op_init(struct btree_op *op, int write_lock_level)
 	op->lock = write_lock_level;
 }
 
+/*
+ * b->seq is odd while a node is write locked. Lockless readers
+ * (bch_btree_lookup_unlocked()) sample it before and after looking at a node
+ * and fall back to taking locks if it changed.
+ */
+static inline void btree_node_seq_write_begin(struct btree *b)
+{
+	WRITE_ONCE(b->seq, b->seq + 1);
+	smp_wmb();
+}
+
+static inline void btree_node_seq_write_end(struct btree *b)
+{
+	smp_wmb();
+	WRITE_ONCE(b->seq, b->seq + 1);
+}
+
+static inline unsigned long btree_node_seq_read_begin(struct btree *b)
+{
+	unsigned long seq = READ_ONCE(b->seq);
+
+	smp_rmb();
+	return seq;
+}
+
+static inline bool btree_node_seq_read_retry(struct btree *b,
+					     unsigned long seq)
+{
+	smp_rmb();
+	return (seq & 1) || READ_ONCE(b->seq) != seq;
+}
+
 static inline void rw_lock(bool w, struct btree *b, int level)
 {
 	w ? down_write_nested(&b->lock, level + 1)
 	  : down_read_nested(&b->lock, level + 1);
 	if (w)
-		b->seq++;
+		btree_node_seq_write_begin(b);
 }
 
 static inline void rw_unlock(bool w, struct btree *b)
 {
 	if (w)
-		b->seq++;
+		btree_node_seq_write_end(b);
 	(w ? up_write : up_read)(&b->lock);
 }
 
@@ -252,6 +284,8 @@ struct btree *bch_btree_node_get(struct cache_set *c, struct btree_op *op,
 				 struct bkey *k, int level, bool write,
 				 struct btree *parent);
 
+int bch_btree_lookup_unlocked(struct cache_set *c, struct bkey *search,
+			      struct btree **leaf, struct bkey *out);
 int bch_btree_insert_check_key(struct btree *b, struct btree_op *op,
 			       struct bkey *check_key);
 int bch_btree_insert(struct cache_set *c, struct keylist *keys,
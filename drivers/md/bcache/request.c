@@ -585,6 +585,32 @@ static int cache_lookup_fn(struct btree_op *op, struct btree *b, struct bkey *k)
 	return n == bio ? MAP_DONE : MAP_CONTINUE;
 }
 
+/*
+ * Fast path for reads that are entirely covered by one cached extent: find
+ * the extent without taking btree node locks, so lookups don't contend with
+ * inserts. Anything else - partial hits, misses, or racing with a writer - is
+ * left to the locked lookup.
+ */
+static bool cache_lookup_unlocked(struct search *s)
+{
+	struct bio *bio = &s->bio.bio;
+	struct btree *b;
+	BKEY_PADDED(key) k;
+
+	if (bch_btree_lookup_unlocked(s->iop.c,
+				      &KEY(s->iop.inode,
+					   bio->bi_iter.bi_sector, 0),
+				      &b, &k.key))
+		return false;
+
+	if (KEY_INODE(&k.key) != s->iop.inode ||
+	    KEY_START(&k.key) > bio->bi_iter.bi_sector ||
+	    KEY_OFFSET(&k.key) < bio_end_sector(bio))
+		return false;
+
+	return cache_lookup_fn(&s->op, b, &k.key) == MAP_DONE;
+}
+
 static void cache_lookup(struct closure *cl)
 {
 	struct search *s = container_of(cl, struct search, iop.cl);
@@ -594,6 +620,11 @@ static void cache_lookup(struct closure *cl)
 
 	bch_btree_op_init(&s->op, -1);
 
+	if (cache_lookup_unlocked(s)) {
+		closure_return(cl);
+		return;
+	}
+
 	ret = bch_btree_map_keys(&s->op, s->iop.c,
 				 &KEY(s->iop.inode, bio->bi_iter.bi_sector, 0),
 				 cache_lookup_fn, MAP_END_KEY);
@@ -2389,6 +2389,9 @@ static void bcache_exit(void)
 		unregister_blkdev(bcache_major, "bcache");
 	unregister_reboot_notifier(&reboot);
 	mutex_destroy(&bch_register_lock);
+
+	/* Node buffers freed by the shrinker and __btree_sort() */
+	rcu_barrier();
 }
 
 static int __init bcache_init(void)
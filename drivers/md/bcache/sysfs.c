@@ -104,6 +104,8 @@ rw_attribute(readahead_cache_policy);
 rw_attribute(stop_when_cache_set_failed);
 rw_attribute(writeback_metadata);
 rw_attribute(writeback_running);
+rw_attribute(writeback_merge);
+rw_attribute(writeback_idle_burst);
 rw_attribute(writeback_percent);
 rw_attribute(writeback_delay);
 rw_attribute(writeback_rate);
@@ -183,6 +185,8 @@ SHOW(__bch_cached_dev)
 	var_printf(bypass_torture_test,	"%i");
 	var_printf(writeback_metadata,	"%i");
 	var_printf(writeback_running,	"%i");
+	var_printf(writeback_merge,	"%i");
+	var_printf(writeback_idle_burst, "%i");
 	var_print(writeback_delay);
 	var_print(writeback_percent);
 	sysfs_hprint(writeback_rate,
@@ -274,6 +278,8 @@ STORE(__cached_dev)
 	d_strtoul(bypass_torture_test);
 	d_strtoul(writeback_metadata);
 	d_strtoul(writeback_running);
+	d_strtoul(writeback_merge);
+	d_strtoul(writeback_idle_burst);
 	d_strtoul(writeback_delay);
 
 	sysfs_strtoul_clamp(writeback_percent, dc->writeback_percent, 0, 40);
@@ -442,6 +448,8 @@ static struct attribute *bch_cached_dev_files[] = {
 	&sysfs_stop_when_cache_set_failed,
 	&sysfs_writeback_metadata,
 	&sysfs_writeback_running,
+	&sysfs_writeback_merge,
+	&sysfs_writeback_idle_burst,
 	&sysfs_writeback_delay,
 	&sysfs_writeback_percent,
 	&sysfs_writeback_rate,
@@ -225,26 +225,36 @@ static unsigned int writeback_delay(struct cached_dev *dc,
 	return bch_next_delay(&dc->writeback_rate, sectors);
 }
 
+/*
+ * When the whole cache set is idle set_at_max_writeback_rate() has already
+ * lifted the rate limit; in that case also gather longer runs of keys and
+ * don't sleep between scans, so the cache drains at backing device speed.
+ */
+static bool writeback_burst(struct cached_dev *dc)
+{
+	return dc->writeback_idle_burst &&
+	       atomic_read(&dc->disk.c->at_max_writeback_rate);
+}
+
+/*
+ * A dirty_io writes back a run of keys that are contiguous on the backing
+ * device: each key is read from the cache with its own bio, and the pages
+ * are then written out with a single bio.
+ */
 struct dirty_io {
 	struct closure		cl;
 	struct cached_dev	*dc;
 	uint16_t		sequence;
+	unsigned int		nr_keys;
+	struct keybuf_key	*keys[MAX_WRITEBACKS_IN_BURST];
+	struct bio		*read_bio[MAX_WRITEBACKS_IN_BURST];
 	struct bio		bio;
 };
 
-static void dirty_init(struct keybuf_key *w)
+static void dirty_init(struct dirty_io *io, struct bio *bio)
 {
-	struct dirty_io *io = w->private;
-	struct bio *bio = &io->bio;
-
-	bio_init(bio, bio->bi_inline_vecs,
-		 DIV_ROUND_UP(KEY_SIZE(&w->key), PAGE_SECTORS));
 	if (!io->dc->writeback_percent)
 		bio_set_prio(bio, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
-
-	bio->bi_iter.bi_size	= KEY_SIZE(&w->key) << 9;
-	bio->bi_private		= w;
-	bch_bio_map(bio, NULL);
 }
 
 static void dirty_io_destructor(struct closure *cl)
@@ -254,62 +264,184 @@ static void dirty_io_destructor(struct closure *cl)
 	kfree(io);
 }
 
+static void dirty_io_free(struct dirty_io *io)
+{
+	unsigned int i;
+
+	for (i = 0; i < io->nr_keys; i++) {
+		if (!io->read_bio[i])
+			continue;
+		bio_free_pages(io->read_bio[i]);
+		bio_put(io->read_bio[i]);
+	}
+	kfree(io);
+}
+
+static void read_dirty_endio(struct bio *bio)
+{
+	struct keybuf_key *w = bio->bi_private;
+	struct dirty_io *io = w->private;
+
+	/* is_read = 1 */
+	bch_count_io_errors(PTR_CACHE(io->dc->disk.c, &w->key, 0),
+			    bio->bi_status, 1,
+			    "reading dirty data from cache");
+
+	if (bio->bi_status)
+		SET_KEY_DIRTY(&w->key, false);
+
+	closure_put(&io->cl);
+}
+
+static struct dirty_io *dirty_io_alloc(struct cached_dev *dc,
+				       struct keybuf_key **keys,
+				       unsigned int nr_keys)
+{
+	struct dirty_io *io;
+	unsigned int i, nr_pages = 0;
+
+	for (i = 0; i < nr_keys; i++)
+		nr_pages += DIV_ROUND_UP(KEY_SIZE(&keys[i]->key), PAGE_SECTORS);
+
+	io = kzalloc(sizeof(struct dirty_io) +
+		     sizeof(struct bio_vec) * nr_pages, GFP_KERNEL);
+	if (!io)
+		return NULL;
+
+	io->dc		= dc;
+	io->nr_keys	= nr_keys;
+	bio_init(&io->bio, io->bio.bi_inline_vecs, nr_pages);
+	dirty_init(io, &io->bio);
+
+	for (i = 0; i < nr_keys; i++) {
+		struct keybuf_key *w = keys[i];
+		struct bio *bio;
+
+		bio = bio_kmalloc(GFP_KERNEL,
+				  DIV_ROUND_UP(KEY_SIZE(&w->key), PAGE_SECTORS));
+		if (!bio)
+			goto err;
+
+		dirty_init(io, bio);
+		bio_set_op_attrs(bio, REQ_OP_READ, 0);
+		bio->bi_iter.bi_sector	= PTR_OFFSET(&w->key, 0);
+		bio->bi_iter.bi_size	= KEY_SIZE(&w->key) << 9;
+		bio->bi_private		= w;
+		bio->bi_end_io		= read_dirty_endio;
+		bio_set_dev(bio, PTR_CACHE(dc->disk.c, &w->key, 0)->bdev);
+		bch_bio_map(bio, NULL);
+
+		if (bch_bio_alloc_pages(bio, GFP_KERNEL)) {
+			bio_put(bio);
+			goto err;
+		}
+
+		io->keys[i]	= w;
+		io->read_bio[i]	= bio;
+	}
+
+	return io;
+err:
+	dirty_io_free(io);
+	return NULL;
+}
+
 static void write_dirty_finish(struct closure *cl)
 {
 	struct dirty_io *io = container_of(cl, struct dirty_io, cl);
-	struct keybuf_key *w = io->bio.bi_private;
 	struct cached_dev *dc = io->dc;
+	unsigned int k;
 
 	bio_free_pages(&io->bio);
 
-	/* This is kind of a dumb way of signalling errors. */
-	if (KEY_DIRTY(&w->key)) {
-		int ret;
-		unsigned int i;
-		struct keylist keys;
+	for (k = 0; k < io->nr_keys; k++) {
+		struct keybuf_key *w = io->keys[k];
+
+		/* This is kind of a dumb way of signalling errors. */
+		if (KEY_DIRTY(&w->key)) {
+			int ret;
+			unsigned int i;
+			struct keylist keys;
 
-		bch_keylist_init(&keys);
+			bch_keylist_init(&keys);
 
-		bkey_copy(keys.top, &w->key);
-		SET_KEY_DIRTY(keys.top, false);
-		bch_keylist_push(&keys);
+			bkey_copy(keys.top, &w->key);
+			SET_KEY_DIRTY(keys.top, false);
+			bch_keylist_push(&keys);
 
-		for (i = 0; i < KEY_PTRS(&w->key); i++)
-			atomic_inc(&PTR_BUCKET(dc->disk.c, &w->key, i)->pin);
+			for (i = 0; i < KEY_PTRS(&w->key); i++)
+				atomic_inc(&PTR_BUCKET(dc->disk.c, &w->key, i)->pin);
 
-		ret = bch_btree_insert(dc->disk.c, &keys, NULL, &w->key);
+			ret = bch_btree_insert(dc->disk.c, &keys, NULL, &w->key);
 
-		if (ret)
-			trace_bcache_writeback_collision(&w->key);
+			if (ret)
+				trace_bcache_writeback_collision(&w->key);
 
-		atomic_long_inc(ret
-				? &dc->disk.c->writeback_keys_failed
-				: &dc->disk.c->writeback_keys_done);
+			atomic_long_inc(ret
+					? &dc->disk.c->writeback_keys_failed
+					: &dc->disk.c->writeback_keys_done);
+		}
+
+		bch_keybuf_del(&dc->writeback_keys, w);
 	}
 
-	bch_keybuf_del(&dc->writeback_keys, w);
 	up(&dc->in_flight);
 
 	closure_return_with_destructor(cl, dirty_io_destructor);
 }
 
-static void dirty_endio(struct bio *bio)
+static void dirty_io_clear_dirty(struct dirty_io *io)
 {
-	struct keybuf_key *w = bio->bi_private;
-	struct dirty_io *io = w->private;
+	unsigned int i;
+
+	for (i = 0; i < io->nr_keys; i++)
+		SET_KEY_DIRTY(&io->keys[i]->key, false);
+}
+
+static void write_dirty_endio(struct bio *bio)
+{
+	struct dirty_io *io = bio->bi_private;
 
 	if (bio->bi_status) {
-		SET_KEY_DIRTY(&w->key, false);
+		dirty_io_clear_dirty(io);
 		bch_count_backing_io_errors(io->dc, bio);
 	}
 
 	closure_put(&io->cl);
 }
 
+/*
+ * Move the pages of the per key read bios into the write bio, in key order.
+ * Returns false if any of the reads failed.
+ */
+static bool dirty_io_merge_reads(struct dirty_io *io)
+{
+	struct bio_vec *bv;
+	unsigned int i;
+	bool ok = true;
+	int j;
+
+	for (i = 0; i < io->nr_keys; i++) {
+		struct bio *bio = io->read_bio[i];
+
+		if (!KEY_DIRTY(&io->keys[i]->key))
+			ok = false;
+
+		bio_for_each_segment_all(bv, bio, j) {
+			io->bio.bi_io_vec[io->bio.bi_vcnt++] = *bv;
+			io->bio.bi_iter.bi_size += bv->bv_len;
+		}
+
+		bio_put(bio);
+		io->read_bio[i] = NULL;
+	}
+
+	return ok;
+}
+
 static void write_dirty(struct closure *cl)
 {
 	struct dirty_io *io = container_of(cl, struct dirty_io, cl);
-	struct keybuf_key *w = io->bio.bi_private;
 	struct cached_dev *dc = io->dc;
 
 	uint16_t next_sequence;
@@ -334,19 +466,22 @@ static void write_dirty(struct closure *cl)
 
 	/*
 	 * IO errors are signalled using the dirty bit on the key.
-	 * If we failed to read, we should not attempt to write to the
-	 * backing device.  Instead, immediately go to write_dirty_finish
-	 * to clean up.
+	 * If we failed to read any key of the run, the merged write would
+	 * leave a hole, so don't write to the backing device at all: the
+	 * keys stay dirty in the btree and are picked up again by a later
+	 * scan.
 	 */
-	if (KEY_DIRTY(&w->key)) {
-		dirty_init(w);
+	if (dirty_io_merge_reads(io)) {
 		bio_set_op_attrs(&io->bio, REQ_OP_WRITE, 0);
-		io->bio.bi_iter.bi_sector = KEY_START(&w->key);
+		io->bio.bi_iter.bi_sector = KEY_START(&io->keys[0]->key);
 		bio_set_dev(&io->bio, io->dc->bdev);
-		io->bio.bi_end_io	= dirty_endio;
+		io->bio.bi_private	= io;
+		io->bio.bi_end_io	= write_dirty_endio;
 
 		/* I/O request sent to backing device */
 		closure_bio_submit(io->dc->disk.c, &io->bio, cl);
+	} else {
+		dirty_io_clear_dirty(io);
 	}
 
 	atomic_set(&dc->writeback_sequence_next, next_sequence);
@@ -355,24 +490,13 @@ static void write_dirty(struct closure *cl)
 	continue_at(cl, write_dirty_finish, io->dc->writeback_write_wq);
 }
 
-static void read_dirty_endio(struct bio *bio)
-{
-	struct keybuf_key *w = bio->bi_private;
-	struct dirty_io *io = w->private;
-
-	/* is_read = 1 */
-	bch_count_io_errors(PTR_CACHE(io->dc->disk.c, &w->key, 0),
-			    bio->bi_status, 1,
-			    "reading dirty data from cache");
-
-	dirty_endio(bio);
-}
-
 static void read_dirty_submit(struct closure *cl)
 {
 	struct dirty_io *io = container_of(cl, struct dirty_io, cl);
+	unsigned int i;
 
-	closure_bio_submit(io->dc->disk.c, &io->bio, cl);
+	for (i = 0; i < io->nr_keys; i++)
+		closure_bio_submit(io->dc->disk.c, io->read_bio[i], cl);
 
 	continue_at(cl, write_dirty, io->dc->writeback_write_wq);
 }
@@ -380,9 +504,9 @@ static void read_dirty_submit(struct closure *cl)
 static void read_dirty(struct cached_dev *dc)
 {
 	unsigned int delay = 0;
-	struct keybuf_key *next, *keys[MAX_WRITEBACKS_IN_PASS], *w;
-	size_t size;
-	int nk, i;
+	struct keybuf_key *next, *keys[MAX_WRITEBACKS_IN_BURST];
+	size_t size, nr_pages;
+	int nk, i, j, nr, max_keys;
 	struct dirty_io *io;
 	struct closure cl;
 	uint16_t sequence = 0;
@@ -402,16 +526,23 @@ static void read_dirty(struct cached_dev *dc)
 	       !test_bit(CACHE_SET_IO_DISABLE, &dc->disk.c->flags) &&
 	       next) {
 		size = 0;
+		nr_pages = 0;
 		nk = 0;
+		max_keys = writeback_burst(dc)
+			? MAX_WRITEBACKS_IN_BURST
+			: MAX_WRITEBACKS_IN_PASS;
 
 		do {
+			size_t key_pages = DIV_ROUND_UP(KEY_SIZE(&next->key),
+							PAGE_SECTORS);
+
 			BUG_ON(ptr_stale(dc->disk.c, &next->key, 0));
 
 			/*
 			 * Don't combine too many operations, even if they
 			 * are all small.
 			 */
-			if (nk >= MAX_WRITEBACKS_IN_PASS)
+			if (nk >= max_keys)
 				break;
 
 			/*
@@ -421,6 +552,10 @@ static void read_dirty(struct cached_dev *dc)
 			if (size >= MAX_WRITESIZE_IN_PASS)
 				break;
 
+			/* A merged write has to fit in a single bio */
+			if (nk && nr_pages + key_pages > BIO_MAX_PAGES)
+				break;
+
 			/*
 			 * Operations are only eligible to be combined
 			 * if they are contiguous.
@@ -435,36 +570,26 @@ static void read_dirty(struct cached_dev *dc)
 				break;
 
 			size += KEY_SIZE(&next->key);
+			nr_pages += key_pages;
 			keys[nk++] = next;
 		} while ((next = bch_keybuf_next(&dc->writeback_keys)));
 
-		/* Now we have gathered a set of 1..5 keys to write back. */
-		for (i = 0; i < nk; i++) {
-			w = keys[i];
+		/*
+		 * Now we have gathered a run of contiguous keys to write back;
+		 * unless merging is disabled, it goes out as one write.
+		 */
+		for (i = 0; i < nk; i += nr) {
+			nr = dc->writeback_merge ? nk - i : 1;
 
-			io = kzalloc(sizeof(struct dirty_io) +
-				     sizeof(struct bio_vec) *
-				     DIV_ROUND_UP(KEY_SIZE(&w->key),
-						  PAGE_SECTORS),
-				     GFP_KERNEL);
+			io = dirty_io_alloc(dc, keys + i, nr);
 			if (!io)
 				goto err;
 
-			w->private	= io;
-			io->dc		= dc;
-			io->sequence    = sequence++;
-
-			dirty_init(w);
-			bio_set_op_attrs(&io->bio, REQ_OP_READ, 0);
-			io->bio.bi_iter.bi_sector = PTR_OFFSET(&w->key, 0);
-			bio_set_dev(&io->bio,
-				    PTR_CACHE(dc->disk.c, &w->key, 0)->bdev);
-			io->bio.bi_end_io	= read_dirty_endio;
-
-			if (bch_bio_alloc_pages(&io->bio, GFP_KERNEL))
-				goto err_free;
-
-			trace_bcache_writeback(&w->key);
+			io->sequence = sequence++;
+			for (j = 0; j < nr; j++) {
+				keys[i + j]->private = io;
+				trace_bcache_writeback(&keys[i + j]->key);
+			}
 
 			down(&dc->in_flight);
 
@@ -487,10 +612,15 @@ static void read_dirty(struct cached_dev *dc)
 	}
 
 	if (0) {
-err_free:
-		kfree(w->private);
 err:
-		bch_keybuf_del(&dc->writeback_keys, w);
+		/*
+		 * Drop the keys we didn't get to; they are still dirty in the
+		 * btree and will be found again by the next scan.
+		 */
+		for (; i < nk; i++)
+			bch_keybuf_del(&dc->writeback_keys, keys[i]);
+		if (next)
+			bch_keybuf_del(&dc->writeback_keys, next);
 	}
 
 	/*
@@ -699,7 +829,11 @@ static int bch_writeback_thread(void *arg)
 
 		read_dirty(dc);
 
-		if (searched_full_index) {
+		/*
+		 * While the cache set is idle keep going straight into the
+		 * next scan instead of waiting for writeback_delay.
+		 */
+		if (searched_full_index && !writeback_burst(dc)) {
 			unsigned int delay = dc->writeback_delay * HZ;
 
 			while (delay &&
@@ -786,6 +920,8 @@ void bch_cached_dev_writeback_init(struct cached_dev *dc)
 
 	dc->writeback_metadata		= true;
 	dc->writeback_running		= false;
+	dc->writeback_merge		= true;
+	dc->writeback_idle_burst	= true;
 	dc->writeback_percent		= 10;
 	dc->writeback_delay		= 30;
 	atomic_long_set(&dc->writeback_rate.rate, 1024);
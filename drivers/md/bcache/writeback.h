@@ -8,6 +8,12 @@
 #define MAX_WRITEBACKS_IN_PASS  5
 #define MAX_WRITESIZE_IN_PASS   5000	/* *512b */
 
+/*
+ * When the cache set is idle, contiguous runs of up to this many keys are
+ * merged into a single write to the backing device.
+ */
+#define MAX_WRITEBACKS_IN_BURST	64
+
 #define WRITEBACK_RATE_UPDATE_SECS_MAX		60
 #define WRITEBACK_RATE_UPDATE_SECS_DEFAULT	5
 
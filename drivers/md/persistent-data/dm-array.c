@@ -882,6 +882,40 @@ static int walk_ablock(void *context, uint64_t *keys, void *leaf)
 	return r;
 }
 
+#define ABLOCK_PREFETCH_BATCH 32
+
+/*
+ * Called for every node of the btree, the bottom leaves list the array
+ * blocks.  Read them all ahead before visiting them in order.
+ */
+static int walk_leaf(void *context, dm_block_t b, unsigned level,
+		     unsigned nr_entries, __le64 *keys, void *values)
+{
+	struct walk_info *wi = context;
+	struct dm_block_manager *bm = dm_tm_get_bm(wi->info->btree_info.tm);
+	dm_block_t blocks[ABLOCK_PREFETCH_BATCH];
+	__le64 *ablocks = values;
+	unsigned i, count = 0;
+	uint64_t key;
+	int r = 0;
+
+	for (i = 0; i < nr_entries; i++) {
+		blocks[count++] = le64_to_cpu(ablocks[i]);
+		if (count == ABLOCK_PREFETCH_BATCH) {
+			dm_bm_prefetch_blocks(bm, blocks, count);
+			count = 0;
+		}
+	}
+	dm_bm_prefetch_blocks(bm, blocks, count);
+
+	for (i = 0; !r && i < nr_entries; i++) {
+		key = le64_to_cpu(keys[i]);
+		r = walk_ablock(wi, &key, ablocks + i);
+	}
+
+	return r;
+}
+
 int dm_array_walk(struct dm_array_info *info, dm_block_t root,
 		  int (*fn)(void *, uint64_t key, void *leaf),
 		  void *context)
@@ -892,7 +926,11 @@ int dm_array_walk(struct dm_array_info *info, dm_block_t root,
 	wi.fn = fn;
 	wi.context = context;
 
-	return dm_btree_walk(&info->btree_info, root, walk_ablock, &wi);
+	/*
+	 * The array btree has a single level, so the breadth first walk
+	 * still visits the leaves, and hence the entries, in key order.
+	 */
+	return dm_btree_walk_bfs(&info->btree_info, root, walk_leaf, &wi);
 }
 EXPORT_SYMBOL_GPL(dm_array_walk);
 
@@ -14,6 +14,8 @@
 #include <linux/device-mapper.h>
 #include <linux/stacktrace.h>
 #include <linux/sched/task.h>
+#include <linux/blkdev.h>
+#include <linux/sort.h>
 
 #define DM_MSG_PREFIX "block manager"
 
@@ -615,6 +617,55 @@ void dm_bm_prefetch(struct dm_block_manager *bm, dm_block_t b)
 	dm_bufio_prefetch(bm->bufio, b, 1);
 }
 
+static int cmp_block(const void *lhs, const void *rhs)
+{
+	dm_block_t l = *(const dm_block_t *) lhs;
+	dm_block_t r = *(const dm_block_t *) rhs;
+
+	if (l < r)
+		return -1;
+
+	return l > r;
+}
+
+void dm_bm_prefetch_blocks(struct dm_block_manager *bm,
+			   dm_block_t *blocks, unsigned count)
+{
+	struct blk_plug plug;
+	dm_block_t start;
+	unsigned i, len;
+
+	if (!count)
+		return;
+
+	sort(blocks, count, sizeof(*blocks), cmp_block, NULL);
+
+	/*
+	 * Coalesce runs of adjacent blocks so dm-bufio can issue them as
+	 * large reads, and plug so the whole batch reaches the device
+	 * together.
+	 */
+	blk_start_plug(&plug);
+	start = blocks[0];
+	len = 1;
+	for (i = 1; i < count; i++) {
+		if (blocks[i] == start + len - 1)
+			continue;	/* duplicate */
+
+		if (blocks[i] == start + len) {
+			len++;
+			continue;
+		}
+
+		dm_bufio_prefetch(bm->bufio, start, len);
+		start = blocks[i];
+		len = 1;
+	}
+	dm_bufio_prefetch(bm->bufio, start, len);
+	blk_finish_plug(&plug);
+}
+EXPORT_SYMBOL_GPL(dm_bm_prefetch_blocks);
+
 bool dm_bm_is_read_only(struct dm_block_manager *bm)
 {
 	return (bm ? bm->read_only : true);
@@ -112,6 +112,13 @@ int dm_bm_flush(struct dm_block_manager *bm);
  */
 void dm_bm_prefetch(struct dm_block_manager *bm, dm_block_t b);
 
+/*
+ * Prefetch a batch of blocks.  The array is sorted in place and adjacent
+ * blocks are merged into a single read.
+ */
+void dm_bm_prefetch_blocks(struct dm_block_manager *bm,
+			   dm_block_t *blocks, unsigned count);
+
 /*
  * Switches the bm to a read only mode.  Once read-only mode
  * has been entered the following functions will return -EPERM.
@@ -10,6 +10,7 @@
 
 #include <linux/export.h>
 #include <linux/device-mapper.h>
+#include <linux/mm.h>
 
 #define DM_MSG_PREFIX "btree"
 
@@ -193,13 +194,34 @@ static int unprocessed_frames(struct del_stack *s)
 	return s->top >= 0;
 }
 
-static void prefetch_children(struct del_stack *s, struct frame *f)
+/*
+ * Prefetch the blocks referenced by a node's 64bit values (children of an
+ * internal node, subtree roots or block references in a leaf).  The values
+ * are gathered into small batches so adjacent blocks get merged into one
+ * read rather than being issued one at a time.
+ */
+#define PREFETCH_BATCH 32
+
+static void prefetch_node_values(struct dm_block_manager *bm,
+				 struct btree_node *n)
 {
-	unsigned i;
-	struct dm_block_manager *bm = dm_tm_get_bm(s->tm);
+	dm_block_t blocks[PREFETCH_BATCH];
+	unsigned i, count = 0, nr = le32_to_cpu(n->header.nr_entries);
 
-	for (i = 0; i < f->nr_children; i++)
-		dm_bm_prefetch(bm, value64(f->n, i));
+	for (i = 0; i < nr; i++) {
+		blocks[count++] = value64(n, i);
+		if (count == PREFETCH_BATCH) {
+			dm_bm_prefetch_blocks(bm, blocks, count);
+			count = 0;
+		}
+	}
+
+	dm_bm_prefetch_blocks(bm, blocks, count);
+}
+
+static void prefetch_children(struct del_stack *s, struct frame *f)
+{
+	prefetch_node_values(dm_tm_get_bm(s->tm), f->n);
 }
 
 static bool is_internal_level(struct dm_btree_info *info, struct frame *f)
@@ -964,6 +986,9 @@ static int walk_node(struct dm_btree_info *info, dm_block_t block,
 
 	n = dm_block_data(node);
 
+	if (le32_to_cpu(n->header.flags) & INTERNAL_NODE)
+		prefetch_node_values(dm_tm_get_bm(info->tm), n);
+
 	nr = le32_to_cpu(n->header.nr_entries);
 	for (i = 0; i < nr; i++) {
 		if (le32_to_cpu(n->header.flags) & INTERNAL_NODE) {
@@ -992,23 +1017,160 @@ int dm_btree_walk(struct dm_btree_info *info, dm_block_t root,
 }
 EXPORT_SYMBOL_GPL(dm_btree_walk);
 
+/*
+ * The breadth first walk keeps every node of the current depth in a queue,
+ * prefetches them ahead of the reads in windows of BFS_PREFETCH_WINDOW and
+ * builds the queue for the next depth as it goes.  Scanning a large tree
+ * therefore costs a few big batches of I/O per depth rather than one
+ * synchronous read per node.
+ */
+#define BFS_PREFETCH_WINDOW 128
+
+struct bfs_entry {
+	dm_block_t b;
+	unsigned level;
+};
+
+struct bfs_queue {
+	struct bfs_entry *entries;
+	unsigned nr;
+	unsigned max;
+};
+
+static int bfs_push(struct bfs_queue *q, dm_block_t b, unsigned level)
+{
+	if (q->nr == q->max) {
+		unsigned max = q->max ? q->max * 2 : BFS_PREFETCH_WINDOW;
+		struct bfs_entry *entries;
+
+		entries = kvmalloc_array(max, sizeof(*entries), GFP_KERNEL);
+		if (!entries)
+			return -ENOMEM;
+
+		if (q->nr)
+			memcpy(entries, q->entries, q->nr * sizeof(*entries));
+		kvfree(q->entries);
+		q->entries = entries;
+		q->max = max;
+	}
+
+	q->entries[q->nr].b = b;
+	q->entries[q->nr].level = level;
+	q->nr++;
+
+	return 0;
+}
+
+static void bfs_prefetch(struct dm_btree_info *info, struct bfs_queue *q,
+			 unsigned start)
+{
+	dm_block_t blocks[PREFETCH_BATCH];
+	unsigned i, count = 0, end = min(q->nr, start + BFS_PREFETCH_WINDOW);
+	struct dm_block_manager *bm = dm_tm_get_bm(info->tm);
+
+	for (i = start; i < end; i++) {
+		blocks[count++] = q->entries[i].b;
+		if (count == PREFETCH_BATCH) {
+			dm_bm_prefetch_blocks(bm, blocks, count);
+			count = 0;
+		}
+	}
+
+	dm_bm_prefetch_blocks(bm, blocks, count);
+}
+
+static int bfs_visit(struct dm_btree_info *info, struct bfs_entry *e,
+		     struct bfs_queue *next,
+		     int (*fn)(void *context, dm_block_t b, unsigned level,
+			       unsigned nr_entries, __le64 *keys, void *values),
+		     void *context)
+{
+	int r;
+	unsigned i, nr, child_level;
+	struct dm_block *node;
+	struct btree_node *n;
+	bool bottom_leaf;
+
+	r = bn_read_lock(info, e->b, &node);
+	if (r)
+		return r;
+
+	n = dm_block_data(node);
+	nr = le32_to_cpu(n->header.nr_entries);
+
+	/*
+	 * Children of an internal node belong to the same btree level;
+	 * values of an upper level leaf are the roots of the next level.
+	 */
+	if (le32_to_cpu(n->header.flags) & INTERNAL_NODE) {
+		bottom_leaf = false;
+		child_level = e->level;
+	} else {
+		bottom_leaf = e->level == info->levels - 1;
+		child_level = e->level + 1;
+	}
+
+	if (bottom_leaf)
+		r = fn(context, e->b, e->level, nr, key_ptr(n, 0), value_ptr(n, 0));
+	else {
+		r = fn(context, e->b, e->level, 0, NULL, NULL);
+		for (i = 0; !r && i < nr; i++)
+			r = bfs_push(next, value64(n, i), child_level);
+	}
+
+	dm_tm_unlock(info->tm, node);
+	return r;
+}
+
+int dm_btree_walk_bfs(struct dm_btree_info *info, dm_block_t root,
+		      int (*fn)(void *context, dm_block_t b, unsigned level,
+				unsigned nr_entries, __le64 *keys, void *values),
+		      void *context)
+{
+	int r;
+	unsigned i;
+	struct bfs_queue cur = { NULL, 0, 0 }, next = { NULL, 0, 0 }, tmp;
+
+	r = bfs_push(&cur, root, 0);
+	if (r)
+		return r;
+
+	while (cur.nr) {
+		for (i = 0; i < cur.nr; i++) {
+			if (!(i % BFS_PREFETCH_WINDOW)) {
+				if (!i)
+					bfs_prefetch(info, &cur, 0);
+				bfs_prefetch(info, &cur, i + BFS_PREFETCH_WINDOW);
+			}
+
+			r = bfs_visit(info, cur.entries + i, &next, fn, context);
+			if (r)
+				goto out;
+		}
+
+		tmp = cur;
+		cur = next;
+		next = tmp;
+		next.nr = 0;
+	}
+
+out:
+	kvfree(cur.entries);
+	kvfree(next.entries);
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_btree_walk_bfs);
+
 /*----------------------------------------------------------------*/
 
 static void prefetch_values(struct dm_btree_cursor *c)
 {
-	unsigned i, nr;
-	__le64 value_le;
 	struct cursor_node *n = c->nodes + c->depth - 1;
 	struct btree_node *bn = dm_block_data(n->b);
-	struct dm_block_manager *bm = dm_tm_get_bm(c->info->tm);
 
-	BUG_ON(c->info->value_type.size != sizeof(value_le));
+	BUG_ON(c->info->value_type.size != sizeof(__le64));
 
-	nr = le32_to_cpu(bn->header.nr_entries);
-	for (i = 0; i < nr; i++) {
-		memcpy(&value_le, value_ptr(bn, i), sizeof(value_le));
-		dm_bm_prefetch(bm, le64_to_cpu(value_le));
-	}
+	prefetch_node_values(dm_tm_get_bm(c->info->tm), bn);
 }
 
 static bool leaf_node(struct dm_btree_cursor *c)
@@ -176,6 +176,28 @@ int dm_btree_walk(struct dm_btree_info *info, dm_block_t root,
 		  int (*fn)(void *context, uint64_t *keys, void *leaf),
 		  void *context);
 
+/*
+ * Breadth first walk of every node in a btree, including all subtrees of
+ * a multi-level tree.  All the nodes at one depth are prefetched in large
+ * batches before they are visited, which makes this much cheaper than
+ * dm_btree_walk() for whole-tree scans of cold metadata (eg, checking or
+ * rebuilding reference counts).
+ *
+ * fn() is called once per node with the block it lives in and the btree
+ * level it belongs to.  For leaves of the bottom level nr_entries, keys and
+ * values describe the node's contents (values are packed at
+ * info->value_type.size), otherwise nr_entries is 0 and keys/values are
+ * NULL.  The pointers are only valid for the duration of the call.
+ *
+ * Nodes are not visited in key order, except that the leaves of a single
+ * level tree are all at the same depth and come left to right.  Allocates
+ * memory proportional to the width of the tree, so don't call on an IO path.
+ */
+int dm_btree_walk_bfs(struct dm_btree_info *info, dm_block_t root,
+		      int (*fn)(void *context, dm_block_t b, unsigned level,
+				unsigned nr_entries, __le64 *keys, void *values),
+		      void *context);
+
 
 /*----------------------------------------------------------------*/
 
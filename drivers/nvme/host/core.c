@@ -248,6 +248,38 @@ static inline bool nvme_req_needs_retry(struct request *req)
 	return true;
 }
 
+static void nvme_account_latency(struct request *req)
+{
+	struct nvme_ns *ns = req->q->queuedata;
+	enum nvme_lat_op op;
+	u64 lat;
+
+	if (!ns)
+		return;
+
+	switch (req_op(req)) {
+	case REQ_OP_READ:
+		op = NVME_LAT_READ;
+		break;
+	case REQ_OP_WRITE:
+		op = NVME_LAT_WRITE;
+		break;
+	case REQ_OP_FLUSH:
+		op = NVME_LAT_FLUSH;
+		break;
+	case REQ_OP_DISCARD:
+		op = NVME_LAT_DISCARD;
+		break;
+	default:
+		return;
+	}
+
+	lat = div_u64(ktime_get_ns() - nvme_req(req)->start_time,
+		      NSEC_PER_USEC);
+	this_cpu_inc(ns->lat_hist->bucket[op][min_t(unsigned int, fls64(lat),
+						    NVME_LAT_BUCKETS - 1)]);
+}
+
 void nvme_complete_rq(struct request *req)
 {
 	blk_status_t status = nvme_error_status(req);
@@ -264,6 +296,7 @@ void nvme_complete_rq(struct request *req)
 			return;
 		}
 	}
+	nvme_account_latency(req);
 	blk_mq_end_request(req, status);
 }
 EXPORT_SYMBOL_GPL(nvme_complete_rq);
@@ -394,6 +427,7 @@ static void nvme_free_ns(struct kref *kref)
 	put_disk(ns->disk);
 	nvme_put_ns_head(ns->head);
 	nvme_put_ctrl(ns->ctrl);
+	free_percpu(ns->lat_hist);
 	kfree(ns);
 }
 
@@ -407,6 +441,8 @@ static inline void nvme_clear_nvme_request(struct request *req)
 	if (!(req->rq_flags & RQF_DONTPREP)) {
 		nvme_req(req)->retries = 0;
 		nvme_req(req)->flags = 0;
+		/* Retries are accounted to the latency of the first try. */
+		nvme_req(req)->start_time = ktime_get_ns();
 		req->rq_flags |= RQF_DONTPREP;
 	}
 }
@@ -2853,6 +2889,120 @@ const struct attribute_group nvme_ns_id_attr_group = {
 	.is_visible	= nvme_ns_id_attrs_are_visible,
 };
 
+/*
+ * Per-namespace statistics in the "stats" group of ns->disk.  With
+ * multipath these are per path, on the nvmeXcYnZ disk of each controller,
+ * since each path has its own latency and queues.
+ */
+static ssize_t nvme_lat_hist_show(struct nvme_ns *ns, enum nvme_lat_op op,
+		char *buf)
+{
+	u64 sum[NVME_LAT_BUCKETS] = { };
+	int cpu, i, len = 0;
+
+	for_each_possible_cpu(cpu) {
+		struct nvme_lat_hist *hist = per_cpu_ptr(ns->lat_hist, cpu);
+
+		for (i = 0; i < NVME_LAT_BUCKETS; i++)
+			sum[i] += READ_ONCE(hist->bucket[op][i]);
+	}
+
+	for (i = 0; i < NVME_LAT_BUCKETS - 1; i++)
+		len += sprintf(buf + len, "%lu %llu\n", 1UL << i, sum[i]);
+	len += sprintf(buf + len, "inf %llu\n", sum[i]);
+	return len;
+}
+
+#define nvme_lat_attr(name, op)						\
+static ssize_t lat_##name##_show(struct device *dev,			\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	return nvme_lat_hist_show(nvme_get_ns_from_dev(dev), op, buf);	\
+}									\
+static struct device_attribute dev_attr_lat_##name =			\
+	__ATTR(name##_latency, S_IRUGO, lat_##name##_show, NULL)
+
+nvme_lat_attr(read, NVME_LAT_READ);
+nvme_lat_attr(write, NVME_LAT_WRITE);
+nvme_lat_attr(flush, NVME_LAT_FLUSH);
+nvme_lat_attr(discard, NVME_LAT_DISCARD);
+
+/*
+ * Counters are cleared without stopping I/O, so a command completing
+ * during the reset may or may not be counted.
+ */
+static ssize_t lat_reset_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct nvme_ns *ns = nvme_get_ns_from_dev(dev);
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(ns->lat_hist, cpu), 0,
+		       sizeof(struct nvme_lat_hist));
+	return count;
+}
+static struct device_attribute dev_attr_lat_reset =
+	__ATTR(latency_reset, S_IWUSR, NULL, lat_reset_store);
+
+struct nvme_hwq_depth {
+	struct request_queue	*q;
+	unsigned int		*depth;
+	unsigned int		nr;
+};
+
+static void nvme_count_hwq_depth(struct request *req, void *data,
+		bool reserved)
+{
+	struct nvme_hwq_depth *d = data;
+	u16 hwq;
+
+	if (req->q != d->q)
+		return;
+
+	hwq = blk_mq_unique_tag_to_hwq(blk_mq_unique_tag(req));
+	if (hwq < d->nr)
+		d->depth[hwq]++;
+}
+
+static ssize_t hw_queue_depth_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct nvme_ns *ns = nvme_get_ns_from_dev(dev);
+	struct nvme_hwq_depth d;
+	int i, len = 0;
+
+	d.q = ns->queue;
+	d.nr = ns->queue->nr_hw_queues;
+	d.depth = kcalloc(d.nr, sizeof(*d.depth), GFP_KERNEL);
+	if (!d.depth)
+		return -ENOMEM;
+
+	blk_mq_tagset_busy_iter(ns->ctrl->tagset, nvme_count_hwq_depth, &d);
+
+	for (i = 0; i < d.nr && len < PAGE_SIZE - 16; i++)
+		len += sprintf(buf + len, "%d %u\n", i, d.depth[i]);
+
+	kfree(d.depth);
+	return len;
+}
+static DEVICE_ATTR_RO(hw_queue_depth);
+
+static struct attribute *nvme_ns_stats_attrs[] = {
+	&dev_attr_lat_read.attr,
+	&dev_attr_lat_write.attr,
+	&dev_attr_lat_flush.attr,
+	&dev_attr_lat_discard.attr,
+	&dev_attr_lat_reset.attr,
+	&dev_attr_hw_queue_depth.attr,
+	NULL,
+};
+
+static const struct attribute_group nvme_ns_stats_attr_group = {
+	.name		= "stats",
+	.attrs		= nvme_ns_stats_attrs,
+};
+
 #define nvme_show_str_function(field)						\
 static ssize_t  field##_show(struct device *dev,				\
 			    struct device_attribute *attr, char *buf)		\
@@ -3171,6 +3321,10 @@ static void nvme_alloc_ns(struct nvme_ctrl *ctrl, unsigned nsid)
 	if (!ns)
 		return;
 
+	ns->lat_hist = alloc_percpu(struct nvme_lat_hist);
+	if (!ns->lat_hist)
+		goto out_free_ns;
+
 	ns->queue = blk_mq_init_queue(ctrl->tagset);
 	if (IS_ERR(ns->queue))
 		goto out_free_ns;
@@ -3227,6 +3381,10 @@ static void nvme_alloc_ns(struct nvme_ctrl *ctrl, unsigned nsid)
 					&nvme_ns_id_attr_group))
 		pr_warn("%s: failed to create sysfs group for identification\n",
 			ns->disk->disk_name);
+	if (sysfs_create_group(&disk_to_dev(ns->disk)->kobj,
+					&nvme_ns_stats_attr_group))
+		pr_warn("%s: failed to create sysfs group for stats\n",
+			ns->disk->disk_name);
 	if (ns->ndev && nvme_nvm_register_sysfs(ns))
 		pr_warn("%s: failed to register lightnvm sysfs group for identification\n",
 			ns->disk->disk_name);
@@ -3245,6 +3403,7 @@ static void nvme_alloc_ns(struct nvme_ctrl *ctrl, unsigned nsid)
  out_free_queue:
 	blk_cleanup_queue(ns->queue);
  out_free_ns:
+	free_percpu(ns->lat_hist);
 	kfree(ns);
 }
 
@@ -3265,6 +3424,8 @@ static void nvme_ns_remove(struct nvme_ns *ns)
 	if (ns->disk && ns->disk->flags & GENHD_FL_UP) {
 		sysfs_remove_group(&disk_to_dev(ns->disk)->kobj,
 					&nvme_ns_id_attr_group);
+		sysfs_remove_group(&disk_to_dev(ns->disk)->kobj,
+					&nvme_ns_stats_attr_group);
 		if (ns->ndev)
 			nvme_nvm_unregister_sysfs(ns);
 		del_gendisk(ns->disk);
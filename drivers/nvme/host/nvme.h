@@ -103,6 +103,7 @@ struct nvme_request {
 	u8			flags;
 	u16			status;
 	struct nvme_ctrl	*ctrl;
+	u64			start_time;
 };
 
 /*
@@ -309,6 +310,24 @@ struct nvme_fault_inject {
 };
 #endif
 
+enum nvme_lat_op {
+	NVME_LAT_READ,
+	NVME_LAT_WRITE,
+	NVME_LAT_FLUSH,
+	NVME_LAT_DISCARD,
+	NVME_LAT_OPS,
+};
+
+/*
+ * Completion latency histogram, bucket i counts commands that took less
+ * than 2^i microseconds (the last bucket takes everything slower).
+ */
+#define NVME_LAT_BUCKETS	24
+
+struct nvme_lat_hist {
+	u64 bucket[NVME_LAT_OPS][NVME_LAT_BUCKETS];
+};
+
 struct nvme_ns {
 	struct list_head list;
 
@@ -336,6 +355,8 @@ struct nvme_ns {
 #define NVME_NS_ANA_PENDING	2
 	u16 noiob;
 
+	struct nvme_lat_hist __percpu *lat_hist;
+
 #ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
 	struct nvme_fault_inject fault_inject;
 #endif
@@ -19,6 +19,7 @@
 #include "nvmet.h"
 
 struct workqueue_struct *buffered_io_wq;
+struct workqueue_struct *queued_io_wq;
 static const struct nvmet_fabrics_ops *nvmet_transports[NVMF_TRTYPE_MAX];
 static DEFINE_IDA(cntlid_ida);
 
@@ -496,6 +497,8 @@ struct nvmet_ns *nvmet_ns_alloc(struct nvmet_subsys *subsys, u32 nsid)
 
 	uuid_gen(&ns->uuid);
 	ns->buffered_io = false;
+	ns->queued_io = false;
+	ns->polled_io = false;
 
 	return ns;
 }
@@ -1229,6 +1232,13 @@ static int __init nvmet_init(void)
 		goto out;
 	}
 
+	queued_io_wq = alloc_workqueue("nvmet-queued-io-wq",
+			WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (!queued_io_wq) {
+		error = -ENOMEM;
+		goto out_free_buffered_io_wq;
+	}
+
 	error = nvmet_init_discovery();
 	if (error)
 		goto out_free_work_queue;
@@ -1241,6 +1251,8 @@ static int __init nvmet_init(void)
 out_exit_discovery:
 	nvmet_exit_discovery();
 out_free_work_queue:
+	destroy_workqueue(queued_io_wq);
+out_free_buffered_io_wq:
 	destroy_workqueue(buffered_io_wq);
 out:
 	return error;
@@ -1251,6 +1263,7 @@ static void __exit nvmet_exit(void)
 	nvmet_exit_configfs();
 	nvmet_exit_discovery();
 	ida_destroy(&cntlid_ida);
+	destroy_workqueue(queued_io_wq);
 	destroy_workqueue(buffered_io_wq);
 
 	BUILD_BUG_ON(sizeof(struct nvmf_disc_rsp_page_entry) != 1024);
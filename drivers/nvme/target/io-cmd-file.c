@@ -12,12 +12,74 @@
 
 #define NVMET_MAX_MPOOL_BVEC		16
 #define NVMET_MIN_MPOOL_OBJ		16
+#define NVMET_MAX_MERGE_BVEC		256
+
+/*
+ * Per-CPU submission context for queued_io namespaces.  Direct I/O
+ * commands issued on a CPU are collected here and submitted from one
+ * work item, which merges runs of sequential commands into one kiocb.
+ *
+ * With polled_io the work item submits synchronous IOCB_HIPRI kiocbs
+ * and spins on each until it completes, as only sync direct I/O polls.
+ * So a polled namespace has at most one kiocb (one command, or one
+ * merged run of them) outstanding per CPU; the rest wait on ->reqs.
+ * That trades queue depth for interrupt-free completions, and only pays
+ * off for low depth, latency bound workloads on fast devices.
+ */
+struct nvmet_file_queue {
+	spinlock_t		lock;
+	struct list_head	reqs;
+	struct work_struct	work;
+	struct nvmet_ns		*ns;
+};
+
+/* A kiocb covering several merged commands. */
+struct nvmet_file_batch {
+	struct kiocb		iocb;
+	struct list_head	reqs;
+	struct bio_vec		bvec[];
+};
+
+static void nvmet_file_queue_work(struct work_struct *w);
+
+static void nvmet_file_free_queues(struct nvmet_ns *ns)
+{
+	int cpu;
+
+	if (!ns->file_queues)
+		return;
+
+	for_each_possible_cpu(cpu)
+		flush_work(&per_cpu_ptr(ns->file_queues, cpu)->work);
+	free_percpu(ns->file_queues);
+	ns->file_queues = NULL;
+}
+
+static int nvmet_file_alloc_queues(struct nvmet_ns *ns)
+{
+	struct nvmet_file_queue *fq;
+	int cpu;
+
+	ns->file_queues = alloc_percpu(struct nvmet_file_queue);
+	if (!ns->file_queues)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		fq = per_cpu_ptr(ns->file_queues, cpu);
+		spin_lock_init(&fq->lock);
+		INIT_LIST_HEAD(&fq->reqs);
+		INIT_WORK(&fq->work, nvmet_file_queue_work);
+		fq->ns = ns;
+	}
+	return 0;
+}
 
 void nvmet_file_ns_disable(struct nvmet_ns *ns)
 {
 	if (ns->file) {
 		if (ns->buffered_io)
 			flush_workqueue(buffered_io_wq);
+		nvmet_file_free_queues(ns);
 		mempool_destroy(ns->bvec_pool);
 		ns->bvec_pool = NULL;
 		kmem_cache_destroy(ns->bvec_cache);
@@ -69,6 +131,12 @@ int nvmet_file_ns_enable(struct nvmet_ns *ns)
 		goto err;
 	}
 
+	if (!ns->buffered_io && (ns->queued_io || ns->polled_io)) {
+		ret = nvmet_file_alloc_queues(ns);
+		if (ret)
+			goto err;
+	}
+
 	return ret;
 err:
 	ns->size = 0;
@@ -84,18 +152,17 @@ static void nvmet_file_init_bvec(struct bio_vec *bv, struct sg_page_iter *iter)
 	bv->bv_len = PAGE_SIZE - iter->sg->offset;
 }
 
-static ssize_t nvmet_file_submit_bvec(struct nvmet_req *req, loff_t pos,
-		unsigned long nr_segs, size_t count)
+static ssize_t __nvmet_file_submit_bvec(struct nvmet_req *req,
+		struct kiocb *iocb, struct bio_vec *bvec, loff_t pos,
+		unsigned long nr_segs, size_t count, int ki_flags)
 {
-	struct kiocb *iocb = &req->f.iocb;
 	ssize_t (*call_iter)(struct kiocb *iocb, struct iov_iter *iter);
 	struct iov_iter iter;
-	int ki_flags = 0, rw;
-	ssize_t ret;
+	int rw;
 
 	if (req->cmd->rw.opcode == nvme_cmd_write) {
 		if (req->cmd->rw.control & cpu_to_le16(NVME_RW_FUA))
-			ki_flags = IOCB_DSYNC;
+			ki_flags |= IOCB_DSYNC;
 		call_iter = req->ns->file->f_op->write_iter;
 		rw = WRITE;
 	} else {
@@ -103,18 +170,20 @@ static ssize_t nvmet_file_submit_bvec(struct nvmet_req *req, loff_t pos,
 		rw = READ;
 	}
 
-	iov_iter_bvec(&iter, ITER_BVEC | rw, req->f.bvec, nr_segs, count);
+	iov_iter_bvec(&iter, ITER_BVEC | rw, bvec, nr_segs, count);
 
 	iocb->ki_pos = pos;
 	iocb->ki_filp = req->ns->file;
 	iocb->ki_flags = ki_flags | iocb_flags(req->ns->file);
 
-	ret = call_iter(iocb, &iter);
-
-	if (ret != -EIOCBQUEUED && iocb->ki_complete)
-		iocb->ki_complete(iocb, ret, 0);
+	return call_iter(iocb, &iter);
+}
 
-	return ret;
+static ssize_t nvmet_file_submit_bvec(struct nvmet_req *req, loff_t pos,
+		unsigned long nr_segs, size_t count, int ki_flags)
+{
+	return __nvmet_file_submit_bvec(req, &req->f.iocb, req->f.bvec, pos,
+			nr_segs, count, ki_flags);
 }
 
 static void nvmet_file_io_done(struct kiocb *iocb, long ret, long ret2)
@@ -132,26 +201,9 @@ static void nvmet_file_io_done(struct kiocb *iocb, long ret, long ret2)
 			NVME_SC_INTERNAL | NVME_SC_DNR : 0);
 }
 
-static void nvmet_file_execute_rw(struct nvmet_req *req)
+static void nvmet_file_alloc_bvec(struct nvmet_req *req)
 {
 	ssize_t nr_bvec = DIV_ROUND_UP(req->data_len, PAGE_SIZE);
-	struct sg_page_iter sg_pg_iter;
-	unsigned long bv_cnt = 0;
-	bool is_sync = false;
-	size_t len = 0, total_len = 0;
-	ssize_t ret = 0;
-	loff_t pos;
-
-	if (!req->sg_cnt || !nr_bvec) {
-		nvmet_req_complete(req, 0);
-		return;
-	}
-
-	pos = le64_to_cpu(req->cmd->rw.slba) << req->ns->blksize_shift;
-	if (unlikely(pos + req->data_len > req->ns->size)) {
-		nvmet_req_complete(req, NVME_SC_LBA_RANGE | NVME_SC_DNR);
-		return;
-	}
 
 	if (nr_bvec > NVMET_MAX_INLINE_BIOVEC)
 		req->f.bvec = kmalloc_array(nr_bvec, sizeof(struct bio_vec),
@@ -164,8 +216,30 @@ static void nvmet_file_execute_rw(struct nvmet_req *req)
 		/* fallback under memory pressure */
 		req->f.bvec = mempool_alloc(req->ns->bvec_pool, GFP_KERNEL);
 		req->f.mpool_alloc = true;
-		if (nr_bvec > NVMET_MAX_MPOOL_BVEC)
-			is_sync = true;
+	}
+}
+
+/*
+ * Returns false if an IOCB_NOWAIT submission would have blocked; the
+ * command is left untouched and must be resubmitted without the flag.
+ */
+static bool nvmet_file_execute_io(struct nvmet_req *req, int ki_flags)
+{
+	ssize_t nr_bvec = DIV_ROUND_UP(req->data_len, PAGE_SIZE);
+	struct sg_page_iter sg_pg_iter;
+	unsigned long bv_cnt = 0;
+	bool is_sync = false;
+	size_t len = 0, total_len = 0;
+	ssize_t ret = 0;
+	loff_t pos;
+
+	if (req->f.mpool_alloc && nr_bvec > NVMET_MAX_MPOOL_BVEC)
+		is_sync = true;
+
+	pos = le64_to_cpu(req->cmd->rw.slba) << req->ns->blksize_shift;
+	if (unlikely(pos + req->data_len > req->ns->size)) {
+		nvmet_req_complete(req, NVME_SC_LBA_RANGE | NVME_SC_DNR);
+		return true;
 	}
 
 	memset(&req->f.iocb, 0, sizeof(struct kiocb));
@@ -179,9 +253,9 @@ static void nvmet_file_execute_rw(struct nvmet_req *req)
 
 		if (unlikely(is_sync) &&
 		    (nr_bvec - 1 == 0 || bv_cnt == NVMET_MAX_MPOOL_BVEC)) {
-			ret = nvmet_file_submit_bvec(req, pos, bv_cnt, len);
+			ret = nvmet_file_submit_bvec(req, pos, bv_cnt, len, 0);
 			if (ret < 0)
-				goto out;
+				goto complete;
 			pos += len;
 			bv_cnt = 0;
 			len = 0;
@@ -189,30 +263,247 @@ static void nvmet_file_execute_rw(struct nvmet_req *req)
 		nr_bvec--;
 	}
 
-	if (WARN_ON_ONCE(total_len != req->data_len))
+	if (WARN_ON_ONCE(total_len != req->data_len)) {
 		ret = -EIO;
-out:
-	if (unlikely(is_sync || ret)) {
-		nvmet_file_io_done(&req->f.iocb, ret < 0 ? ret : total_len, 0);
-		return;
+		goto complete;
 	}
-	req->f.iocb.ki_complete = nvmet_file_io_done;
-	nvmet_file_submit_bvec(req, pos, bv_cnt, total_len);
+
+	if (unlikely(is_sync)) {
+		ret = total_len;
+		goto complete;
+	}
+
+	/*
+	 * A polled submission is a synchronous kiocb: the direct I/O code
+	 * spins on the device queue for IOCB_HIPRI instead of sleeping
+	 * until the completion interrupt, and the queue work item can't
+	 * submit anything else meanwhile (see struct nvmet_file_queue).
+	 */
+	if (!(ki_flags & IOCB_HIPRI))
+		req->f.iocb.ki_complete = nvmet_file_io_done;
+
+	ret = nvmet_file_submit_bvec(req, pos, bv_cnt, total_len, ki_flags);
+	if (ret == -EIOCBQUEUED)
+		return true;
+
+	/* A buffered read stops short at the first page not in the cache. */
+	if ((ki_flags & IOCB_NOWAIT) &&
+	    (ret == -EAGAIN || (ret >= 0 && ret < total_len)))
+		return false;
+
+complete:
+	nvmet_file_io_done(&req->f.iocb, ret, 0);
+	return true;
 }
 
 static void nvmet_file_buffered_io_work(struct work_struct *w)
 {
 	struct nvmet_req *req = container_of(w, struct nvmet_req, f.work);
 
-	nvmet_file_execute_rw(req);
+	nvmet_file_execute_io(req, 0);
 }
 
-static void nvmet_file_execute_rw_buffered_io(struct nvmet_req *req)
+static void nvmet_file_submit_buffered_io(struct nvmet_req *req)
 {
 	INIT_WORK(&req->f.work, nvmet_file_buffered_io_work);
 	queue_work(buffered_io_wq, &req->f.work);
 }
 
+static void nvmet_file_batch_done(struct kiocb *iocb, long ret, long ret2)
+{
+	struct nvmet_file_batch *batch =
+		container_of(iocb, struct nvmet_file_batch, iocb);
+	struct nvmet_req *req, *next;
+
+	/* A short transfer fails every command it did not fully cover. */
+	list_for_each_entry_safe(req, next, &batch->reqs, f.entry) {
+		u16 status = 0;
+
+		if (ret < (long)req->data_len) {
+			status = NVME_SC_INTERNAL | NVME_SC_DNR;
+			ret = 0;
+		} else {
+			ret -= req->data_len;
+		}
+		list_del(&req->f.entry);
+		nvmet_req_complete(req, status);
+	}
+	kfree(batch);
+}
+
+static void nvmet_file_submit_single(struct nvmet_req *req, int ki_flags)
+{
+	list_del(&req->f.entry);
+	nvmet_file_alloc_bvec(req);
+	nvmet_file_execute_io(req, ki_flags);
+}
+
+static struct nvmet_file_batch *nvmet_file_build_batch(struct list_head *run,
+		unsigned int nr_bvec, unsigned long *bv_cnt)
+{
+	struct nvmet_file_batch *batch;
+	struct sg_page_iter sg_pg_iter;
+	struct nvmet_req *req;
+	size_t len;
+
+	batch = kmalloc(struct_size(batch, bvec, nr_bvec), GFP_KERNEL);
+	if (!batch)
+		return NULL;
+
+	*bv_cnt = 0;
+	list_for_each_entry(req, run, f.entry) {
+		len = 0;
+		for_each_sg_page(req->sg, &sg_pg_iter, req->sg_cnt, 0) {
+			if (WARN_ON_ONCE(*bv_cnt == nr_bvec))
+				goto free_batch;
+			nvmet_file_init_bvec(&batch->bvec[*bv_cnt], &sg_pg_iter);
+			len += batch->bvec[*bv_cnt].bv_len;
+			(*bv_cnt)++;
+		}
+		/* Every command must fill its range for the next to follow. */
+		if (len != req->data_len)
+			goto free_batch;
+	}
+
+	memset(&batch->iocb, 0, sizeof(struct kiocb));
+	INIT_LIST_HEAD(&batch->reqs);
+	list_splice_init(run, &batch->reqs);
+	return batch;
+
+free_batch:
+	kfree(batch);
+	return NULL;
+}
+
+static void nvmet_file_submit_run(struct nvmet_ns *ns, struct list_head *run,
+		unsigned int nr_bvec, size_t count)
+{
+	int ki_flags = ns->polled_io ? IOCB_HIPRI : 0;
+	struct nvmet_req *req, *next;
+	struct nvmet_file_batch *batch;
+	unsigned long bv_cnt;
+	ssize_t ret;
+
+	req = list_first_entry(run, struct nvmet_req, f.entry);
+	if (list_is_singular(run)) {
+		nvmet_file_submit_single(req, ki_flags);
+		return;
+	}
+
+	batch = nvmet_file_build_batch(run, nr_bvec, &bv_cnt);
+	if (!batch) {
+		list_for_each_entry_safe(req, next, run, f.entry)
+			nvmet_file_submit_single(req, ki_flags);
+		return;
+	}
+
+	if (!(ki_flags & IOCB_HIPRI))
+		batch->iocb.ki_complete = nvmet_file_batch_done;
+
+	ret = __nvmet_file_submit_bvec(req, &batch->iocb, batch->bvec,
+			req->f.pos, bv_cnt, count, ki_flags);
+	if (ret != -EIOCBQUEUED)
+		nvmet_file_batch_done(&batch->iocb, ret, 0);
+}
+
+static bool nvmet_file_can_merge(struct nvmet_req *prev, struct nvmet_req *req,
+		unsigned int nr_bvec)
+{
+	__le16 fua = cpu_to_le16(NVME_RW_FUA);
+
+	return req->cmd->rw.opcode == prev->cmd->rw.opcode &&
+		(req->cmd->rw.control & fua) == (prev->cmd->rw.control & fua) &&
+		prev->f.pos + prev->data_len == req->f.pos &&
+		nr_bvec + DIV_ROUND_UP(req->data_len, PAGE_SIZE) <=
+			NVMET_MAX_MERGE_BVEC;
+}
+
+static void nvmet_file_queue_work(struct work_struct *w)
+{
+	struct nvmet_file_queue *fq =
+		container_of(w, struct nvmet_file_queue, work);
+	struct nvmet_ns *ns = fq->ns;
+	struct nvmet_req *req, *next, *prev = NULL;
+	unsigned int nr_bvec = 0;
+	size_t count = 0;
+	LIST_HEAD(reqs);
+	LIST_HEAD(run);
+
+	spin_lock_bh(&fq->lock);
+	list_splice_init(&fq->reqs, &reqs);
+	spin_unlock_bh(&fq->lock);
+
+	list_for_each_entry_safe(req, next, &reqs, f.entry) {
+		if (prev && !nvmet_file_can_merge(prev, req, nr_bvec)) {
+			nvmet_file_submit_run(ns, &run, nr_bvec, count);
+			nr_bvec = 0;
+			count = 0;
+		}
+		list_move_tail(&req->f.entry, &run);
+		nr_bvec += DIV_ROUND_UP(req->data_len, PAGE_SIZE);
+		count += req->data_len;
+		prev = req;
+	}
+
+	if (!list_empty(&run))
+		nvmet_file_submit_run(ns, &run, nr_bvec, count);
+}
+
+static void nvmet_file_queue_rw(struct nvmet_req *req)
+{
+	struct nvmet_ns *ns = req->ns;
+	struct nvmet_file_queue *fq;
+	bool kick;
+	int cpu;
+
+	req->f.pos = le64_to_cpu(req->cmd->rw.slba) << ns->blksize_shift;
+	if (unlikely(req->f.pos + req->data_len > ns->size)) {
+		nvmet_req_complete(req, NVME_SC_LBA_RANGE | NVME_SC_DNR);
+		return;
+	}
+
+	cpu = get_cpu();
+	fq = per_cpu_ptr(ns->file_queues, cpu);
+	spin_lock_bh(&fq->lock);
+	kick = list_empty(&fq->reqs);
+	list_add_tail(&req->f.entry, &fq->reqs);
+	spin_unlock_bh(&fq->lock);
+	if (kick)
+		queue_work_on(cpu, queued_io_wq, &fq->work);
+	put_cpu();
+}
+
+static void nvmet_file_execute_rw(struct nvmet_req *req)
+{
+	ssize_t nr_bvec = DIV_ROUND_UP(req->data_len, PAGE_SIZE);
+
+	if (!req->sg_cnt || !nr_bvec) {
+		nvmet_req_complete(req, 0);
+		return;
+	}
+
+	if (req->ns->file_queues) {
+		nvmet_file_queue_rw(req);
+		return;
+	}
+
+	nvmet_file_alloc_bvec(req);
+
+	if (req->ns->buffered_io) {
+		/*
+		 * Reads that hit the page cache complete inline, everything
+		 * else goes to the buffered I/O workqueue.
+		 */
+		if (req->cmd->rw.opcode == nvme_cmd_read &&
+		    likely(!req->f.mpool_alloc) &&
+		    nvmet_file_execute_io(req, IOCB_NOWAIT))
+			return;
+		nvmet_file_submit_buffered_io(req);
+	} else {
+		nvmet_file_execute_io(req, 0);
+	}
+}
+
 u16 nvmet_file_flush(struct nvmet_req *req)
 {
 	if (vfs_fsync(req->ns->file, 1) < 0)
@@ -322,10 +613,7 @@ u16 nvmet_file_parse_io_cmd(struct nvmet_req *req)
 	switch (cmd->common.opcode) {
 	case nvme_cmd_read:
 	case nvme_cmd_write:
-		if (req->ns->buffered_io)
-			req->execute = nvmet_file_execute_rw_buffered_io;
-		else
-			req->execute = nvmet_file_execute_rw;
+		req->execute = nvmet_file_execute_rw;
 		req->data_len = nvmet_rw_len(req);
 		return 0;
 	case nvme_cmd_flush:
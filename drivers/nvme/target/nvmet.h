@@ -67,6 +67,8 @@ struct nvmet_ns {
 	u32			anagrpid;
 
 	bool			buffered_io;
+	bool			queued_io;
+	bool			polled_io;
 	bool			enabled;
 	struct nvmet_subsys	*subsys;
 	const char		*device_path;
@@ -77,6 +79,7 @@ struct nvmet_ns {
 	struct completion	disable_done;
 	mempool_t		*bvec_pool;
 	struct kmem_cache	*bvec_cache;
+	struct nvmet_file_queue __percpu *file_queues;
 };
 
 static inline struct nvmet_ns *to_nvmet_ns(struct config_item *item)
@@ -282,6 +285,8 @@ struct nvmet_req {
 			struct kiocb            iocb;
 			struct bio_vec          *bvec;
 			struct work_struct      work;
+			struct list_head	entry;
+			loff_t			pos;
 		} f;
 	};
 	int			sg_cnt;
@@ -297,6 +302,7 @@ struct nvmet_req {
 };
 
 extern struct workqueue_struct *buffered_io_wq;
+extern struct workqueue_struct *queued_io_wq;
 
 static inline void nvmet_set_status(struct nvmet_req *req, u16 status)
 {
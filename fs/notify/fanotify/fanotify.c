@@ -13,6 +13,7 @@
 #include <linux/wait.h>
 #include <linux/audit.h>
 #include <linux/sched/mm.h>
+#include <linux/hash.h>
 
 #include "fanotify.h"
 
@@ -57,6 +58,30 @@ static int fanotify_merge(struct list_head *list, struct fsnotify_event *event)
 	return 0;
 }
 
+/*
+ * Same decision as fanotify_merge(), but on the latest queued event for the
+ * object found through the group's merge hash instead of a list scan.
+ */
+static int fanotify_merge_hashed(struct fsnotify_event *old,
+				 struct fsnotify_event *new)
+{
+	if (!should_merge(old, new))
+		return FSNOTIFY_MERGE_OTHER;
+
+	old->mask |= new->mask;
+	return FSNOTIFY_MERGE_DONE;
+}
+
+static u32 fanotify_merge_key(struct fanotify_event_info *event)
+{
+	unsigned long key = (unsigned long)event->fse.inode ^
+			    (unsigned long)event->path.mnt ^
+			    (unsigned long)event->path.dentry ^
+			    (unsigned long)event->tgid;
+
+	return hash_long(key, 32) ?: 1;
+}
+
 static int fanotify_get_response(struct fsnotify_group *group,
 				 struct fanotify_perm_event_info *event,
 				 struct fsnotify_iter_info *iter_info)
@@ -239,6 +264,9 @@ static int fanotify_handle_event(struct fsnotify_group *group,
 	}
 
 	fsn_event = &event->fse;
+	/* permission events are never merged */
+	if (!fanotify_is_perm_event(mask))
+		fsn_event->merge_key = fanotify_merge_key(event);
 	ret = fsnotify_add_event(group, fsn_event, fanotify_merge);
 	if (ret) {
 		/* Permission events shouldn't be merged */
@@ -293,4 +321,5 @@ const struct fsnotify_ops fanotify_fsnotify_ops = {
 	.free_group_priv = fanotify_free_group_priv,
 	.free_event = fanotify_free_event,
 	.free_mark = fanotify_free_mark,
+	.merge_hashed = fanotify_merge_hashed,
 };
@@ -28,6 +28,12 @@ static void show_fdinfo(struct seq_file *m, struct file *f,
 	struct fsnotify_group *group = f->private_data;
 	struct fsnotify_mark *mark;
 
+	spin_lock(&group->notification_lock);
+	seq_printf(m, "queue len:%u max-len:%u queued:%lu merged:%lu overflows:%lu\n",
+		   group->q_len, group->q_len_max, group->q_queued,
+		   group->q_merged, group->q_overflows);
+	spin_unlock(&group->notification_lock);
+
 	mutex_lock(&group->mark_mutex);
 	list_for_each_entry(mark, &group->marks_list, g_list) {
 		show(m, mark);
@@ -39,6 +39,7 @@ static void fsnotify_final_destroy_group(struct fsnotify_group *group)
 
 	mem_cgroup_put(group->memcg);
 
+	kfree(group->merge_hash);
 	kfree(group);
 }
 
@@ -148,6 +149,16 @@ struct fsnotify_group *fsnotify_alloc_group(const struct fsnotify_ops *ops)
 
 	group->ops = ops;
 
+	if (ops->merge_hashed) {
+		group->merge_hash = kcalloc(FSNOTIFY_MERGE_HASH_SIZE,
+					    sizeof(struct hlist_head),
+					    GFP_KERNEL);
+		if (!group->merge_hash) {
+			kfree(group);
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+
 	return group;
 }
 
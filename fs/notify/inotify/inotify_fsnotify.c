@@ -32,6 +32,8 @@
 #include <linux/sched.h>
 #include <linux/sched/user.h>
 #include <linux/sched/mm.h>
+#include <linux/hash.h>
+#include <linux/stringhash.h>
 
 #include "inotify.h"
 
@@ -64,6 +66,40 @@ static int inotify_merge(struct list_head *list,
 	return event_compare(last_event, event);
 }
 
+/*
+ * Hashed coalescing: the object of an inotify event is the watched inode
+ * plus the name of the child, if any.  Only identical events merge, and
+ * rename events never do since their cookies pair them up.
+ */
+static int inotify_merge_hashed(struct fsnotify_event *old_fsn,
+				struct fsnotify_event *new_fsn)
+{
+	struct inotify_event_info *old = INOTIFY_E(old_fsn);
+	struct inotify_event_info *new = INOTIFY_E(new_fsn);
+
+	if (old_fsn->inode != new_fsn->inode ||
+	    old->name_len != new->name_len ||
+	    (old->name_len && strcmp(old->name, new->name)))
+		return FSNOTIFY_MERGE_OTHER;
+
+	if (old->sync_cookie || new->sync_cookie ||
+	    !event_compare(old_fsn, new_fsn))
+		return FSNOTIFY_MERGE_NONE;
+
+	return FSNOTIFY_MERGE_DONE;
+}
+
+static u32 inotify_merge_key(struct inode *inode, const unsigned char *name,
+			     int len)
+{
+	u32 key = hash_ptr(inode, 32);
+
+	if (len)
+		key ^= full_name_hash(NULL, name, len);
+
+	return key ?: 1;
+}
+
 int inotify_handle_event(struct fsnotify_group *group,
 			 struct inode *inode,
 			 u32 mask, const void *data, int data_type,
@@ -119,6 +155,7 @@ int inotify_handle_event(struct fsnotify_group *group,
 
 	fsn_event = &event->fse;
 	fsnotify_init_event(fsn_event, inode, mask);
+	fsn_event->merge_key = inotify_merge_key(inode, file_name, len);
 	event->wd = i_mark->wd;
 	event->sync_cookie = cookie;
 	event->name_len = len;
@@ -207,4 +244,5 @@ const struct fsnotify_ops inotify_fsnotify_ops = {
 	.free_event = inotify_free_event,
 	.freeing_mark = inotify_freeing_mark,
 	.free_mark = inotify_free_mark,
+	.merge_hashed = inotify_merge_hashed,
 };
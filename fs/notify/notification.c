@@ -42,6 +42,7 @@
 #include <linux/path.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/hash.h>
 
 #include <linux/atomic.h>
 
@@ -87,12 +88,51 @@ void fsnotify_destroy_event(struct fsnotify_group *group,
 	group->ops->free_event(event);
 }
 
+static struct hlist_head *fsnotify_merge_bucket(struct fsnotify_group *group,
+						struct fsnotify_event *event)
+{
+	return &group->merge_hash[hash_32(event->merge_key,
+					  FSNOTIFY_MERGE_HASH_BITS)];
+}
+
+/*
+ * Try to fold @event into the latest queued event for the same object,
+ * wherever it is in the queue.  Only the latest event of each object is
+ * hashed, so merging never reorders events about one object.
+ */
+static int fsnotify_merge_hashed(struct fsnotify_group *group,
+				 struct fsnotify_event *event)
+{
+	struct fsnotify_event *old;
+
+	hlist_for_each_entry(old, fsnotify_merge_bucket(group, event),
+			     merge_node) {
+		if (old->merge_key != event->merge_key)
+			continue;
+
+		switch (group->ops->merge_hashed(old, event)) {
+		case FSNOTIFY_MERGE_DONE:
+			return 1;
+		case FSNOTIFY_MERGE_NONE:
+			/* @event becomes the latest for this object */
+			hlist_del_init(&old->merge_node);
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
 /*
  * Add an event to the group notification queue.  The group can later pull this
  * event off the queue to deal with.  The function returns 0 if the event was
  * added to the queue, 1 if the event was merged with some other queued event,
  * 2 if the event was not queued - either the queue of events has overflown
  * or the group is shutting down.
+ *
+ * Groups providing ops->merge_hashed get events with a merge_key coalesced
+ * anywhere in the queue through a hash; others only through @merge, which
+ * is handed the whole list.
  */
 int fsnotify_add_event(struct fsnotify_group *group,
 		       struct fsnotify_event *event,
@@ -101,6 +141,7 @@ int fsnotify_add_event(struct fsnotify_group *group,
 {
 	int ret = 0;
 	struct list_head *list = &group->notification_list;
+	bool hashed = group->merge_hash && event->merge_key;
 
 	pr_debug("%s: group=%p event=%p\n", __func__, group, event);
 
@@ -114,26 +155,36 @@ int fsnotify_add_event(struct fsnotify_group *group,
 	if (event == group->overflow_event ||
 	    group->q_len >= group->max_events) {
 		ret = 2;
+		group->q_overflows++;
 		/* Queue overflow event only if it isn't already queued */
 		if (!list_empty(&group->overflow_event->list)) {
 			spin_unlock(&group->notification_lock);
 			return ret;
 		}
 		event = group->overflow_event;
+		hashed = false;
 		goto queue;
 	}
 
-	if (!list_empty(list) && merge) {
+	if (hashed)
+		ret = fsnotify_merge_hashed(group, event);
+	else if (!list_empty(list) && merge)
 		ret = merge(list, event);
-		if (ret) {
-			spin_unlock(&group->notification_lock);
-			return ret;
-		}
+	if (ret) {
+		group->q_merged++;
+		spin_unlock(&group->notification_lock);
+		return ret;
 	}
 
 queue:
 	group->q_len++;
+	group->q_queued++;
+	if (group->q_len > group->q_len_max)
+		group->q_len_max = group->q_len;
 	list_add_tail(&event->list, list);
+	if (hashed)
+		hlist_add_head(&event->merge_node,
+			       fsnotify_merge_bucket(group, event));
 	spin_unlock(&group->notification_lock);
 
 	wake_up(&group->notification_waitq);
@@ -160,6 +211,8 @@ struct fsnotify_event *fsnotify_remove_first_event(struct fsnotify_group *group)
 	 * check in fsnotify_add_event() works
 	 */
 	list_del_init(&event->list);
+	if (!hlist_unhashed(&event->merge_node))
+		hlist_del_init(&event->merge_node);
 	group->q_len--;
 
 	return event;
@@ -211,6 +264,8 @@ void fsnotify_init_event(struct fsnotify_event *event, struct inode *inode,
 			 u32 mask)
 {
 	INIT_LIST_HEAD(&event->list);
+	INIT_HLIST_NODE(&event->merge_node);
 	event->inode = inode;
 	event->mask = mask;
+	event->merge_key = 0;
 }
@@ -21,6 +21,8 @@
 #include <linux/fdtable.h>
 #include <linux/ratelimit.h>
 #include <linux/exportfs.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 #include "overlayfs.h"
 
 #define OVL_COPY_UP_CHUNK_SIZE (1 << 20)
@@ -120,12 +122,166 @@ int ovl_copy_xattr(struct dentry *old, struct dentry *new)
 	return error;
 }
 
+/*
+ * Copy [pos, end) of old_file to the same offsets of new_file, skipping
+ * ranges that are holes in old_file.  @abort is NULL when called from the
+ * copying task itself, otherwise it is polled between chunks.
+ */
+static int ovl_copy_up_range(struct file *old_file, struct file *new_file,
+			     loff_t pos, loff_t end, bool *abort)
+{
+	bool skip_holes = true;
+
+	while (pos < end) {
+		loff_t old_pos, new_pos, data;
+		size_t this_len;
+		long bytes;
+
+		if (abort ? READ_ONCE(*abort) :
+			    signal_pending_state(TASK_KILLABLE, current))
+			return -EINTR;
+
+		if (skip_holes) {
+			data = vfs_llseek(old_file, pos, SEEK_DATA);
+			/* -ENXIO: nothing but hole up to EOF */
+			if (data == -ENXIO)
+				return 0;
+			if (data < 0)
+				skip_holes = false;
+			else if (data >= end)
+				return 0;
+			else
+				pos = data;
+		}
+
+		this_len = min_t(loff_t, end - pos, OVL_COPY_UP_CHUNK_SIZE);
+		old_pos = new_pos = pos;
+		bytes = do_splice_direct(old_file, &old_pos,
+					 new_file, &new_pos,
+					 this_len, SPLICE_F_MOVE);
+		if (bytes <= 0)
+			return bytes;
+		WARN_ON(old_pos != new_pos);
+
+		pos += bytes;
+	}
+
+	return 0;
+}
+
+static unsigned int ovl_copy_up_threads = 4;
+module_param_named(copy_up_threads, ovl_copy_up_threads, uint, 0644);
+MODULE_PARM_DESC(ovl_copy_up_threads,
+		 "Number of concurrent chunk copies for large cross-fs copy up (0/1 = serial)");
+
+static unsigned int ovl_copy_up_parallel_mb = 64;
+module_param_named(copy_up_parallel_mb, ovl_copy_up_parallel_mb, uint, 0644);
+MODULE_PARM_DESC(ovl_copy_up_parallel_mb,
+		 "Minimum file size in MiB for parallel copy up");
+
+struct ovl_copy_up_par;
+
+struct ovl_copy_up_job {
+	struct work_struct work;
+	struct ovl_copy_up_par *par;
+	loff_t pos;
+	loff_t end;
+};
+
+struct ovl_copy_up_par {
+	struct file *old_file;
+	struct file *new_file;
+	const struct cred *cred;
+	atomic_t pending;
+	struct completion done;
+	bool abort;
+	int error;
+	struct ovl_copy_up_job jobs[];
+};
+
+static void ovl_copy_up_job_fn(struct work_struct *work)
+{
+	struct ovl_copy_up_job *job =
+		container_of(work, struct ovl_copy_up_job, work);
+	struct ovl_copy_up_par *par = job->par;
+	const struct cred *old_cred;
+	int err;
+
+	old_cred = override_creds(par->cred);
+	err = ovl_copy_up_range(par->old_file, par->new_file,
+				job->pos, job->end, &par->abort);
+	revert_creds(old_cred);
+
+	if (err) {
+		cmpxchg(&par->error, 0, err);
+		WRITE_ONCE(par->abort, true);
+	}
+	if (atomic_dec_and_test(&par->pending))
+		complete(&par->done);
+}
+
+/*
+ * Split a large copy into stripes copied concurrently from the unbound
+ * workqueue.  Writes to the upper file still serialize on its i_rwsem, so
+ * the gain comes from overlapping the (usually slower) lower reads.
+ * Returns -EAGAIN if the copy should be done serially instead.
+ */
+static int ovl_copy_up_parallel(struct file *old_file, struct file *new_file,
+				loff_t len)
+{
+	struct ovl_copy_up_par *par;
+	unsigned int nr = READ_ONCE(ovl_copy_up_threads);
+	loff_t stripe, pos = 0;
+	unsigned int i;
+	int err;
+
+	if (nr < 2 || len < ((loff_t)READ_ONCE(ovl_copy_up_parallel_mb) << 20))
+		return -EAGAIN;
+
+	nr = min_t(loff_t, nr, DIV_ROUND_UP_ULL(len, OVL_COPY_UP_CHUNK_SIZE));
+	stripe = round_up(DIV_ROUND_UP_ULL(len, nr), OVL_COPY_UP_CHUNK_SIZE);
+
+	par = kzalloc(struct_size(par, jobs, nr), GFP_KERNEL);
+	if (!par)
+		return -EAGAIN;
+
+	par->old_file = old_file;
+	par->new_file = new_file;
+	par->cred = get_current_cred();
+	init_completion(&par->done);
+	atomic_set(&par->pending, 1);
+
+	for (i = 0; i < nr && pos < len; i++) {
+		struct ovl_copy_up_job *job = &par->jobs[i];
+
+		job->par = par;
+		job->pos = pos;
+		job->end = min(pos + stripe, len);
+		pos = job->end;
+		INIT_WORK(&job->work, ovl_copy_up_job_fn);
+		atomic_inc(&par->pending);
+		queue_work(system_unbound_wq, &job->work);
+	}
+	if (atomic_dec_and_test(&par->pending))
+		complete(&par->done);
+
+	if (wait_for_completion_killable(&par->done)) {
+		WRITE_ONCE(par->abort, true);
+		wait_for_completion(&par->done);
+		cmpxchg(&par->error, 0, -EINTR);
+	}
+
+	err = par->error;
+	put_cred(par->cred);
+	kfree(par);
+	return err;
+}
+
 static int ovl_copy_up_data(struct path *old, struct path *new, loff_t len)
 {
 	struct file *old_file;
 	struct file *new_file;
-	loff_t old_pos = 0;
-	loff_t new_pos = 0;
+	struct inode *inode;
 	int error = 0;
 
 	if (len == 0)
@@ -146,31 +302,23 @@ static int ovl_copy_up_data(struct path *old, struct path *new, loff_t len)
 	if (!error)
 		goto out;
 	/* Couldn't clone, so now we try to copy the data */
-	error = 0;
-
-	/* FIXME: copy up sparse files efficiently */
-	while (len) {
-		size_t this_len = OVL_COPY_UP_CHUNK_SIZE;
-		long bytes;
-
-		if (len < this_len)
-			this_len = len;
-
-		if (signal_pending_state(TASK_KILLABLE, current)) {
-			error = -EINTR;
-			break;
-		}
+	error = ovl_copy_up_parallel(old_file, new_file, len);
+	if (error == -EAGAIN)
+		error = ovl_copy_up_range(old_file, new_file, 0, len, NULL);
+	if (error)
+		goto out;
 
-		bytes = do_splice_direct(old_file, &old_pos,
-					 new_file, &new_pos,
-					 this_len, SPLICE_F_MOVE);
-		if (bytes <= 0) {
-			error = bytes;
-			break;
-		}
-		WARN_ON(old_pos != new_pos);
+	/* Holes were skipped, a trailing one still needs the size set */
+	inode = file_inode(new_file);
+	if (i_size_read(inode) < len) {
+		struct iattr attr = {
+			.ia_valid = ATTR_SIZE,
+			.ia_size = len,
+		};
 
-		len -= bytes;
+		inode_lock(inode);
+		error = notify_change(new_file->f_path.dentry, &attr, NULL);
+		inode_unlock(inode);
 	}
 out:
 	if (!error)
@@ -757,9 +905,68 @@ static int ovl_copy_up_meta_inode_data(struct ovl_copy_up_ctx *c)
 	return err;
 }
 
+static bool ovl_lazy_data_copy_up;
+module_param_named(lazy_data_copy_up, ovl_lazy_data_copy_up, bool, 0644);
+MODULE_PARM_DESC(ovl_lazy_data_copy_up,
+		 "Copy data of metacopy-only copied up files in the background");
+
+struct ovl_lazy_copy_up {
+	struct work_struct work;
+	struct dentry *dentry;
+	const struct cred *cred;
+};
+
+static void ovl_lazy_copy_up_fn(struct work_struct *work)
+{
+	struct ovl_lazy_copy_up *lc =
+		container_of(work, struct ovl_lazy_copy_up, work);
+	struct dentry *dentry = lc->dentry;
+	struct super_block *sb = dentry->d_sb;
+	const struct cred *old_cred;
+	int err;
+
+	old_cred = override_creds(lc->cred);
+	err = ovl_want_write(dentry);
+	if (!err) {
+		/* Races with an open for write are settled by ovl_copy_up_start */
+		err = ovl_copy_up_with_data(dentry);
+		ovl_drop_write(dentry);
+	}
+	revert_creds(old_cred);
+	if (err)
+		pr_warn_ratelimited("overlayfs: lazy data copy up of %pd2 failed (%i)\n",
+				    dentry, err);
+
+	put_cred(lc->cred);
+	dput(dentry);
+	deactivate_super(sb);
+	kfree(lc);
+}
+
+/*
+ * Schedule copy up of data for a file that was just copied up metadata
+ * only, so that the first open for write does not have to wait for it.
+ * Best effort: if this fails, data is copied up on open for write as usual.
+ */
+static void ovl_queue_lazy_copy_up(struct dentry *dentry)
+{
+	struct ovl_lazy_copy_up *lc;
+
+	lc = kmalloc(sizeof(*lc), GFP_KERNEL);
+	if (!lc)
+		return;
+
+	atomic_inc(&dentry->d_sb->s_active);
+	lc->dentry = dget(dentry);
+	lc->cred = get_current_cred();
+	INIT_WORK(&lc->work, ovl_lazy_copy_up_fn);
+	queue_work(system_unbound_wq, &lc->work);
+}
+
 static int ovl_copy_up_one(struct dentry *parent, struct dentry *dentry,
 			   int flags)
 {
+	bool lazy = false;
 	int err;
 	DEFINE_DELAYED_CALL(done);
 	struct path parentpath;
@@ -808,13 +1015,18 @@ static int ovl_copy_up_one(struct dentry *parent, struct dentry *dentry,
 		if (err > 0)
 			err = 0;
 	} else {
-		if (!ovl_dentry_upper(dentry))
+		if (!ovl_dentry_upper(dentry)) {
 			err = ovl_do_copy_up(&ctx);
+			lazy = !err && ctx.metacopy && ctx.stat.size &&
+			       READ_ONCE(ovl_lazy_data_copy_up);
+		}
 		if (!err && parent && !ovl_dentry_has_upper_alias(dentry))
 			err = ovl_link_up(&ctx);
 		if (!err && ovl_dentry_needs_data_copy_up_locked(dentry, flags))
 			err = ovl_copy_up_meta_inode_data(&ctx);
 		ovl_copy_up_end(dentry);
+		if (!err && lazy)
+			ovl_queue_lazy_copy_up(dentry);
 	}
 	do_delayed_call(&done);
 
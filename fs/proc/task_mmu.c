@@ -22,6 +22,7 @@
 #include <linux/mm_inline.h>
 #include <linux/ctype.h>
 #include <linux/export.h>
+#include <linux/compat.h>
 
 #include <asm/elf.h>
 #include <asm/tlb.h>
@@ -924,6 +925,37 @@ static int show_smaps_rollup(struct seq_file *m, void *v)
 
 	return ret;
 }
+
+/*
+ * smaps_rollup_fast: just the numbers the mm already keeps, in the
+ * smaps_rollup format.  No page table walk, so there is no Pss (it needs
+ * the mapcount of every page) and no clean/dirty or referenced breakdown.
+ */
+static int show_smaps_rollup_fast(struct seq_file *m, void *v)
+{
+	struct proc_maps_private *priv = m->private;
+	unsigned long anon, file, shmem, swap;
+	struct mm_struct *mm = priv->mm;
+
+	if (!mm || !mmget_not_zero(mm))
+		return -ESRCH;
+
+	anon = get_mm_counter(mm, MM_ANONPAGES);
+	file = get_mm_counter(mm, MM_FILEPAGES);
+	shmem = get_mm_counter(mm, MM_SHMEMPAGES);
+	swap = get_mm_counter(mm, MM_SWAPENTS);
+	mmput(mm);
+
+	seq_puts(m, "[rollup]\n");
+	SEQ_PUT_DEC("Rss:            ", (anon + file + shmem) << PAGE_SHIFT);
+	SEQ_PUT_DEC(" kB\nRssAnon:        ", anon << PAGE_SHIFT);
+	SEQ_PUT_DEC(" kB\nRssFile:        ", file << PAGE_SHIFT);
+	SEQ_PUT_DEC(" kB\nRssShmem:       ", shmem << PAGE_SHIFT);
+	SEQ_PUT_DEC(" kB\nSwap:           ", swap << PAGE_SHIFT);
+	seq_puts(m, " kB\n");
+
+	return 0;
+}
 #undef SEQ_PUT_DEC
 
 static const struct seq_operations proc_pid_smaps_op = {
@@ -938,7 +970,8 @@ static int pid_smaps_open(struct inode *inode, struct file *file)
 	return do_maps_open(inode, file, &proc_pid_smaps_op);
 }
 
-static int smaps_rollup_open(struct inode *inode, struct file *file)
+static int __smaps_rollup_open(struct inode *inode, struct file *file,
+			       int (*show)(struct seq_file *, void *))
 {
 	int ret;
 	struct proc_maps_private *priv;
@@ -947,7 +980,7 @@ static int smaps_rollup_open(struct inode *inode, struct file *file)
 	if (!priv)
 		return -ENOMEM;
 
-	ret = single_open(file, show_smaps_rollup, priv);
+	ret = single_open(file, show, priv);
 	if (ret)
 		goto out_free;
 
@@ -967,6 +1000,16 @@ static int smaps_rollup_open(struct inode *inode, struct file *file)
 	return ret;
 }
 
+static int smaps_rollup_open(struct inode *inode, struct file *file)
+{
+	return __smaps_rollup_open(inode, file, show_smaps_rollup);
+}
+
+static int smaps_rollup_fast_open(struct inode *inode, struct file *file)
+{
+	return __smaps_rollup_open(inode, file, show_smaps_rollup_fast);
+}
+
 static int smaps_rollup_release(struct inode *inode, struct file *file)
 {
 	struct seq_file *seq = file->private_data;
@@ -993,6 +1036,13 @@ const struct file_operations proc_pid_smaps_rollup_operations = {
 	.release	= smaps_rollup_release,
 };
 
+const struct file_operations proc_pid_smaps_rollup_fast_operations = {
+	.open		= smaps_rollup_fast_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= smaps_rollup_release,
+};
+
 enum clear_refs_types {
 	CLEAR_REFS_ALL = 1,
 	CLEAR_REFS_ANON,
@@ -1638,6 +1688,359 @@ static ssize_t pagemap_read(struct file *file, char __user *buf,
 	return ret;
 }
 
+/*
+ * PAGEMAP_SCAN - run length encoded view of the pagemap
+ *
+ * Working set estimation only cares about a handful of per-page states, and
+ * neighbouring pages tend to share them, so rather than one 64-bit entry per
+ * page report ranges of pages with identical categories.  Only pages in one
+ * of the categories of the caller's category_mask are reported; by default
+ * that is present or swapped pages, so holes are skipped even when the VMA
+ * is soft-dirty.  With PM_SCAN_CLEAR_YOUNG the accessed
+ * bit of every reported page is cleared under the page table lock as it is
+ * read, so the result and the reset are consistent with each other.  Unlike
+ * clear_refs, PG_referenced is left alone: this is meant to be run
+ * continuously and shouldn't disturb LRU aging.
+ */
+#define PM_SCAN_CATEGORIES	(PAGE_IS_PRESENT | PAGE_IS_SWAPPED |	\
+				 PAGE_IS_SOFT_DIRTY | PAGE_IS_YOUNG |	\
+				 PAGE_IS_FILE)
+
+struct pagemap_scan_private {
+	struct page_region cur;		/* run being built */
+	struct page_region *buf;	/* completed runs, not yet copied out */
+	unsigned long nr;
+	unsigned long max;
+	unsigned long walk_end;
+	u64 category_mask;
+	bool clear_young;
+	bool cleared;
+};
+
+/*
+ * Whether a page with these categories ends up in the output; only those
+ * may have their accessed bit cleared.
+ */
+static bool pagemap_scan_wanted(struct pagemap_scan_private *p,
+				u64 categories)
+{
+	return categories & p->category_mask;
+}
+
+static int pagemap_scan_output(struct pagemap_scan_private *p,
+			       unsigned long addr, unsigned long end,
+			       u64 categories)
+{
+	struct page_region *cur = &p->cur;
+
+	if (!pagemap_scan_wanted(p, categories))
+		categories = 0;
+
+	if (categories && cur->end == addr && cur->categories == categories) {
+		cur->end = end;
+		return 0;
+	}
+
+	/* runs are only opened while there's room for them in buf */
+	if (cur->end > cur->start) {
+		p->buf[p->nr++] = *cur;
+		cur->start = cur->end = 0;
+	}
+
+	if (!categories)
+		return 0;
+
+	if (p->nr >= p->max) {
+		p->walk_end = addr;
+		return PM_END_OF_BUFFER;
+	}
+
+	cur->start = addr;
+	cur->end = end;
+	cur->categories = categories;
+	return 0;
+}
+
+static int pagemap_scan_pte_hole(unsigned long start, unsigned long end,
+				 struct mm_walk *walk)
+{
+	struct pagemap_scan_private *p = walk->private;
+	unsigned long addr = start;
+	int err = 0;
+
+	while (addr < end) {
+		struct vm_area_struct *vma = find_vma(walk->mm, addr);
+		unsigned long hole_end = vma ? min(end, vma->vm_start) : end;
+
+		err = pagemap_scan_output(p, addr, hole_end, 0);
+		if (err || !vma || hole_end == end)
+			break;
+
+		/* only reported if the caller asked for soft-dirty pages */
+		addr = hole_end;
+		hole_end = min(end, vma->vm_end);
+		err = pagemap_scan_output(p, addr, hole_end,
+				(vma->vm_flags & VM_SOFTDIRTY) ?
+				PAGE_IS_SOFT_DIRTY : 0);
+		if (err)
+			break;
+		addr = hole_end;
+	}
+
+	return err;
+}
+
+static u64 pagemap_scan_pte_categories(struct vm_area_struct *vma,
+				       unsigned long addr, pte_t pte,
+				       struct page **pagep)
+{
+	struct page *page = NULL;
+	u64 categories = 0;
+
+	if (pte_present(pte)) {
+		categories |= PAGE_IS_PRESENT;
+		if (pte_soft_dirty(pte))
+			categories |= PAGE_IS_SOFT_DIRTY;
+		page = vm_normal_page(vma, addr, pte);
+		if (pte_young(pte) || (page && page_is_young(page)))
+			categories |= PAGE_IS_YOUNG;
+	} else if (is_swap_pte(pte)) {
+		categories |= PAGE_IS_SWAPPED;
+		if (pte_swp_soft_dirty(pte))
+			categories |= PAGE_IS_SOFT_DIRTY;
+	}
+
+	if (page && !PageAnon(page))
+		categories |= PAGE_IS_FILE;
+	if (vma->vm_flags & VM_SOFTDIRTY)
+		categories |= PAGE_IS_SOFT_DIRTY;
+
+	*pagep = page;
+	return categories;
+}
+
+static int pagemap_scan_pmd_range(pmd_t *pmdp, unsigned long addr,
+				  unsigned long end, struct mm_walk *walk)
+{
+	struct vm_area_struct *vma = walk->vma;
+	struct pagemap_scan_private *p = walk->private;
+	spinlock_t *ptl;
+	pte_t *pte, *orig_pte;
+	int err = 0;
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	ptl = pmd_trans_huge_lock(pmdp, vma);
+	if (ptl) {
+		pmd_t pmd = *pmdp;
+		struct page *page = NULL;
+		u64 categories = 0;
+
+		if (pmd_present(pmd)) {
+			page = pmd_page(pmd);
+			categories |= PAGE_IS_PRESENT;
+			if (pmd_soft_dirty(pmd))
+				categories |= PAGE_IS_SOFT_DIRTY;
+			if (pmd_young(pmd) || page_is_young(page))
+				categories |= PAGE_IS_YOUNG;
+			if (!PageAnon(page))
+				categories |= PAGE_IS_FILE;
+		}
+#ifdef CONFIG_ARCH_ENABLE_THP_MIGRATION
+		else if (is_swap_pmd(pmd)) {
+			categories |= PAGE_IS_SWAPPED;
+			if (pmd_swp_soft_dirty(pmd))
+				categories |= PAGE_IS_SOFT_DIRTY;
+		}
+#endif
+		if (vma->vm_flags & VM_SOFTDIRTY)
+			categories |= PAGE_IS_SOFT_DIRTY;
+
+		err = pagemap_scan_output(p, addr, end, categories);
+		if (!err && p->clear_young && (categories & PAGE_IS_YOUNG) &&
+		    pagemap_scan_wanted(p, categories)) {
+			pmdp_test_and_clear_young(vma, addr, pmdp);
+			test_and_clear_page_young(page);
+			p->cleared = true;
+		}
+		spin_unlock(ptl);
+		return err;
+	}
+
+	if (pmd_trans_unstable(pmdp))
+		return 0;
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
+	orig_pte = pte = pte_offset_map_lock(walk->mm, pmdp, addr, &ptl);
+	for (; addr < end; pte++, addr += PAGE_SIZE) {
+		struct page *page;
+		u64 categories;
+
+		categories = pagemap_scan_pte_categories(vma, addr, *pte, &page);
+		err = pagemap_scan_output(p, addr, addr + PAGE_SIZE, categories);
+		if (err)
+			break;
+
+		if (p->clear_young && (categories & PAGE_IS_YOUNG) &&
+		    pagemap_scan_wanted(p, categories)) {
+			ptep_test_and_clear_young(vma, addr, pte);
+			if (page)
+				test_and_clear_page_young(page);
+			p->cleared = true;
+		}
+	}
+	pte_unmap_unlock(orig_pte, ptl);
+
+	cond_resched();
+
+	return err;
+}
+
+#ifdef CONFIG_HUGETLB_PAGE
+static int pagemap_scan_hugetlb_range(pte_t *ptep, unsigned long hmask,
+				      unsigned long addr, unsigned long end,
+				      struct mm_walk *walk)
+{
+	struct pagemap_scan_private *p = walk->private;
+	struct vm_area_struct *vma = walk->vma;
+	u64 categories = 0;
+	pte_t pte;
+
+	/* accessed bits of hugetlb pages are reported but never cleared */
+	pte = huge_ptep_get(ptep);
+	if (pte_present(pte)) {
+		categories |= PAGE_IS_PRESENT;
+		if (pte_young(pte))
+			categories |= PAGE_IS_YOUNG;
+		if (!PageAnon(pte_page(pte)))
+			categories |= PAGE_IS_FILE;
+	}
+	if (vma->vm_flags & VM_SOFTDIRTY)
+		categories |= PAGE_IS_SOFT_DIRTY;
+
+	return pagemap_scan_output(p, addr, end, categories);
+}
+#endif /* HUGETLB_PAGE */
+
+static long pagemap_scan(struct mm_struct *mm, struct pm_scan_arg __user *uarg)
+{
+	struct pagemap_scan_private p = {};
+	struct mm_walk scan_walk = {
+		.pmd_entry = pagemap_scan_pmd_range,
+		.pte_hole = pagemap_scan_pte_hole,
+#ifdef CONFIG_HUGETLB_PAGE
+		.hugetlb_entry = pagemap_scan_hugetlb_range,
+#endif
+		.mm = mm,
+		.private = &p,
+	};
+	struct page_region __user *vec;
+	struct pm_scan_arg arg;
+	unsigned long start, end, found = 0, buf_len;
+	long ret;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.size != sizeof(arg) || (arg.flags & ~PM_SCAN_FLAGS) ||
+	    (arg.category_mask & ~PM_SCAN_CATEGORIES))
+		return -EINVAL;
+	if (!PAGE_ALIGNED(arg.start) || !PAGE_ALIGNED(arg.end) ||
+	    arg.start > arg.end || arg.end > mm->task_size)
+		return -EINVAL;
+
+	vec = u64_to_user_ptr(arg.vec);
+	if (!arg.vec_len || arg.vec_len > ULONG_MAX / sizeof(*vec) ||
+	    !access_ok(VERIFY_WRITE, vec, arg.vec_len * sizeof(*vec)))
+		return -EINVAL;
+
+	/* a PAGEMAP_WALK_SIZE step can produce at most one run per page */
+	buf_len = PAGEMAP_WALK_SIZE >> PAGE_SHIFT;
+	p.buf = kmalloc_array(buf_len, sizeof(*p.buf), GFP_KERNEL);
+	if (!p.buf)
+		return -ENOMEM;
+
+	p.clear_young = arg.flags & PM_SCAN_CLEAR_YOUNG;
+	p.category_mask = arg.category_mask ?:
+			  PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+	p.walk_end = arg.end;
+
+	ret = 0;
+	start = arg.start;
+	while (start < arg.end) {
+		end = (start + PAGEMAP_WALK_SIZE) & PAGEMAP_WALK_MASK;
+		if (end < start || end > arg.end)
+			end = arg.end;
+
+		p.nr = 0;
+		p.max = min_t(unsigned long, buf_len, arg.vec_len - found);
+
+		ret = down_read_killable(&mm->mmap_sem);
+		if (ret)
+			goto out_free;
+		ret = walk_page_range(start, end, &scan_walk);
+		up_read(&mm->mmap_sem);
+
+		if (p.nr && copy_to_user(vec + found, p.buf,
+					 p.nr * sizeof(*p.buf))) {
+			ret = -EFAULT;
+			goto out_free;
+		}
+		found += p.nr;
+
+		if (ret)
+			break;
+		start = end;
+	}
+
+	if (ret && ret != PM_END_OF_BUFFER)
+		goto out_free;
+
+	/* there's always room for the run that is still open */
+	if (p.cur.end > p.cur.start) {
+		if (copy_to_user(vec + found, &p.cur, sizeof(p.cur))) {
+			ret = -EFAULT;
+			goto out_free;
+		}
+		found++;
+	}
+
+	if (put_user(p.walk_end, &uarg->walk_end))
+		ret = -EFAULT;
+	else
+		ret = found;
+
+out_free:
+	if (p.cleared)
+		flush_tlb_mm(mm);
+	kfree(p.buf);
+	return ret;
+}
+
+static long pagemap_ioctl(struct file *file, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct mm_struct *mm = file->private_data;
+	long ret;
+
+	if (cmd != PAGEMAP_SCAN)
+		return -ENOTTY;
+
+	if (!mm || !mmget_not_zero(mm))
+		return -ESRCH;
+
+	ret = pagemap_scan(mm, (struct pm_scan_arg __user *)arg);
+	mmput(mm);
+	return ret;
+}
+
+#ifdef CONFIG_COMPAT
+static long pagemap_compat_ioctl(struct file *file, unsigned int cmd,
+				 unsigned long arg)
+{
+	return pagemap_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
 static int pagemap_open(struct inode *inode, struct file *file)
 {
 	struct mm_struct *mm;
@@ -1663,6 +2066,10 @@ const struct file_operations proc_pagemap_operations = {
 	.read		= pagemap_read,
 	.open		= pagemap_open,
 	.release	= pagemap_release,
+	.unlocked_ioctl	= pagemap_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= pagemap_compat_ioctl,
+#endif
 };
 #endif /* CONFIG_PROC_PAGE_MONITOR */
 
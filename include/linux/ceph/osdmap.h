@@ -187,6 +187,11 @@ struct ceph_osdmap {
 
 	struct mutex crush_workspace_mutex;
 	void *crush_workspace;
+
+	/* up/acting sets computed for this epoch, keyed by pgid */
+	spinlock_t pg_mapping_cache_lock;
+	struct rb_root pg_mapping_cache;
+	int pg_mapping_cache_cnt;
 };
 
 static inline bool ceph_osd_exists(struct ceph_osdmap *map, int osd)
@@ -37,6 +37,7 @@
 struct device;
 struct dma_buf;
 struct dma_buf_attachment;
+struct dma_buf_exporter;
 
 /**
  * struct dma_buf_ops - operations possible on struct dma_buf
@@ -420,6 +421,9 @@ typedef int (*dma_buf_destructor)(struct dma_buf *dmabuf, void *dtor_data);
  * @poll: for userspace poll support
  * @cb_excl: for userspace poll support
  * @cb_shared: for userspace poll support
+ * @acct_stamp: marks the buffer as counted while /proc/dma_buf/procs walks
+ *              one process.
+ * @exp_stats: per-exporter accounting this buffer is charged to.
  *
  * This represents a shared buffer, created by calling dma_buf_export(). The
  * userspace representation is a normal file descriptor, which can be created by
@@ -463,6 +467,9 @@ struct dma_buf {
 	dma_buf_destructor dtor;
 	void *dtor_data;
 	atomic_t dent_count;
+
+	u64 acct_stamp;
+	struct dma_buf_exporter *exp_stats;
 };
 
 /**
@@ -113,8 +113,22 @@ struct fsnotify_ops {
 	void (*free_event)(struct fsnotify_event *event);
 	/* called on final put+free to free memory */
 	void (*free_mark)(struct fsnotify_mark *mark);
+	/*
+	 * Optional hashed coalescing of queued events, see fsnotify_add_event().
+	 * Called for the latest queued event with the same merge_key.
+	 */
+	int (*merge_hashed)(struct fsnotify_event *old,
+			    struct fsnotify_event *new);
 };
 
+/* return values of fsnotify_ops.merge_hashed */
+#define FSNOTIFY_MERGE_OTHER	0	/* a different object, keep looking */
+#define FSNOTIFY_MERGE_DONE	1	/* new was folded into old */
+#define FSNOTIFY_MERGE_NONE	2	/* same object, but can't be merged */
+
+#define FSNOTIFY_MERGE_HASH_BITS	7
+#define FSNOTIFY_MERGE_HASH_SIZE	(1 << FSNOTIFY_MERGE_HASH_BITS)
+
 /*
  * all of the information about the original object we want to now send to
  * a group.  If you want to carry more info from the accessing task to the
@@ -125,6 +139,8 @@ struct fsnotify_event {
 	/* inode may ONLY be dereferenced during handle_event(). */
 	struct inode *inode;	/* either the inode the event happened to or its parent */
 	u32 mask;		/* the type of access, bitwise OR for FS_* event types */
+	u32 merge_key;		/* hash of the object for coalescing, 0 for none */
+	struct hlist_node merge_node;	/* in group->merge_hash while queued */
 };
 
 /*
@@ -152,6 +168,13 @@ struct fsnotify_group {
 	wait_queue_head_t notification_waitq;	/* read() on the notification file blocks on this waitq */
 	unsigned int q_len;			/* events on the queue */
 	unsigned int max_events;		/* maximum events allowed on the list */
+	/* latest queued event of each object, for groups with ops->merge_hashed */
+	struct hlist_head *merge_hash;
+	/* queue statistics, protected by notification_lock */
+	unsigned int q_len_max;			/* high watermark of q_len */
+	unsigned long q_queued;			/* events added to the queue */
+	unsigned long q_merged;			/* events merged into queued ones */
+	unsigned long q_overflows;		/* events lost to overflow */
 	/*
 	 * Valid fsnotify group priorities.  Events are send in order from highest
 	 * priority to lowest priority.  We default to the lowest priority.
@@ -6,12 +6,14 @@
 #include <linux/un.h>
 #include <linux/mutex.h>
 #include <linux/refcount.h>
+#include <linux/llist.h>
 #include <net/sock.h>
 
 void unix_inflight(struct user_struct *user, struct file *fp);
 void unix_notinflight(struct user_struct *user, struct file *fp);
 void unix_destruct_scm(struct sk_buff *skb);
 void unix_gc(void);
+void unix_gc_exit(void);
 void wait_for_unix_gc(void);
 struct sock *unix_get_socket(struct file *filp);
 struct sock *unix_peer_get(struct sock *);
@@ -49,6 +51,8 @@ struct unix_skb_parms {
 				spin_lock_nested(&unix_sk(s)->lock, \
 				SINGLE_DEPTH_NESTING)
 
+struct unix_vertex;
+
 /* The AF_UNIX socket */
 struct unix_sock {
 	/* WARNING: sk has to be the first member */
@@ -62,7 +66,9 @@ struct unix_sock {
 	spinlock_t		lock;
 	unsigned long		gc_flags;
 #define UNIX_GC_CANDIDATE	0
-#define UNIX_GC_MAYBE_CYCLE	1
+#define UNIX_GC_MARKED		1
+	struct llist_node	gc_node;
+	struct unix_vertex	*gc_vertex;
 	struct socket_wq	peer_wq;
 	wait_queue_entry_t		peer_wake;
 };
@@ -80,6 +80,7 @@ struct kcm_sock {
 	bool tx_wait_more;
 
 	/* Receive */
+	struct kcm_mux_shard *rx_shard;
 	struct kcm_psock *rx_psock;
 	struct list_head wait_rx_list; /* KCMs waiting for receiving */
 	bool rx_wait;
@@ -116,6 +117,7 @@ struct kcm_psock {
 	struct sk_buff *ready_rx_msg;
 
 	/* Transmit */
+	struct kcm_mux_shard *tx_shard;
 	struct kcm_sock *tx_kcm;
 	struct list_head psock_avail_list;
 	unsigned long long saved_tx_bytes;
@@ -132,6 +134,25 @@ struct kcm_net {
 	int count;
 };
 
+#define KCM_MUX_SHARDS	8
+
+/* Slice of the MUX receive waiters and available transmit psocks. KCM
+ * sockets and psocks are spread over the shards by index, and lookups
+ * start at the shard of the local CPU, so that the MUX wide locks are
+ * only taken when a shard runs dry.
+ */
+struct kcm_mux_shard {
+	/* Receive */
+	spinlock_t rx_lock ____cacheline_aligned_in_smp;
+	struct list_head kcm_rx_waiters; /* KCMs waiting for receiving */
+	struct kcm_mux_stats rx_stats;
+
+	/* Transmit */
+	spinlock_t lock ____cacheline_aligned_in_smp;
+	struct list_head psocks_avail;	/* List of available psocks */
+	struct kcm_mux_stats tx_stats;
+};
+
 /* Structure for a MUX */
 struct kcm_mux {
 	struct list_head kcm_mux_list;
@@ -149,14 +170,15 @@ struct kcm_mux {
 
 	/* Receive */
 	spinlock_t rx_lock ____cacheline_aligned_in_smp;
-	struct list_head kcm_rx_waiters; /* KCMs waiting for receiving */
 	struct list_head psocks_ready;	/* List of psocks with a msg ready */
 	struct sk_buff_head rx_hold_queue;
 
 	/* Transmit */
 	spinlock_t  lock ____cacheline_aligned_in_smp;	/* TX and mux locking */
-	struct list_head psocks_avail;	/* List of available psocks */
 	struct list_head kcm_tx_waiters; /* KCMs waiting for a TX psock */
+
+	unsigned int nr_shards;
+	struct kcm_mux_shard shards[KCM_MUX_SHARDS];
 };
 
 #ifdef CONFIG_PROC_FS
@@ -198,4 +220,15 @@ static inline void aggregate_mux_stats(struct kcm_mux_stats *stats,
 #undef SAVE_MUX_STATS
 }
 
+static inline void aggregate_mux_shard_stats(struct kcm_mux *mux,
+					     struct kcm_mux_stats *agg_stats)
+{
+	unsigned int i;
+
+	for (i = 0; i < mux->nr_shards; i++) {
+		aggregate_mux_stats(&mux->shards[i].rx_stats, agg_stats);
+		aggregate_mux_stats(&mux->shards[i].tx_stats, agg_stats);
+	}
+}
+
 #endif /* __NET_KCM_H_ */
@@ -3,6 +3,8 @@
 #define __NETNS_XFRM_H
 
 #include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/seqlock.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
 #include <linux/xfrm.h>
@@ -19,6 +21,18 @@ struct xfrm_policy_hash {
 	u8			sbits6;
 };
 
+/*
+ * Inexact (prefix) policies of one direction, binned by selector prefix
+ * lengths and masked addresses.  @classes lists the distinct
+ * (family, dst prefixlen, src prefixlen) combinations present in @root.
+ * @unbinned holds policies no bin could be allocated for.
+ */
+struct xfrm_policy_inexact {
+	struct rb_root		root;
+	struct list_head	classes;
+	struct hlist_head	unbinned;
+};
+
 struct xfrm_policy_hthresh {
 	struct work_struct	work;
 	seqlock_t		lock;
@@ -49,6 +63,9 @@ struct netns_xfrm {
 	struct hlist_head	*policy_byidx;
 	unsigned int		policy_idx_hmask;
 	struct hlist_head	policy_inexact[XFRM_POLICY_MAX];
+	struct xfrm_policy_inexact policy_inexact_bins[XFRM_POLICY_MAX];
+	seqcount_t		policy_inexact_seq;
+	u64			policy_inexact_pos;
 	struct xfrm_policy_hash	policy_bydst[XFRM_POLICY_MAX];
 	unsigned int		policy_count[XFRM_POLICY_MAX * 2];
 	struct work_struct	policy_hash_work;
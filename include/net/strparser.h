@@ -42,10 +42,17 @@ struct strp_aggr_stats {
 
 struct strparser;
 
-/* Callbacks are called with lock held for the attached socket */
+/* Callbacks are called with lock held for the attached socket.
+ *
+ * An upper layer sets either rcv_msg, which is called for each message, or
+ * rcv_msgs, which is passed the messages framed from a received skb in one
+ * list. rcv_msgs dequeues the messages it takes; any left on the list when
+ * it pauses the strparser are passed again once it is unpaused.
+ */
 struct strp_callbacks {
 	int (*parse_msg)(struct strparser *strp, struct sk_buff *skb);
 	void (*rcv_msg)(struct strparser *strp, struct sk_buff *skb);
+	void (*rcv_msgs)(struct strparser *strp, struct sk_buff_head *list);
 	int (*read_sock_done)(struct strparser *strp, int err);
 	void (*abort_parser)(struct strparser *strp, int err);
 	void (*lock)(struct strparser *strp);
@@ -75,6 +82,7 @@ struct strparser {
 
 	struct sk_buff **skb_nextp;
 	struct sk_buff *skb_head;
+	struct sk_buff_head rcv_batch;
 	unsigned int need_bytes;
 	struct delayed_work msg_timer_work;
 	struct work_struct work;
@@ -574,6 +574,7 @@ struct xfrm_policy {
 	possible_net_t		xp_net;
 	struct hlist_node	bydst;
 	struct hlist_node	byidx;
+	struct hlist_node	bydst_inexact_list;
 
 	/* This lock only affects elements except for entry. */
 	rwlock_t		lock;
@@ -584,6 +585,7 @@ struct xfrm_policy {
 	u32			priority;
 	u32			index;
 	u32			if_id;
+	u64			pos;
 	struct xfrm_mark	mark;
 	struct xfrm_selector	selector;
 	struct xfrm_lifetime_cfg lft;
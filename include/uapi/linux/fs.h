@@ -322,6 +322,40 @@ struct fsxattr {
 #define SYNC_FILE_RANGE_WRITE		2
 #define SYNC_FILE_RANGE_WAIT_AFTER	4
 
+/*
+ * PAGEMAP_SCAN ioctl on /proc/<pid>/pagemap: report runs of pages that
+ * share the same categories instead of one entry per page.
+ */
+#define PAGE_IS_PRESENT		(1 << 0)
+#define PAGE_IS_SWAPPED		(1 << 1)
+#define PAGE_IS_SOFT_DIRTY	(1 << 2)
+#define PAGE_IS_YOUNG		(1 << 3)
+#define PAGE_IS_FILE		(1 << 4)
+
+struct page_region {
+	__u64 start;
+	__u64 end;
+	__u64 categories;
+};
+
+/* Clear the accessed bit of the pages reported, as the walk goes */
+#define PM_SCAN_CLEAR_YOUNG	(1 << 0)
+#define PM_SCAN_FLAGS		(PM_SCAN_CLEAR_YOUNG)
+
+struct pm_scan_arg {
+	__u64 size;		/* sizeof(struct pm_scan_arg) */
+	__u64 flags;		/* PM_SCAN_* */
+	__u64 start;		/* page aligned start of the range */
+	__u64 end;		/* page aligned end of the range */
+	__u64 walk_end;		/* out: address the walk stopped at */
+	__u64 vec;		/* user pointer to struct page_region array */
+	__u64 vec_len;		/* number of entries in vec */
+	__u64 category_mask;	/* report pages in any of these PAGE_IS_*,
+				 * 0 for present or swapped pages */
+};
+
+#define PAGEMAP_SCAN	_IOWR('f', 16, struct pm_scan_arg)
+
 /*
  * Flags for preadv2/pwritev2:
  */
@@ -57,6 +57,7 @@ struct sockaddr_ll {
 #define PACKET_QDISC_BYPASS		20
 #define PACKET_ROLLOVER_STATS		21
 #define PACKET_FANOUT_DATA		22
+#define PACKET_RX_RING_QUEUES		23
 
 #define PACKET_FANOUT_HASH		0
 #define PACKET_FANOUT_LB		1
@@ -126,6 +127,13 @@ struct tpacket_auxdata {
 
 /* Rx ring - feature request bits */
 #define TP_FT_REQ_FILL_RXHASH	0x1
+/* TPACKET_V3: split the blocks in PACKET_RX_RING_QUEUES queues of
+ * tp_block_nr / queues consecutive blocks each, the last one taking
+ * the remainder.  Each queue is filled by its own set of CPUs and is
+ * read in order on its own.  Partially filled blocks are also retired
+ * by poll() finding nothing to read and by recvmsg().
+ */
+#define TP_FT_REQ_PERCPU_BLK	0x2
 
 struct tpacket_hdr {
 	unsigned long	tp_status;
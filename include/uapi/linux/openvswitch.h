@@ -102,7 +102,7 @@ struct ovs_dp_megaflow_stats {
 	__u64 n_mask_hit;	 /* Number of masks used for flow lookups. */
 	__u32 n_masks;		 /* Number of masks for the datapath. */
 	__u32 pad0;		 /* Pad for future expension. */
-	__u64 pad1;		 /* Pad for future expension. */
+	__u64 n_cache_hit;	 /* Number of cache matches for flow lookups. */
 	__u64 pad2;		 /* Pad for future expension. */
 };
 
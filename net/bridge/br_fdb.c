@@ -19,6 +19,7 @@
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/jhash.h>
+#include <linux/hash.h>
 #include <linux/random.h>
 #include <linux/slab.h>
 #include <linux/atomic.h>
@@ -61,12 +62,23 @@ void br_fdb_fini(void)
 
 int br_fdb_hash_init(struct net_bridge *br)
 {
-	return rhashtable_init(&br->fdb_hash_tbl, &br_fdb_rht_params);
+	int err;
+
+	br->fdb_learn_cache = alloc_percpu(struct br_fdb_learn_cache);
+	if (!br->fdb_learn_cache)
+		return -ENOMEM;
+
+	err = rhashtable_init(&br->fdb_hash_tbl, &br_fdb_rht_params);
+	if (err)
+		free_percpu(br->fdb_learn_cache);
+
+	return err;
 }
 
 void br_fdb_hash_fini(struct net_bridge *br)
 {
 	rhashtable_destroy(&br->fdb_hash_tbl);
+	free_percpu(br->fdb_learn_cache);
 }
 
 /* if topology_changing then use forward_delay (default 15 sec)
@@ -77,6 +89,16 @@ static inline unsigned long hold_time(const struct net_bridge *br)
 	return br->topology_change ? br->forward_delay : br->ageing_time;
 }
 
+/* Timestamps of dynamic entries only need to be a small fraction of the
+ * hold time accurate, refreshing them on every frame dirties the entry
+ * on all receiving CPUs.
+ */
+static inline unsigned long fdb_touch_interval(const struct net_bridge *br)
+{
+	return min_t(unsigned long, hold_time(br) >> 6,
+		     BR_FDB_MAX_TOUCH_INTERVAL);
+}
+
 static inline int has_expired(const struct net_bridge *br,
 				  const struct net_bridge_fdb_entry *fdb)
 {
@@ -558,11 +580,19 @@ int br_fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 	return ret;
 }
 
+static inline u64 fdb_learn_key(const unsigned char *addr, u16 vid)
+{
+	return ether_addr_to_u64(addr) | (u64)vid << 48;
+}
+
 void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 		   const unsigned char *addr, u16 vid, bool added_by_user)
 {
+	struct br_fdb_learn_ent *ent = NULL;
 	struct net_bridge_fdb_entry *fdb;
 	bool fdb_modified = false;
+	unsigned int gen = 0;
+	u64 key = 0;
 
 	/* some users want to always flood. */
 	if (hold_time(br) == 0)
@@ -573,6 +603,17 @@ void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 	      source->state == BR_STATE_FORWARDING))
 		return;
 
+	/* frames from known hosts: recently learned on this cpu */
+	if (likely(!added_by_user)) {
+		key = fdb_learn_key(addr, vid);
+		ent = this_cpu_ptr(&br->fdb_learn_cache->ent[
+				hash_64(key, BR_FDB_LEARN_CACHE_BITS)]);
+		gen = atomic_read(&br->fdb_learn_gen);
+		if (ent->key == key && ent->port == source &&
+		    ent->gen == gen && time_before(jiffies, ent->until))
+			return;
+	}
+
 	fdb = fdb_find_rcu(&br->fdb_hash_tbl, addr, vid);
 	if (likely(fdb)) {
 		/* attempt to update an entry for a local interface */
@@ -582,6 +623,7 @@ void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 					source->dev->name, addr, vid);
 		} else {
 			unsigned long now = jiffies;
+			unsigned long interval = fdb_touch_interval(br);
 
 			/* fastpath: update of existing entry */
 			if (unlikely(source != fdb->dst)) {
@@ -591,13 +633,18 @@ void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 				if (unlikely(fdb->added_by_external_learn))
 					fdb->added_by_external_learn = 0;
 			}
-			if (now != fdb->updated)
+			if (time_after(now, fdb->updated + interval))
 				fdb->updated = now;
 			if (unlikely(added_by_user))
 				fdb->added_by_user = 1;
 			if (unlikely(fdb_modified)) {
 				trace_br_fdb_update(br, source, addr, vid, added_by_user);
 				fdb_notify(br, fdb, RTM_NEWNEIGH, true);
+			} else if (ent) {
+				ent->key = key;
+				ent->port = source;
+				ent->gen = gen;
+				ent->until = fdb->updated + interval;
 			}
 		}
 	} else {
@@ -697,6 +744,9 @@ static void fdb_notify(struct net_bridge *br,
 	struct sk_buff *skb;
 	int err = -ENOBUFS;
 
+	/* every fdb change is notified, drop the learn caches */
+	atomic_inc(&br->fdb_learn_gen);
+
 	if (swdev_notify)
 		br_switchdev_fdb_notify(fdb, type);
 
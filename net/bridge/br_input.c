@@ -166,7 +166,8 @@ int br_handle_frame_finish(struct net *net, struct sock *sk, struct sk_buff *skb
 		if (dst->is_local)
 			return br_pass_frame_up(skb);
 
-		if (now != dst->used)
+		/* only reported to user space, keep it coarse */
+		if (time_after(now, dst->used + BR_FDB_MAX_TOUCH_INTERVAL))
 			dst->used = now;
 		br_forward(dst->dst, skb, local_rcv, false);
 	} else {
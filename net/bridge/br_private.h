@@ -192,6 +192,28 @@ struct net_bridge_fdb_entry {
 	struct rcu_head			rcu;
 };
 
+/* Per-CPU filter of recently learned source addresses: a hit means the
+ * entry for this address and vlan already points to the port and was
+ * refreshed less than one touch interval ago, so learning can be skipped
+ * without looking up or writing the shared fdb entry.
+ */
+#define BR_FDB_LEARN_CACHE_BITS	6
+#define BR_FDB_LEARN_CACHE_SIZE	(1 << BR_FDB_LEARN_CACHE_BITS)
+
+struct br_fdb_learn_ent {
+	u64				key;
+	const struct net_bridge_port	*port;
+	unsigned long			until;
+	unsigned int			gen;
+};
+
+struct br_fdb_learn_cache {
+	struct br_fdb_learn_ent		ent[BR_FDB_LEARN_CACHE_SIZE];
+};
+
+/* fdb timestamps are refreshed at most this often on the packet path */
+#define BR_FDB_MAX_TOUCH_INTERVAL	HZ
+
 #define MDB_PG_FLAGS_PERMANENT	BIT(0)
 #define MDB_PG_FLAGS_OFFLOAD	BIT(1)
 
@@ -325,6 +347,9 @@ struct net_bridge {
 #endif
 
 	struct rhashtable		fdb_hash_tbl;
+	struct br_fdb_learn_cache	__percpu *fdb_learn_cache;
+	/* bumped on fdb changes, invalidates the learn caches */
+	atomic_t			fdb_learn_gen;
 #if IS_ENABLED(CONFIG_BRIDGE_NETFILTER)
 	union {
 		struct rtable		fake_rtable;
@@ -634,6 +634,85 @@ static void free_pg_mapping(struct ceph_pg_mapping *pg)
 DEFINE_RB_FUNCS2(pg_mapping, struct ceph_pg_mapping, pgid, ceph_pg_compare,
 		 RB_BYPTR, const struct ceph_pg *, node)
 
+/*
+ * Cache of up and acting sets, so that only the first request to a PG
+ * in a given epoch has to run CRUSH.  Valid for the current epoch only:
+ * flushed whenever the map is changed by an incremental.
+ */
+#define CEPH_PG_MAPPING_CACHE_MAX	4096
+
+struct ceph_pg_cached_mapping {
+	struct rb_node node;
+	struct ceph_pg pgid;
+	struct ceph_osds up;
+	struct ceph_osds acting;
+};
+
+DEFINE_RB_FUNCS2(pg_cached_mapping, struct ceph_pg_cached_mapping, pgid,
+		 ceph_pg_compare, RB_BYPTR, const struct ceph_pg *, node)
+
+static bool lookup_cached_osds(struct ceph_osdmap *map,
+			       const struct ceph_pg *pgid,
+			       struct ceph_osds *up,
+			       struct ceph_osds *acting)
+{
+	struct ceph_pg_cached_mapping *cm;
+
+	spin_lock(&map->pg_mapping_cache_lock);
+	cm = lookup_pg_cached_mapping(&map->pg_mapping_cache, pgid);
+	if (cm) {
+		ceph_osds_copy(up, &cm->up);
+		ceph_osds_copy(acting, &cm->acting);
+	}
+	spin_unlock(&map->pg_mapping_cache_lock);
+	return cm;
+}
+
+static void cache_osds(struct ceph_osdmap *map, const struct ceph_pg *pgid,
+		       const struct ceph_osds *up,
+		       const struct ceph_osds *acting)
+{
+	struct ceph_pg_cached_mapping *cm;
+
+	if (READ_ONCE(map->pg_mapping_cache_cnt) >= CEPH_PG_MAPPING_CACHE_MAX)
+		return;
+
+	cm = kmalloc(sizeof(*cm), GFP_NOIO);
+	if (!cm)
+		return;
+
+	RB_CLEAR_NODE(&cm->node);
+	cm->pgid = *pgid; /* struct */
+	ceph_osds_copy(&cm->up, up);
+	ceph_osds_copy(&cm->acting, acting);
+
+	/* readers only hold osdc->lock for read and may race to fill */
+	spin_lock(&map->pg_mapping_cache_lock);
+	if (map->pg_mapping_cache_cnt >= CEPH_PG_MAPPING_CACHE_MAX ||
+	    lookup_pg_cached_mapping(&map->pg_mapping_cache, pgid)) {
+		spin_unlock(&map->pg_mapping_cache_lock);
+		kfree(cm);
+		return;
+	}
+	insert_pg_cached_mapping(&map->pg_mapping_cache, cm);
+	map->pg_mapping_cache_cnt++;
+	spin_unlock(&map->pg_mapping_cache_lock);
+}
+
+static void clear_cached_osds(struct ceph_osdmap *map)
+{
+	spin_lock(&map->pg_mapping_cache_lock);
+	while (!RB_EMPTY_ROOT(&map->pg_mapping_cache)) {
+		struct ceph_pg_cached_mapping *cm =
+			rb_entry(rb_first(&map->pg_mapping_cache),
+				 struct ceph_pg_cached_mapping, node);
+		erase_pg_cached_mapping(&map->pg_mapping_cache, cm);
+		kfree(cm);
+	}
+	map->pg_mapping_cache_cnt = 0;
+	spin_unlock(&map->pg_mapping_cache_lock);
+}
+
 /*
  * rbtree of pg pool info
  */
@@ -940,6 +1019,8 @@ struct ceph_osdmap *ceph_osdmap_alloc(void)
 	map->pg_upmap = RB_ROOT;
 	map->pg_upmap_items = RB_ROOT;
 	mutex_init(&map->crush_workspace_mutex);
+	spin_lock_init(&map->pg_mapping_cache_lock);
+	map->pg_mapping_cache = RB_ROOT;
 
 	return map;
 }
@@ -947,6 +1028,7 @@ struct ceph_osdmap *ceph_osdmap_alloc(void)
 void ceph_osdmap_destroy(struct ceph_osdmap *map)
 {
 	dout("osdmap_destroy %p\n", map);
+	clear_cached_osds(map);
 	if (map->crush)
 		crush_destroy(map->crush);
 	while (!RB_EMPTY_ROOT(&map->pg_temp)) {
@@ -1765,6 +1847,9 @@ struct ceph_osdmap *osdmap_apply_incremental(void **p, void *end,
 		return ceph_osdmap_decode(p, min(*p+len, end));
 	}
 
+	/* anything below may change placement */
+	clear_cached_osds(map);
+
 	/* new crush? */
 	ceph_decode_32_safe(p, end, len, e_inval);
 	if (len > 0) {
@@ -2590,6 +2675,9 @@ void ceph_pg_to_up_acting_osds(struct ceph_osdmap *osdmap,
 	WARN_ON(pi->id != raw_pgid->pool);
 	raw_pg_to_pg(pi, raw_pgid, &pgid);
 
+	if (lookup_cached_osds(osdmap, &pgid, up, acting))
+		return;
+
 	pg_to_raw_osds(osdmap, pi, raw_pgid, up, &pps);
 	apply_upmap(osdmap, &pgid, up);
 	raw_to_up_osds(osdmap, pi, up);
@@ -2602,6 +2690,8 @@ void ceph_pg_to_up_acting_osds(struct ceph_osdmap *osdmap,
 			acting->primary = up->primary;
 	}
 	WARN_ON(!osds_valid(up) || !osds_valid(acting));
+
+	cache_osds(osdmap, &pgid, up, acting);
 }
 
 bool ceph_pg_to_primary_shard(struct ceph_osdmap *osdmap,
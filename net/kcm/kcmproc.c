@@ -188,15 +188,20 @@ kcm_format_mux(struct kcm_mux *mux, loff_t idx, struct seq_file *seq)
 	int i, len;
 	struct kcm_sock *kcm;
 	struct kcm_psock *psock;
+	struct kcm_mux_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	aggregate_mux_stats(&mux->stats, &stats);
+	aggregate_mux_shard_stats(mux, &stats);
 
 	/* mux information */
 	seq_printf(seq,
 		   "%-6s%-8s %-10llu %-16llu %-10llu %-16llu %-8s %-8s %-8s %-8s ",
 		   "mux", "",
-		   mux->stats.rx_msgs,
-		   mux->stats.rx_bytes,
-		   mux->stats.tx_msgs,
-		   mux->stats.tx_bytes,
+		   stats.rx_msgs,
+		   stats.rx_bytes,
+		   stats.tx_msgs,
+		   stats.tx_bytes,
 		   "-", "-", "-", "-");
 
 	seq_printf(seq, "KCMs: %d, Psocks %d\n",
@@ -264,6 +269,7 @@ static int kcm_stats_seq_show(struct seq_file *seq, void *v)
 	list_for_each_entry_rcu(mux, &knet->mux_list, kcm_mux_list) {
 		spin_lock_bh(&mux->lock);
 		aggregate_mux_stats(&mux->stats, &mux_stats);
+		aggregate_mux_shard_stats(mux, &mux_stats);
 		aggregate_psock_stats(&mux->aggregate_psock_stats,
 				      &psock_stats);
 		aggregate_strp_stats(&mux->aggregate_strp_stats,
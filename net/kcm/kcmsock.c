@@ -57,14 +57,14 @@ static void kcm_abort_tx_psock(struct kcm_psock *psock, int err,
 			       bool wakeup_kcm)
 {
 	struct sock *csk = psock->sk;
-	struct kcm_mux *mux = psock->mux;
+	struct kcm_mux_shard *shard = psock->tx_shard;
 
 	/* Unrecoverable error in transmit */
 
-	spin_lock_bh(&mux->lock);
+	spin_lock_bh(&shard->lock);
 
 	if (psock->tx_stopped) {
-		spin_unlock_bh(&mux->lock);
+		spin_unlock_bh(&shard->lock);
 		return;
 	}
 
@@ -73,7 +73,7 @@ static void kcm_abort_tx_psock(struct kcm_psock *psock, int err,
 
 	if (!psock->tx_kcm) {
 		/* Take off psocks_avail list */
-		list_del(&psock->psock_avail_list);
+		list_del_init(&psock->psock_avail_list);
 	} else if (wakeup_kcm) {
 		/* In this case psock is being aborted while outside of
 		 * write_msgs and psock is reserved. Schedule tx_work
@@ -85,56 +85,102 @@ static void kcm_abort_tx_psock(struct kcm_psock *psock, int err,
 		queue_work(kcm_wq, &psock->tx_kcm->tx_work);
 	}
 
-	spin_unlock_bh(&mux->lock);
+	spin_unlock_bh(&shard->lock);
 
 	/* Report error on lower socket */
 	report_csk_error(csk, err);
 }
 
-/* RX mux lock held. */
-static void kcm_update_rx_mux_stats(struct kcm_mux *mux,
+/* Lock protecting stats held. */
+static void kcm_update_rx_mux_stats(struct kcm_mux_stats *stats,
 				    struct kcm_psock *psock)
 {
-	STRP_STATS_ADD(mux->stats.rx_bytes,
+	STRP_STATS_ADD(stats->rx_bytes,
 		       psock->strp.stats.bytes -
 		       psock->saved_rx_bytes);
-	mux->stats.rx_msgs +=
+	stats->rx_msgs +=
 		psock->strp.stats.msgs - psock->saved_rx_msgs;
 	psock->saved_rx_msgs = psock->strp.stats.msgs;
 	psock->saved_rx_bytes = psock->strp.stats.bytes;
 }
 
-static void kcm_update_tx_mux_stats(struct kcm_mux *mux,
+static void kcm_update_tx_mux_stats(struct kcm_mux_stats *stats,
 				    struct kcm_psock *psock)
 {
-	KCM_STATS_ADD(mux->stats.tx_bytes,
+	KCM_STATS_ADD(stats->tx_bytes,
 		      psock->stats.tx_bytes - psock->saved_tx_bytes);
-	mux->stats.tx_msgs +=
+	stats->tx_msgs +=
 		psock->stats.tx_msgs - psock->saved_tx_msgs;
 	psock->saved_tx_msgs = psock->stats.tx_msgs;
 	psock->saved_tx_bytes = psock->stats.tx_bytes;
 }
 
+static inline unsigned int kcm_mux_this_shard(struct kcm_mux *mux)
+{
+	return raw_smp_processor_id() % mux->nr_shards;
+}
+
 static int kcm_queue_rcv_skb(struct sock *sk, struct sk_buff *skb);
 
-/* KCM is ready to receive messages on its queue-- either the KCM is new or
- * has become unblocked after being blocked on full socket buffer. Queue any
- * pending ready messages on a psock. RX mux lock held.
+/* Messages held on the MUX that wait for a KCM to become ready */
+static inline bool kcm_rx_pending(struct kcm_mux *mux)
+{
+	return !skb_queue_empty(&mux->rx_hold_queue) ||
+	       !list_empty(&mux->psocks_ready);
+}
+
+/* Queue a message to a waiting KCM in any shard, starting with the shard
+ * of the local CPU. KCMs that can't take the message are taken off the
+ * waiters list. Returns false if no KCM accepted the message.
+ * RX mux lock held.
  */
-static void kcm_rcv_ready(struct kcm_sock *kcm)
+static bool kcm_rx_deliver(struct kcm_mux *mux, struct sk_buff *skb)
+{
+	unsigned int start = kcm_mux_this_shard(mux);
+	struct kcm_mux_shard *shard;
+	struct kcm_sock *kcm;
+	unsigned int i;
+
+	for (i = 0; i < mux->nr_shards; i++) {
+		shard = &mux->shards[(start + i) % mux->nr_shards];
+		if (list_empty(&shard->kcm_rx_waiters))
+			continue;
+
+		spin_lock(&shard->rx_lock);
+		while (!list_empty(&shard->kcm_rx_waiters)) {
+			kcm = list_first_entry(&shard->kcm_rx_waiters,
+					       struct kcm_sock, wait_rx_list);
+
+			if (!kcm_queue_rcv_skb(&kcm->sk, skb)) {
+				spin_unlock(&shard->rx_lock);
+				return true;
+			}
+
+			/* Should mean socket buffer full */
+			list_del(&kcm->wait_rx_list);
+			/* paired with lockless reads in kcm_rfree() */
+			WRITE_ONCE(kcm->rx_wait, false);
+
+			/* Commit rx_wait to read in kcm_free */
+			smp_wmb();
+		}
+		spin_unlock(&shard->rx_lock);
+	}
+
+	return false;
+}
+
+/* Hand messages held on the MUX and ready messages on psocks to waiting
+ * KCMs. RX mux lock held.
+ */
+static void __kcm_rx_match(struct kcm_mux *mux)
 {
-	struct kcm_mux *mux = kcm->mux;
 	struct kcm_psock *psock;
 	struct sk_buff *skb;
 
-	if (unlikely(kcm->rx_wait || kcm->rx_psock || kcm->rx_disabled))
-		return;
-
 	while (unlikely((skb = __skb_dequeue(&mux->rx_hold_queue)))) {
-		if (kcm_queue_rcv_skb(&kcm->sk, skb)) {
-			/* Assuming buffer limit has been reached */
-			skb_queue_head(&mux->rx_hold_queue, skb);
-			WARN_ON(!sk_rmem_alloc_get(&kcm->sk));
+		if (!kcm_rx_deliver(mux, skb)) {
+			__skb_queue_head(&mux->rx_hold_queue, skb);
 			return;
 		}
 	}
@@ -143,11 +189,8 @@ static void kcm_rcv_ready(struct kcm_sock *kcm)
 		psock = list_first_entry(&mux->psocks_ready, struct kcm_psock,
 					 psock_ready_list);
 
-		if (kcm_queue_rcv_skb(&kcm->sk, psock->ready_rx_msg)) {
-			/* Assuming buffer limit has been reached */
-			WARN_ON(!sk_rmem_alloc_get(&kcm->sk));
+		if (!kcm_rx_deliver(mux, psock->ready_rx_msg))
 			return;
-		}
 
 		/* Consumed the ready message on the psock. Schedule rx_work to
 		 * get more messages.
@@ -160,20 +203,45 @@ static void kcm_rcv_ready(struct kcm_sock *kcm)
 		strp_unpause(&psock->strp);
 		strp_check_rcv(&psock->strp);
 	}
+}
 
-	/* Buffer limit is okay now, add to ready list */
-	list_add_tail(&kcm->wait_rx_list,
-		      &kcm->mux->kcm_rx_waiters);
+static void kcm_rx_match(struct kcm_mux *mux)
+{
+	spin_lock_bh(&mux->rx_lock);
+	__kcm_rx_match(mux);
+	spin_unlock_bh(&mux->rx_lock);
+}
+
+/* KCM is ready to receive messages on its queue-- either the KCM is new or
+ * has become unblocked after being blocked on full socket buffer. Add it to
+ * the waiters of its shard and return true if there are pending messages on
+ * the MUX that the caller must pass to kcm_rx_match() after dropping the
+ * shard lock. KCM RX shard lock held.
+ */
+static bool kcm_rcv_ready(struct kcm_sock *kcm)
+{
+	if (unlikely(kcm->rx_wait || kcm->rx_psock || kcm->rx_disabled))
+		return false;
+
+	list_add_tail(&kcm->wait_rx_list, &kcm->rx_shard->kcm_rx_waiters);
 	/* paired with lockless reads in kcm_rfree() */
 	WRITE_ONCE(kcm->rx_wait, true);
+
+	/* Publish the waiter before looking for pending messages, paired
+	 * with the barriers in requeue_rx_msgs() and reserve_rx_kcm().
+	 */
+	smp_mb();
+
+	return kcm_rx_pending(kcm->mux);
 }
 
 static void kcm_rfree(struct sk_buff *skb)
 {
 	struct sock *sk = skb->sk;
 	struct kcm_sock *kcm = kcm_sk(sk);
-	struct kcm_mux *mux = kcm->mux;
+	struct kcm_mux_shard *shard = kcm->rx_shard;
 	unsigned int len = skb->truesize;
+	bool pending;
 
 	sk_mem_uncharge(sk, len);
 	atomic_sub(len, &sk->sk_rmem_alloc);
@@ -183,13 +251,17 @@ static void kcm_rfree(struct sk_buff *skb)
 
 	if (!READ_ONCE(kcm->rx_wait) && !READ_ONCE(kcm->rx_psock) &&
 	    sk_rmem_alloc_get(sk) < sk->sk_rcvlowat) {
-		spin_lock_bh(&mux->rx_lock);
-		kcm_rcv_ready(kcm);
-		spin_unlock_bh(&mux->rx_lock);
+		spin_lock_bh(&shard->rx_lock);
+		pending = kcm_rcv_ready(kcm);
+		spin_unlock_bh(&shard->rx_lock);
+
+		if (pending)
+			kcm_rx_match(kcm->mux);
 	}
 }
 
-static int kcm_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
+/* Queue a message without waking up the reader */
+static int __kcm_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
 {
 	struct sk_buff_head *list = &sk->sk_receive_queue;
 
@@ -209,10 +281,24 @@ static int kcm_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
 
 	skb_queue_tail(list, skb);
 
+	return 0;
+}
+
+static void kcm_rcv_wakeup(struct sock *sk)
+{
 	if (!sock_flag(sk, SOCK_DEAD))
 		sk->sk_data_ready(sk);
+}
 
-	return 0;
+static int kcm_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
+{
+	int err;
+
+	err = __kcm_queue_rcv_skb(sk, skb);
+	if (!err)
+		kcm_rcv_wakeup(sk);
+
+	return err;
 }
 
 /* Requeue received messages for a kcm socket to other kcm sockets. This is
@@ -222,33 +308,65 @@ static int kcm_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
 static void requeue_rx_msgs(struct kcm_mux *mux, struct sk_buff_head *head)
 {
 	struct sk_buff *skb;
-	struct kcm_sock *kcm;
+	bool held = false;
 
 	while ((skb = skb_dequeue(head))) {
 		/* Reset destructor to avoid calling kcm_rcv_ready */
 		skb->destructor = sock_rfree;
 		skb_orphan(skb);
-try_again:
-		if (list_empty(&mux->kcm_rx_waiters)) {
+
+		if (!kcm_rx_deliver(mux, skb)) {
 			skb_queue_tail(&mux->rx_hold_queue, skb);
-			continue;
+			held = true;
 		}
+	}
 
-		kcm = list_first_entry(&mux->kcm_rx_waiters,
-				       struct kcm_sock, wait_rx_list);
+	if (held) {
+		/* Publish held messages before looking for waiters again,
+		 * paired with kcm_rcv_ready().
+		 */
+		smp_mb();
+		__kcm_rx_match(mux);
+	}
+}
 
-		if (kcm_queue_rcv_skb(&kcm->sk, skb)) {
-			/* Should mean socket buffer full */
+/* Take a waiting KCM off a shard, starting with the shard of the local
+ * CPU. Lower sock lock held.
+ */
+static struct kcm_sock *kcm_rx_reserve_waiter(struct kcm_psock *psock)
+{
+	struct kcm_mux *mux = psock->mux;
+	unsigned int start = kcm_mux_this_shard(mux);
+	struct kcm_mux_shard *shard;
+	struct kcm_sock *kcm;
+	unsigned int i;
+
+	for (i = 0; i < mux->nr_shards; i++) {
+		shard = &mux->shards[(start + i) % mux->nr_shards];
+		if (list_empty(&shard->kcm_rx_waiters))
+			continue;
+
+		spin_lock_bh(&shard->rx_lock);
+		kcm = list_first_entry_or_null(&shard->kcm_rx_waiters,
+					       struct kcm_sock, wait_rx_list);
+		if (kcm) {
 			list_del(&kcm->wait_rx_list);
 			/* paired with lockless reads in kcm_rfree() */
 			WRITE_ONCE(kcm->rx_wait, false);
 
-			/* Commit rx_wait to read in kcm_free */
-			smp_wmb();
+			psock->rx_kcm = kcm;
+			/* paired with lockless reads in kcm_rfree() */
+			WRITE_ONCE(kcm->rx_psock, psock);
 
-			goto try_again;
+			kcm_update_rx_mux_stats(&shard->rx_stats, psock);
 		}
+		spin_unlock_bh(&shard->rx_lock);
+
+		if (kcm)
+			return kcm;
 	}
+
+	return NULL;
 }
 
 /* Lower sock lock held */
@@ -263,37 +381,28 @@ static struct kcm_sock *reserve_rx_kcm(struct kcm_psock *psock,
 	if (psock->rx_kcm)
 		return psock->rx_kcm;
 
-	spin_lock_bh(&mux->rx_lock);
+	kcm = kcm_rx_reserve_waiter(psock);
+	if (kcm)
+		return kcm;
 
-	if (psock->rx_kcm) {
-		spin_unlock_bh(&mux->rx_lock);
-		return psock->rx_kcm;
-	}
+	/* No KCM is waiting, hold the message on the psock */
+	spin_lock_bh(&mux->rx_lock);
 
-	kcm_update_rx_mux_stats(mux, psock);
+	kcm_update_rx_mux_stats(&mux->stats, psock);
 
-	if (list_empty(&mux->kcm_rx_waiters)) {
-		psock->ready_rx_msg = head;
-		strp_pause(&psock->strp);
-		list_add_tail(&psock->psock_ready_list,
-			      &mux->psocks_ready);
-		spin_unlock_bh(&mux->rx_lock);
-		return NULL;
-	}
+	psock->ready_rx_msg = head;
+	strp_pause(&psock->strp);
+	list_add_tail(&psock->psock_ready_list, &mux->psocks_ready);
 
-	kcm = list_first_entry(&mux->kcm_rx_waiters,
-			       struct kcm_sock, wait_rx_list);
-	list_del(&kcm->wait_rx_list);
-	/* paired with lockless reads in kcm_rfree() */
-	WRITE_ONCE(kcm->rx_wait, false);
-
-	psock->rx_kcm = kcm;
-	/* paired with lockless reads in kcm_rfree() */
-	WRITE_ONCE(kcm->rx_psock, psock);
+	/* Publish the ready psock before looking for waiters again, paired
+	 * with kcm_rcv_ready().
+	 */
+	smp_mb();
+	__kcm_rx_match(mux);
 
 	spin_unlock_bh(&mux->rx_lock);
 
-	return kcm;
+	return NULL;
 }
 
 static void kcm_done(struct kcm_sock *kcm);
@@ -309,11 +418,26 @@ static void unreserve_rx_kcm(struct kcm_psock *psock,
 {
 	struct kcm_sock *kcm = psock->rx_kcm;
 	struct kcm_mux *mux = psock->mux;
+	struct kcm_mux_shard *shard;
+	bool pending = false;
+	bool locked = false;
 
 	if (!kcm)
 		return;
 
-	spin_lock_bh(&mux->rx_lock);
+	shard = kcm->rx_shard;
+	spin_lock_bh(&shard->rx_lock);
+
+	if (unlikely(kcm->done || kcm->rx_disabled)) {
+		/* Slow path, KCM is going away or its messages need to be
+		 * requeued. Take the RX mux lock so that kcm_done() can't
+		 * proceed until we are done with the KCM.
+		 */
+		spin_unlock_bh(&shard->rx_lock);
+		spin_lock_bh(&mux->rx_lock);
+		spin_lock(&shard->rx_lock);
+		locked = true;
+	}
 
 	psock->rx_kcm = NULL;
 	/* paired with lockless reads in kcm_rfree() */
@@ -325,6 +449,7 @@ static void unreserve_rx_kcm(struct kcm_psock *psock,
 	smp_mb();
 
 	if (unlikely(kcm->done)) {
+		spin_unlock(&shard->rx_lock);
 		spin_unlock_bh(&mux->rx_lock);
 
 		/* Need to run kcm_done in a task since we need to qcquire
@@ -336,14 +461,31 @@ static void unreserve_rx_kcm(struct kcm_psock *psock,
 	}
 
 	if (unlikely(kcm->rx_disabled)) {
+		spin_unlock(&shard->rx_lock);
 		requeue_rx_msgs(mux, &kcm->sk.sk_receive_queue);
-	} else if (rcv_ready || unlikely(!sk_rmem_alloc_get(&kcm->sk))) {
+		spin_unlock_bh(&mux->rx_lock);
+		return;
+	}
+
+	if (rcv_ready || unlikely(!sk_rmem_alloc_get(&kcm->sk))) {
 		/* Check for degenerative race with rx_wait that all
 		 * data was dequeued (accounted for in kcm_rfree).
 		 */
-		kcm_rcv_ready(kcm);
+		pending = kcm_rcv_ready(kcm);
 	}
-	spin_unlock_bh(&mux->rx_lock);
+
+	if (locked) {
+		spin_unlock(&shard->rx_lock);
+		if (pending)
+			__kcm_rx_match(mux);
+		spin_unlock_bh(&mux->rx_lock);
+		return;
+	}
+
+	spin_unlock_bh(&shard->rx_lock);
+
+	if (pending)
+		kcm_rx_match(mux);
 }
 
 /* Lower sock lock held */
@@ -360,26 +502,42 @@ static void psock_data_ready(struct sock *sk)
 	read_unlock_bh(&sk->sk_callback_lock);
 }
 
-/* Called with lower sock held */
-static void kcm_rcv_strparser(struct strparser *strp, struct sk_buff *skb)
+/* Called with lower sock held. Queue a batch of messages to the reserved
+ * KCM, waking it up once for the whole batch.
+ */
+static void kcm_rcv_strparser(struct strparser *strp,
+			      struct sk_buff_head *list)
 {
 	struct kcm_psock *psock = container_of(strp, struct kcm_psock, strp);
-	struct kcm_sock *kcm;
+	struct kcm_sock *kcm, *queued = NULL;
+	struct sk_buff *skb;
 
+	while ((skb = __skb_dequeue(list))) {
 try_queue:
-	kcm = reserve_rx_kcm(psock, skb);
-	if (!kcm) {
-		 /* Unable to reserve a KCM, message is held in psock and strp
-		  * is paused.
-		  */
-		return;
-	}
+		kcm = reserve_rx_kcm(psock, skb);
+		if (!kcm) {
+			/* Unable to reserve a KCM, message is held in psock
+			 * and strp is paused. The rest of the batch stays
+			 * with the strparser.
+			 */
+			return;
+		}
 
-	if (kcm_queue_rcv_skb(&kcm->sk, skb)) {
-		/* Should mean socket buffer full */
-		unreserve_rx_kcm(psock, false);
-		goto try_queue;
+		if (__kcm_queue_rcv_skb(&kcm->sk, skb)) {
+			/* Should mean socket buffer full */
+			if (queued) {
+				kcm_rcv_wakeup(&queued->sk);
+				queued = NULL;
+			}
+			unreserve_rx_kcm(psock, false);
+			goto try_queue;
+		}
+
+		queued = kcm;
 	}
+
+	if (queued)
+		kcm_rcv_wakeup(&queued->sk);
 }
 
 static int kcm_parse_func_strparser(struct strparser *strp, struct sk_buff *skb)
@@ -416,7 +574,7 @@ static void psock_state_change(struct sock *sk)
 static void psock_write_space(struct sock *sk)
 {
 	struct kcm_psock *psock;
-	struct kcm_mux *mux;
+	struct kcm_mux_shard *shard;
 	struct kcm_sock *kcm;
 
 	read_lock_bh(&sk->sk_callback_lock);
@@ -424,22 +582,60 @@ static void psock_write_space(struct sock *sk)
 	psock = (struct kcm_psock *)sk->sk_user_data;
 	if (unlikely(!psock))
 		goto out;
-	mux = psock->mux;
 
-	spin_lock_bh(&mux->lock);
+	/* Not added to the mux yet, so it can't be reserved */
+	shard = READ_ONCE(psock->tx_shard);
+	if (unlikely(!shard))
+		goto out;
+
+	spin_lock_bh(&shard->lock);
 
 	/* Check if the socket is reserved so someone is waiting for sending. */
 	kcm = psock->tx_kcm;
 	if (kcm && !unlikely(kcm->tx_stopped))
 		queue_work(kcm_wq, &kcm->tx_work);
 
-	spin_unlock_bh(&mux->lock);
+	spin_unlock_bh(&shard->lock);
 out:
 	read_unlock_bh(&sk->sk_callback_lock);
 }
 
 static void unreserve_psock(struct kcm_sock *kcm);
 
+/* Take an available psock for the KCM, starting with the shard of the
+ * local CPU. Returns NULL if no psock is available.
+ */
+static struct kcm_psock *kcm_grab_psock(struct kcm_sock *kcm)
+{
+	struct kcm_mux *mux = kcm->mux;
+	unsigned int start = kcm_mux_this_shard(mux);
+	struct kcm_mux_shard *shard;
+	struct kcm_psock *psock;
+	unsigned int i;
+
+	for (i = 0; i < mux->nr_shards; i++) {
+		shard = &mux->shards[(start + i) % mux->nr_shards];
+		if (list_empty(&shard->psocks_avail))
+			continue;
+
+		spin_lock_bh(&shard->lock);
+		psock = list_first_entry_or_null(&shard->psocks_avail,
+						 struct kcm_psock,
+						 psock_avail_list);
+		if (psock) {
+			list_del_init(&psock->psock_avail_list);
+			psock->tx_kcm = kcm;
+			KCM_STATS_INCR(psock->stats.reserved);
+		}
+		spin_unlock_bh(&shard->lock);
+
+		if (psock)
+			return psock;
+	}
+
+	return NULL;
+}
+
 /* kcm sock is locked. */
 static struct kcm_psock *reserve_psock(struct kcm_sock *kcm)
 {
@@ -458,6 +654,17 @@ static struct kcm_psock *reserve_psock(struct kcm_sock *kcm)
 			return kcm->tx_psock;
 	}
 
+	/* KCM is not on the waiters list so a psock can be taken without
+	 * the mux lock.
+	 */
+	if (!READ_ONCE(kcm->tx_wait)) {
+		psock = kcm_grab_psock(kcm);
+		if (psock) {
+			kcm->tx_psock = psock;
+			return psock;
+		}
+	}
+
 	spin_lock_bh(&mux->lock);
 
 	/* Check again under lock to see if psock was reserved for this
@@ -470,45 +677,64 @@ static struct kcm_psock *reserve_psock(struct kcm_sock *kcm)
 		return kcm->tx_psock;
 	}
 
-	if (!list_empty(&mux->psocks_avail)) {
-		psock = list_first_entry(&mux->psocks_avail,
-					 struct kcm_psock,
-					 psock_avail_list);
-		list_del(&psock->psock_avail_list);
-		if (kcm->tx_wait) {
-			list_del(&kcm->wait_psock_list);
-			kcm->tx_wait = false;
-		}
-		kcm->tx_psock = psock;
-		psock->tx_kcm = kcm;
-		KCM_STATS_INCR(psock->stats.reserved);
-	} else if (!kcm->tx_wait) {
+	if (!kcm->tx_wait) {
 		list_add_tail(&kcm->wait_psock_list,
 			      &mux->kcm_tx_waiters);
 		kcm->tx_wait = true;
 	}
 
+	/* Publish the waiter before looking for a psock again, paired with
+	 * kcm_tx_match().
+	 */
+	smp_mb();
+
+	psock = kcm_grab_psock(kcm);
+	if (psock) {
+		list_del(&kcm->wait_psock_list);
+		kcm->tx_wait = false;
+		kcm->tx_psock = psock;
+	}
+
 	spin_unlock_bh(&mux->lock);
 
 	return psock;
 }
 
-/* mux lock held */
+/* psock TX shard lock held */
 static void psock_now_avail(struct kcm_psock *psock)
 {
-	struct kcm_mux *mux = psock->mux;
+	list_add_tail(&psock->psock_avail_list,
+		      &psock->tx_shard->psocks_avail);
+}
+
+/* Hand psocks made available by psock_now_avail() to KCMs waiting in
+ * reserve_psock(). No mux locks held.
+ */
+static void kcm_tx_match(struct kcm_mux *mux)
+{
+	struct kcm_psock *psock;
 	struct kcm_sock *kcm;
 
-	if (list_empty(&mux->kcm_tx_waiters)) {
-		list_add_tail(&psock->psock_avail_list,
-			      &mux->psocks_avail);
-	} else {
+	/* Publish the available psock before looking for waiters, paired
+	 * with reserve_psock().
+	 */
+	smp_mb();
+
+	if (list_empty(&mux->kcm_tx_waiters))
+		return;
+
+	spin_lock_bh(&mux->lock);
+
+	while (!list_empty(&mux->kcm_tx_waiters)) {
 		kcm = list_first_entry(&mux->kcm_tx_waiters,
 				       struct kcm_sock,
 				       wait_psock_list);
+		psock = kcm_grab_psock(kcm);
+		if (!psock)
+			break;
+
 		list_del(&kcm->wait_psock_list);
 		kcm->tx_wait = false;
-		psock->tx_kcm = kcm;
 
 		/* Commit before changing tx_psock since that is read in
 		 * reserve_psock before queuing work.
@@ -516,9 +742,10 @@ static void psock_now_avail(struct kcm_psock *psock)
 		smp_mb();
 
 		kcm->tx_psock = psock;
-		KCM_STATS_INCR(psock->stats.reserved);
 		queue_work(kcm_wq, &kcm->tx_work);
 	}
+
+	spin_unlock_bh(&mux->lock);
 }
 
 /* kcm sock is locked. */
@@ -526,19 +753,19 @@ static void unreserve_psock(struct kcm_sock *kcm)
 {
 	struct kcm_psock *psock;
 	struct kcm_mux *mux = kcm->mux;
-
-	spin_lock_bh(&mux->lock);
+	struct kcm_mux_shard *shard;
 
 	psock = kcm->tx_psock;
 
-	if (WARN_ON(!psock)) {
-		spin_unlock_bh(&mux->lock);
+	if (WARN_ON(!psock))
 		return;
-	}
+
+	shard = psock->tx_shard;
+	spin_lock_bh(&shard->lock);
 
 	smp_rmb(); /* Read tx_psock before tx_wait */
 
-	kcm_update_tx_mux_stats(mux, psock);
+	kcm_update_tx_mux_stats(&shard->tx_stats, psock);
 
 	WARN_ON(kcm->tx_wait);
 
@@ -547,25 +774,32 @@ static void unreserve_psock(struct kcm_sock *kcm)
 	KCM_STATS_INCR(psock->stats.unreserved);
 
 	if (unlikely(psock->tx_stopped)) {
-		if (psock->done) {
+		bool done = psock->done;
+
+		/* Don't put back on available list */
+
+		spin_unlock_bh(&shard->lock);
+
+		if (done) {
 			/* Deferred free */
+			spin_lock_bh(&mux->lock);
 			list_del(&psock->psock_list);
 			mux->psocks_cnt--;
+			spin_unlock_bh(&mux->lock);
+
 			sock_put(psock->sk);
 			fput(psock->sk->sk_socket->file);
 			kmem_cache_free(kcm_psockp, psock);
 		}
 
-		/* Don't put back on available list */
-
-		spin_unlock_bh(&mux->lock);
-
 		return;
 	}
 
 	psock_now_avail(psock);
 
-	spin_unlock_bh(&mux->lock);
+	spin_unlock_bh(&shard->lock);
+
+	kcm_tx_match(mux);
 }
 
 static void kcm_report_tx_retry(struct kcm_sock *kcm)
@@ -1193,11 +1427,13 @@ static ssize_t kcm_splice_read(struct socket *sock, loff_t *ppos,
 static void kcm_recv_disable(struct kcm_sock *kcm)
 {
 	struct kcm_mux *mux = kcm->mux;
+	struct kcm_mux_shard *shard = kcm->rx_shard;
 
 	if (kcm->rx_disabled)
 		return;
 
 	spin_lock_bh(&mux->rx_lock);
+	spin_lock(&shard->rx_lock);
 
 	kcm->rx_disabled = 1;
 
@@ -1209,7 +1445,10 @@ static void kcm_recv_disable(struct kcm_sock *kcm)
 			WRITE_ONCE(kcm->rx_wait, false);
 		}
 
+		spin_unlock(&shard->rx_lock);
 		requeue_rx_msgs(mux, &kcm->sk.sk_receive_queue);
+	} else {
+		spin_unlock(&shard->rx_lock);
 	}
 
 	spin_unlock_bh(&mux->rx_lock);
@@ -1218,17 +1457,21 @@ static void kcm_recv_disable(struct kcm_sock *kcm)
 /* kcm sock lock held */
 static void kcm_recv_enable(struct kcm_sock *kcm)
 {
-	struct kcm_mux *mux = kcm->mux;
+	struct kcm_mux_shard *shard = kcm->rx_shard;
+	bool pending;
 
 	if (!kcm->rx_disabled)
 		return;
 
-	spin_lock_bh(&mux->rx_lock);
+	spin_lock_bh(&shard->rx_lock);
 
 	kcm->rx_disabled = 0;
-	kcm_rcv_ready(kcm);
+	pending = kcm_rcv_ready(kcm);
 
-	spin_unlock_bh(&mux->rx_lock);
+	spin_unlock_bh(&shard->rx_lock);
+
+	if (pending)
+		kcm_rx_match(kcm->mux);
 }
 
 static int kcm_setsockopt(struct socket *sock, int level, int optname,
@@ -1301,6 +1544,7 @@ static void init_kcm_sock(struct kcm_sock *kcm, struct kcm_mux *mux)
 	struct kcm_sock *tkcm;
 	struct list_head *head;
 	int index = 0;
+	bool pending;
 
 	/* For SOCK_SEQPACKET sock type, datagram_poll checks the sk_state, so
 	 * we set sk_state, otherwise epoll_wait always returns right away with
@@ -1322,15 +1566,19 @@ static void init_kcm_sock(struct kcm_sock *kcm, struct kcm_mux *mux)
 
 	list_add(&kcm->kcm_sock_list, head);
 	kcm->index = index;
+	kcm->rx_shard = &mux->shards[index % mux->nr_shards];
 
 	mux->kcm_socks_cnt++;
 	spin_unlock_bh(&mux->lock);
 
 	INIT_WORK(&kcm->tx_work, kcm_tx_work);
 
-	spin_lock_bh(&mux->rx_lock);
-	kcm_rcv_ready(kcm);
-	spin_unlock_bh(&mux->rx_lock);
+	spin_lock_bh(&kcm->rx_shard->rx_lock);
+	pending = kcm_rcv_ready(kcm);
+	spin_unlock_bh(&kcm->rx_shard->rx_lock);
+
+	if (pending)
+		kcm_rx_match(mux);
 }
 
 static int kcm_attach(struct socket *sock, struct socket *csock,
@@ -1343,7 +1591,7 @@ static int kcm_attach(struct socket *sock, struct socket *csock,
 	struct list_head *head;
 	int index = 0;
 	static const struct strp_callbacks cb = {
-		.rcv_msg = kcm_rcv_strparser,
+		.rcv_msgs = kcm_rcv_strparser,
 		.parse_msg = kcm_parse_func_strparser,
 		.read_sock_done = kcm_read_sock_done,
 	};
@@ -1421,12 +1669,19 @@ static int kcm_attach(struct socket *sock, struct socket *csock,
 
 	list_add(&psock->psock_list, head);
 	psock->index = index;
+	psock->tx_shard = &mux->shards[index % mux->nr_shards];
 
 	KCM_STATS_INCR(mux->stats.psock_attach);
 	mux->psocks_cnt++;
+
+	spin_lock(&psock->tx_shard->lock);
 	psock_now_avail(psock);
+	spin_unlock(&psock->tx_shard->lock);
+
 	spin_unlock_bh(&mux->lock);
 
+	kcm_tx_match(mux);
+
 	/* Schedule RX work in case there are already bytes queued */
 	strp_check_rcv(&psock->strp);
 
@@ -1470,6 +1725,7 @@ static void kcm_unattach(struct kcm_psock *psock)
 {
 	struct sock *csk = psock->sk;
 	struct kcm_mux *mux = psock->mux;
+	struct kcm_mux_shard *shard = psock->tx_shard;
 
 	lock_sock(csk);
 
@@ -1519,12 +1775,15 @@ static void kcm_unattach(struct kcm_psock *psock)
 
 	KCM_STATS_INCR(mux->stats.psock_unattach);
 
+	spin_lock(&shard->lock);
+
 	if (psock->tx_kcm) {
 		/* psock was reserved.  Just mark it finished and we will clean
 		 * up in the kcm paths, we need kcm lock which can not be
 		 * acquired here.
 		 */
 		KCM_STATS_INCR(mux->stats.psock_unattach_rsvd);
+		spin_unlock(&shard->lock);
 		spin_unlock_bh(&mux->lock);
 
 		/* We are unattaching a socket that is reserved. Abort the
@@ -1534,6 +1793,7 @@ static void kcm_unattach(struct kcm_psock *psock)
 		kcm_abort_tx_psock(psock, EPIPE, false);
 
 		spin_lock_bh(&mux->lock);
+		spin_lock(&shard->lock);
 		if (!psock->tx_kcm) {
 			/* psock now unreserved in window mux was unlocked */
 			goto no_reserved;
@@ -1545,11 +1805,13 @@ static void kcm_unattach(struct kcm_psock *psock)
 
 		/* Queue tx work to make sure psock->done is handled */
 		queue_work(kcm_wq, &psock->tx_kcm->tx_work);
+		spin_unlock(&shard->lock);
 		spin_unlock_bh(&mux->lock);
 	} else {
 no_reserved:
-		if (!psock->tx_stopped)
-			list_del(&psock->psock_avail_list);
+		list_del_init(&psock->psock_avail_list);
+		spin_unlock(&shard->lock);
+
 		list_del(&psock->psock_list);
 		mux->psocks_cnt--;
 		spin_unlock_bh(&mux->lock);
@@ -1730,6 +1992,7 @@ static void release_mux(struct kcm_mux *mux)
 
 	mutex_lock(&knet->mutex);
 	aggregate_mux_stats(&mux->stats, &knet->aggregate_mux_stats);
+	aggregate_mux_shard_stats(mux, &knet->aggregate_mux_stats);
 	aggregate_psock_stats(&mux->aggregate_psock_stats,
 			      &knet->aggregate_psock_stats);
 	aggregate_strp_stats(&mux->aggregate_strp_stats,
@@ -1744,15 +2007,18 @@ static void release_mux(struct kcm_mux *mux)
 static void kcm_done(struct kcm_sock *kcm)
 {
 	struct kcm_mux *mux = kcm->mux;
+	struct kcm_mux_shard *shard = kcm->rx_shard;
 	struct sock *sk = &kcm->sk;
 	int socks_cnt;
 
 	spin_lock_bh(&mux->rx_lock);
+	spin_lock(&shard->rx_lock);
 	if (kcm->rx_psock) {
 		/* Cleanup in unreserve_rx_kcm */
 		WARN_ON(kcm->done);
 		kcm->rx_disabled = 1;
 		kcm->done = 1;
+		spin_unlock(&shard->rx_lock);
 		spin_unlock_bh(&mux->rx_lock);
 		return;
 	}
@@ -1762,6 +2028,8 @@ static void kcm_done(struct kcm_sock *kcm)
 		/* paired with lockless reads in kcm_rfree() */
 		WRITE_ONCE(kcm->rx_wait, false);
 	}
+	spin_unlock(&shard->rx_lock);
+
 	/* Move any pending receive messages to other kcm sockets */
 	requeue_rx_msgs(mux, &sk->sk_receive_queue);
 
@@ -1910,6 +2178,7 @@ static int kcm_create(struct net *net, struct socket *sock,
 	struct kcm_net *knet = net_generic(net, kcm_net_id);
 	struct sock *sk;
 	struct kcm_mux *mux;
+	unsigned int i;
 
 	switch (sock->type) {
 	case SOCK_DGRAM:
@@ -1939,12 +2208,18 @@ static int kcm_create(struct net *net, struct socket *sock,
 	spin_lock_init(&mux->lock);
 	spin_lock_init(&mux->rx_lock);
 	INIT_LIST_HEAD(&mux->kcm_socks);
-	INIT_LIST_HEAD(&mux->kcm_rx_waiters);
 	INIT_LIST_HEAD(&mux->kcm_tx_waiters);
 
 	INIT_LIST_HEAD(&mux->psocks);
 	INIT_LIST_HEAD(&mux->psocks_ready);
-	INIT_LIST_HEAD(&mux->psocks_avail);
+
+	mux->nr_shards = min_t(unsigned int, nr_cpu_ids, KCM_MUX_SHARDS);
+	for (i = 0; i < mux->nr_shards; i++) {
+		spin_lock_init(&mux->shards[i].rx_lock);
+		INIT_LIST_HEAD(&mux->shards[i].kcm_rx_waiters);
+		spin_lock_init(&mux->shards[i].lock);
+		INIT_LIST_HEAD(&mux->shards[i].psocks_avail);
+	}
 
 	mux->knet = knet;
 
@@ -11,6 +11,8 @@
 #include <linux/rcupdate.h>
 #include <linux/jhash.h>
 #include <linux/types.h>
+#include <linux/bitops.h>
+#include <linux/prefetch.h>
 #include <linux/netfilter/ipset/ip_set_timeout.h>
 
 #define __ipset_dereference_protected(p, c)	rcu_dereference_protected(p, c)
@@ -65,18 +67,29 @@ tune_ahash_max(u8 curr, u32 multi)
 #define TUNE_AHASH_MAX(h, multi)
 #endif
 
-/* A hash bucket */
+/* A hash bucket
+ *
+ * The value area starts with one tag byte per slot, padded to a multiple
+ * of u64, followed by the array of the elements. The tag is the top byte
+ * of the element hash, so lookups compare a word of tags at a time and
+ * only touch the elements whose tag matches. With the header the tags of
+ * the first slots share the first cache line of the bucket.
+ */
 struct hbucket {
 	struct rcu_head rcu;	/* for call_rcu_bh */
 	/* Which positions are used in the array */
 	DECLARE_BITMAP(used, AHASH_MAX_TUNED);
 	u8 size;		/* size of the array */
 	u8 pos;			/* position of the first free entry */
-	unsigned char value[0]	/* the array of the values */
+	unsigned char value[0]	/* the tags and the array of the values */
 		__aligned(__alignof__(u64));
 };
 
-/* The hash table: the table size stored here in order to make resizing easy */
+/* The hash table: the table size stored here in order to make resizing easy.
+ * The bucket pointers are followed by a bitmap of the non-empty buckets,
+ * which is checked before the bucket pointer to skip empty buckets
+ * without touching the much larger pointer array.
+ */
 struct htable {
 	atomic_t ref;		/* References for resizing */
 	atomic_t uref;		/* References for dumping */
@@ -85,8 +98,57 @@ struct htable {
 };
 
 #define hbucket(h, i)		((h)->bucket[i])
+#define hbucket_map(h)		\
+	((unsigned long *)&(h)->bucket[jhash_size((h)->htable_bits)])
 #define ext_size(n, dsize)	\
-	(sizeof(struct hbucket) + (n) * (dsize))
+	(sizeof(struct hbucket) + (n) * ((dsize) + 1))
+
+/* Bytes of the tag area and of a whole bucket of n elements */
+#define AHASH_TAGS_SIZE(n)	ALIGN(n, sizeof(u64))
+#define hbucket_alloc_size(n, dsize)	\
+	(sizeof(struct hbucket) + AHASH_TAGS_SIZE(n) + (n) * (dsize))
+
+#define ahash_tags(n)		((n)->value)
+#define ahash_value(n, i, dsize)	\
+	((n)->value + AHASH_TAGS_SIZE((n)->size) + (i) * (dsize))
+
+/* Tag of an element: hash bits not used by the bucket index */
+#define HTAG(hash)		((u8)((hash) >> 24))
+
+/* Copy the used slots of bucket old into the larger bucket n, whose size
+ * must already be set.
+ */
+static void
+hbucket_copy(struct hbucket *n, const struct hbucket *old, size_t dsize)
+{
+	memcpy(n->used, old->used, sizeof(n->used));
+	n->pos = old->pos;
+	memcpy(ahash_tags(n), ahash_tags(old), old->size);
+	memcpy(ahash_value(n, 0, dsize), ahash_value(old, 0, dsize),
+	       old->size * dsize);
+}
+
+/* Load a word of tags so that tag i of the word is in byte i */
+static inline unsigned long
+ahash_tag_word(const u8 *tags)
+{
+#if BITS_PER_LONG == 64
+	return le64_to_cpup((const __le64 *)tags);
+#else
+	return le32_to_cpup((const __le32 *)tags);
+#endif
+}
+
+/* Candidate slots in a word of tags: the high bit of byte i is set if
+ * tag i may equal tag. There can be false positives, never false negatives.
+ */
+static inline unsigned long
+ahash_tag_match(unsigned long word, u8 tag)
+{
+	unsigned long x = word ^ REPEAT_BYTE(tag);
+
+	return (x - REPEAT_BYTE(0x01)) & ~x & REPEAT_BYTE(0x80);
+}
 
 #ifndef IPSET_NET_COUNT
 #define IPSET_NET_COUNT		1
@@ -108,11 +170,13 @@ htable_size(u8 hbits)
 	if (hbits > 31)
 		return 0;
 	hsize = jhash_size(hbits);
-	if ((INT_MAX - sizeof(struct htable)) / sizeof(struct hbucket *)
-	    < hsize)
+	if ((INT_MAX - sizeof(struct htable)) /
+	    (sizeof(struct hbucket *) + sizeof(unsigned long)) < hsize)
 		return 0;
 
-	return hsize * sizeof(struct hbucket *) + sizeof(struct htable);
+	return hsize * sizeof(struct hbucket *) +
+	       BITS_TO_LONGS(hsize) * sizeof(unsigned long) +
+	       sizeof(struct htable);
 }
 
 #ifdef IP_SET_HASH_WITH_NETS
@@ -193,6 +257,7 @@ htable_size(u8 hbits)
 #undef mtype_add
 #undef mtype_del
 #undef mtype_test_cidrs
+#undef mtype_bucket_test
 #undef mtype_test
 #undef mtype_uref
 #undef mtype_expire
@@ -235,6 +300,7 @@ htable_size(u8 hbits)
 #define mtype_add		IPSET_TOKEN(MTYPE, _add)
 #define mtype_del		IPSET_TOKEN(MTYPE, _del)
 #define mtype_test_cidrs	IPSET_TOKEN(MTYPE, _test_cidrs)
+#define mtype_bucket_test	IPSET_TOKEN(MTYPE, _bucket_test)
 #define mtype_test		IPSET_TOKEN(MTYPE, _test)
 #define mtype_uref		IPSET_TOKEN(MTYPE, _uref)
 #define mtype_expire		IPSET_TOKEN(MTYPE, _expire)
@@ -252,16 +318,19 @@ htable_size(u8 hbits)
 
 #define htype			MTYPE
 
-#define HKEY(data, initval, htable_bits)			\
+#define HKEY_HASH(data, initval)				\
 ({								\
 	const u32 *__k = (const u32 *)data;			\
 	u32 __l = HKEY_DATALEN / sizeof(u32);			\
 								\
 	BUILD_BUG_ON(HKEY_DATALEN % sizeof(u32) != 0);		\
 								\
-	jhash2(__k, __l, initval) & jhash_mask(htable_bits);	\
+	jhash2(__k, __l, initval);				\
 })
 
+#define HKEY(data, initval, htable_bits)			\
+	(HKEY_HASH(data, initval) & jhash_mask(htable_bits))
+
 /* The generic hash structure */
 struct htype {
 	struct htable __rcu *table; /* the hash table */
@@ -335,12 +404,14 @@ mtype_del_cidr(struct htype *h, u8 cidr, u8 n)
 static size_t
 mtype_ahash_memsize(const struct htype *h, const struct htable *t)
 {
-	return sizeof(*h) + sizeof(*t);
+	return sizeof(*h) + sizeof(*t) +
+	       BITS_TO_LONGS(jhash_size(t->htable_bits)) *
+	       sizeof(unsigned long);
 }
 
 /* Get the ith element from the array block n */
 #define ahash_data(n, i, dsize)	\
-	((struct mtype_elem *)((n)->value + ((i) * (dsize))))
+	((struct mtype_elem *)ahash_value(n, i, dsize))
 
 static void
 mtype_ext_cleanup(struct ip_set *set, struct hbucket *n)
@@ -370,6 +441,7 @@ mtype_flush(struct ip_set *set)
 			mtype_ext_cleanup(set, n);
 		/* FIXME: use slab cache */
 		rcu_assign_pointer(hbucket(t, i), NULL);
+		__clear_bit(i, hbucket_map(t));
 		kfree_rcu(n, rcu);
 	}
 #ifdef IP_SET_HASH_WITH_NETS
@@ -486,11 +558,13 @@ mtype_expire(struct ip_set *set, struct htype *h)
 		if (d >= AHASH_INIT_SIZE) {
 			if (d >= n->size) {
 				rcu_assign_pointer(hbucket(t, i), NULL);
+				__clear_bit(i, hbucket_map(t));
 				kfree_rcu(n, rcu);
 				continue;
 			}
-			tmp = kzalloc(sizeof(*tmp) +
-				      (n->size - AHASH_INIT_SIZE) * dsize,
+			tmp = kzalloc(hbucket_alloc_size(n->size -
+							 AHASH_INIT_SIZE,
+							 dsize),
 				      GFP_ATOMIC);
 			if (!tmp)
 				/* Still try to delete expired elements */
@@ -500,7 +574,8 @@ mtype_expire(struct ip_set *set, struct htype *h)
 				if (!test_bit(j, n->used))
 					continue;
 				data = ahash_data(n, j, dsize);
-				memcpy(tmp->value + d * dsize, data, dsize);
+				memcpy(ahash_data(tmp, d, dsize), data, dsize);
+				ahash_tags(tmp)[d] = ahash_tags(n)[j];
 				set_bit(d, tmp->used);
 				d++;
 			}
@@ -545,7 +620,7 @@ mtype_resize(struct ip_set *set, bool retried)
 	struct mtype_elem *data;
 	struct mtype_elem *d;
 	struct hbucket *n, *m;
-	u32 i, j, key;
+	u32 i, j, key, hash;
 	int ret;
 
 #ifdef IP_SET_HASH_WITH_NETS
@@ -600,11 +675,12 @@ mtype_resize(struct ip_set *set, bool retried)
 			data = tmp;
 			mtype_data_reset_flags(data, &flags);
 #endif
-			key = HKEY(data, h->initval, htable_bits);
+			hash = HKEY_HASH(data, h->initval);
+			key = hash & jhash_mask(htable_bits);
 			m = __ipset_dereference_protected(hbucket(t, key), 1);
 			if (!m) {
-				m = kzalloc(sizeof(*m) +
-					    AHASH_INIT_SIZE * dsize,
+				m = kzalloc(hbucket_alloc_size(AHASH_INIT_SIZE,
+							       dsize),
 					    GFP_ATOMIC);
 				if (!m) {
 					ret = -ENOMEM;
@@ -613,24 +689,24 @@ mtype_resize(struct ip_set *set, bool retried)
 				m->size = AHASH_INIT_SIZE;
 				extsize += ext_size(AHASH_INIT_SIZE, dsize);
 				RCU_INIT_POINTER(hbucket(t, key), m);
+				__set_bit(key, hbucket_map(t));
 			} else if (m->pos >= m->size) {
 				struct hbucket *ht;
 
 				if (m->size >= AHASH_MAX(h)) {
 					ret = -EAGAIN;
 				} else {
-					ht = kzalloc(sizeof(*ht) +
-						(m->size + AHASH_INIT_SIZE)
-						* dsize,
+					ht = kzalloc(hbucket_alloc_size(
+						m->size + AHASH_INIT_SIZE,
+						dsize),
 						GFP_ATOMIC);
 					if (!ht)
 						ret = -ENOMEM;
 				}
 				if (ret < 0)
 					goto cleanup;
-				memcpy(ht, m, sizeof(struct hbucket) +
-					      m->size * dsize);
 				ht->size = m->size + AHASH_INIT_SIZE;
+				hbucket_copy(ht, m, dsize);
 				extsize += ext_size(AHASH_INIT_SIZE, dsize);
 				kfree(m);
 				m = ht;
@@ -638,6 +714,7 @@ mtype_resize(struct ip_set *set, bool retried)
 			}
 			d = ahash_data(m, m->pos, dsize);
 			memcpy(d, data, dsize);
+			ahash_tags(m)[m->pos] = HTAG(hash);
 			set_bit(m->pos++, m->used);
 #ifdef IP_SET_HASH_WITH_NETS
 			mtype_data_reset_flags(d, &flags);
@@ -691,7 +768,7 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	int i, j = -1;
 	bool flag_exist = flags & IPSET_FLAG_EXIST;
 	bool deleted = false, forceadd = false, reuse = false;
-	u32 key, multi = 0;
+	u32 key, hash, multi = 0;
 
 	if (set->elements >= h->maxelem) {
 		if (SET_WITH_TIMEOUT(set))
@@ -702,13 +779,14 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	}
 
 	t = ipset_dereference_protected(h->table, set);
-	key = HKEY(value, h->initval, t->htable_bits);
+	hash = HKEY_HASH(value, h->initval);
+	key = hash & jhash_mask(t->htable_bits);
 	n = __ipset_dereference_protected(hbucket(t, key), 1);
 	if (!n) {
 		if (forceadd || set->elements >= h->maxelem)
 			goto set_full;
 		old = NULL;
-		n = kzalloc(sizeof(*n) + AHASH_INIT_SIZE * set->dsize,
+		n = kzalloc(hbucket_alloc_size(AHASH_INIT_SIZE, set->dsize),
 			    GFP_ATOMIC);
 		if (!n)
 			return -ENOMEM;
@@ -769,14 +847,13 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 			return -EAGAIN;
 		}
 		old = n;
-		n = kzalloc(sizeof(*n) +
-			    (old->size + AHASH_INIT_SIZE) * set->dsize,
+		n = kzalloc(hbucket_alloc_size(old->size + AHASH_INIT_SIZE,
+					       set->dsize),
 			    GFP_ATOMIC);
 		if (!n)
 			return -ENOMEM;
-		memcpy(n, old, sizeof(struct hbucket) +
-		       old->size * set->dsize);
 		n->size = old->size + AHASH_INIT_SIZE;
+		hbucket_copy(n, old, set->dsize);
 		set->ext_size += ext_size(AHASH_INIT_SIZE, set->dsize);
 	}
 
@@ -790,6 +867,7 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 		mtype_add_cidr(h, NCIDR_PUT(DCIDR_GET(d->cidr, i)), i);
 #endif
 	memcpy(data, d, sizeof(struct mtype_elem));
+	ahash_tags(n)[j] = HTAG(hash);
 overwrite_extensions:
 #ifdef IP_SET_HASH_WITH_NETS
 	mtype_data_set_flags(data, flags);
@@ -806,6 +884,8 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	smp_mb__before_atomic();
 	set_bit(j, n->used);
 	if (old != ERR_PTR(-ENOENT)) {
+		if (!old)
+			__set_bit(key, hbucket_map(t));
 		rcu_assign_pointer(hbucket(t, key), n);
 		if (old)
 			kfree_rcu(old, rcu);
@@ -871,10 +951,11 @@ mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 		if (n->pos == 0 && k == 0) {
 			set->ext_size -= ext_size(n->size, dsize);
 			rcu_assign_pointer(hbucket(t, key), NULL);
+			__clear_bit(key, hbucket_map(t));
 			kfree_rcu(n, rcu);
 		} else if (k >= AHASH_INIT_SIZE) {
-			struct hbucket *tmp = kzalloc(sizeof(*tmp) +
-					(n->size - AHASH_INIT_SIZE) * dsize,
+			struct hbucket *tmp = kzalloc(hbucket_alloc_size(
+					n->size - AHASH_INIT_SIZE, dsize),
 					GFP_ATOMIC);
 			if (!tmp)
 				goto out;
@@ -883,7 +964,8 @@ mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 				if (!test_bit(j, n->used))
 					continue;
 				data = ahash_data(n, j, dsize);
-				memcpy(tmp->value + k * dsize, data, dsize);
+				memcpy(ahash_data(tmp, k, dsize), data, dsize);
+				ahash_tags(tmp)[k] = ahash_tags(n)[j];
 				set_bit(k, tmp->used);
 				k++;
 			}
@@ -909,7 +991,53 @@ mtype_data_match(struct mtype_elem *data, const struct ip_set_ext *ext,
 	return mtype_do_data_match(data);
 }
 
+/* Test the elements of bucket n whose tag matches the element hash:
+ * a word of tags is compared at once and only the candidate slots are
+ * compared in full.
+ */
+static int
+mtype_bucket_test(struct ip_set *set, struct hbucket *n, u32 hash,
+		  struct mtype_elem *d, const struct ip_set_ext *ext,
+		  struct ip_set_ext *mext, u32 flags, u32 *multi)
+{
+	struct mtype_elem *data;
+	unsigned long cand;
+	int i, j, ret;
+
+	for (i = 0; i < n->pos; i += sizeof(unsigned long)) {
+#ifdef IP_SET_HASH_WITH_MULTI
+		/* Partial matches are counted in multi: check all slots */
+		cand = REPEAT_BYTE(0x80);
+#else
+		cand = ahash_tag_match(ahash_tag_word(ahash_tags(n) + i),
+				       HTAG(hash));
+#endif
+		while (cand) {
+			j = i + __ffs(cand) / BITS_PER_BYTE;
+			cand &= cand - 1;
+			if (j >= n->pos)
+				break;
+			if (!test_bit(j, n->used))
+				continue;
+			data = ahash_data(n, j, set->dsize);
+			if (!mtype_data_equal(data, d, multi))
+				continue;
+			ret = mtype_data_match(data, ext, mext, set, flags);
+			if (ret != 0)
+				return ret;
+#ifdef IP_SET_HASH_WITH_MULTI
+			/* No match, reset multiple match flag */
+			*multi = 0;
+#endif
+		}
+	}
+	return 0;
+}
+
 #ifdef IP_SET_HASH_WITH_NETS
+/* Number of prefix lengths hashed ahead of probing their buckets */
+#define AHASH_TEST_BATCH	8
+
 /* Special test function which takes into account the different network
  * sizes added to the set
  */
@@ -920,50 +1048,79 @@ mtype_test_cidrs(struct ip_set *set, struct mtype_elem *d,
 {
 	struct htype *h = set->data;
 	struct htable *t = rcu_dereference_bh(h->table);
+	unsigned long *map = hbucket_map(t);
 	struct hbucket *n;
-	struct mtype_elem *data;
 #if IPSET_NET_COUNT == 2
 	struct mtype_elem orig = *d;
-	int ret, i, j = 0, k;
+	int ret, j = 0, k;
+	u32 hash;
 #else
-	int ret, i, j = 0;
+	struct mtype_elem start;
+	u32 hashes[AHASH_TEST_BATCH];
+	int ret, j = 0, k, b;
 #endif
 	u32 key, multi = 0;
 
 	pr_debug("test by nets\n");
-	for (; j < NLEN && h->nets[j].cidr[0] && !multi; j++) {
 #if IPSET_NET_COUNT == 2
+	for (; j < NLEN && h->nets[j].cidr[0] && !multi; j++) {
 		mtype_data_reset_elem(d, &orig);
 		mtype_data_netmask(d, NCIDR_GET(h->nets[j].cidr[0]), false);
 		for (k = 0; k < NLEN && h->nets[k].cidr[1] && !multi;
 		     k++) {
 			mtype_data_netmask(d, NCIDR_GET(h->nets[k].cidr[1]),
 					   true);
-#else
-		mtype_data_netmask(d, NCIDR_GET(h->nets[j].cidr[0]));
-#endif
-		key = HKEY(d, h->initval, t->htable_bits);
-		n =  rcu_dereference_bh(hbucket(t, key));
-		if (!n)
-			continue;
-		for (i = 0; i < n->pos; i++) {
-			if (!test_bit(i, n->used))
+			hash = HKEY_HASH(d, h->initval);
+			key = hash & jhash_mask(t->htable_bits);
+			/* Prefix pair with no bucket: nothing to compare */
+			if (!test_bit(key, map))
 				continue;
-			data = ahash_data(n, i, set->dsize);
-			if (!mtype_data_equal(data, d, &multi))
+			n = rcu_dereference_bh(hbucket(t, key));
+			if (!n)
 				continue;
-			ret = mtype_data_match(data, ext, mext, set, flags);
+			ret = mtype_bucket_test(set, n, hash, d, ext, mext,
+						flags, &multi);
 			if (ret != 0)
 				return ret;
-#ifdef IP_SET_HASH_WITH_MULTI
-			/* No match, reset multiple match flag */
-			multi = 0;
-#endif
 		}
-#if IPSET_NET_COUNT == 2
+	}
+#else
+	/* Prefixes are stored from the longest one and masking is
+	 * cumulative: hash a batch of them and prefetch the buckets which
+	 * exist, then mask again from the batch start and probe them.
+	 */
+	for (; j < NLEN && h->nets[j].cidr[0] && !multi; j += b) {
+		start = *d;
+		for (b = 0; b < AHASH_TEST_BATCH && j + b < NLEN &&
+		     h->nets[j + b].cidr[0]; b++) {
+			mtype_data_netmask(d, NCIDR_GET(h->nets[j + b].cidr[0]));
+			hashes[b] = HKEY_HASH(d, h->initval);
+			key = hashes[b] & jhash_mask(t->htable_bits);
+			if (!test_bit(key, map))
+				continue;
+			/* the header and the tags share the first line */
+			n = rcu_dereference_bh(hbucket(t, key));
+			if (n)
+				prefetch(n);
+		}
+		if (!b)
+			break;
+		*d = start;
+		for (k = 0; k < b && !multi; k++) {
+			mtype_data_netmask(d, NCIDR_GET(h->nets[j + k].cidr[0]));
+			key = hashes[k] & jhash_mask(t->htable_bits);
+			if (!test_bit(key, map))
+				continue;
+			n = rcu_dereference_bh(hbucket(t, key));
+			if (!n)
+				continue;
+			ret = mtype_bucket_test(set, n, hashes[k], d, ext,
+						mext, flags, &multi);
+			if (ret != 0)
+				return ret;
 		}
-#endif
 	}
+#endif
 	return 0;
 }
 #endif
@@ -977,9 +1134,11 @@ mtype_test(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	struct htable *t;
 	struct mtype_elem *d = value;
 	struct hbucket *n;
-	struct mtype_elem *data;
-	int i, ret = 0;
-	u32 key, multi = 0;
+	int ret = 0;
+	u32 hash, key, multi = 0;
+#ifdef IP_SET_HASH_WITH_NETS
+	int i;
+#endif
 
 	t = rcu_dereference_bh(h->table);
 #ifdef IP_SET_HASH_WITH_NETS
@@ -995,22 +1154,14 @@ mtype_test(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	}
 #endif
 
-	key = HKEY(d, h->initval, t->htable_bits);
+	hash = HKEY_HASH(d, h->initval);
+	key = hash & jhash_mask(t->htable_bits);
+	if (!test_bit(key, hbucket_map(t)))
+		goto out;
 	n = rcu_dereference_bh(hbucket(t, key));
-	if (!n) {
-		ret = 0;
+	if (!n)
 		goto out;
-	}
-	for (i = 0; i < n->pos; i++) {
-		if (!test_bit(i, n->used))
-			continue;
-		data = ahash_data(n, i, set->dsize);
-		if (!mtype_data_equal(data, d, &multi))
-			continue;
-		ret = mtype_data_match(data, ext, mext, set, flags);
-		if (ret != 0)
-			goto out;
-	}
+	ret = mtype_bucket_test(set, n, hash, d, ext, mext, flags, &multi);
 out:
 	return ret;
 }
@@ -37,6 +37,9 @@
 #include <linux/seq_file.h>
 #include <linux/jhash.h>
 #include <linux/random.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
 
 #include <net/net_namespace.h>
 #include <net/ip_vs.h>
@@ -48,19 +51,40 @@
 
 /*
  * Connection hash size. Default is what was selected at compile time.
+ * The table grows with the number of connections up to conn_tab_max_bits
+ * and shrinks back, but never below conn_tab_bits.
 */
 static int ip_vs_conn_tab_bits = CONFIG_IP_VS_TAB_BITS;
 module_param_named(conn_tab_bits, ip_vs_conn_tab_bits, int, 0444);
 MODULE_PARM_DESC(conn_tab_bits, "Set connections' hash size");
 
-/* size and mask values */
+static int ip_vs_conn_tab_max_bits = 22;
+module_param_named(conn_tab_max_bits, ip_vs_conn_tab_max_bits, int, 0444);
+MODULE_PARM_DESC(conn_tab_max_bits, "Set connections' maximum hash size");
+
+/* size of the current table */
 int ip_vs_conn_tab_size __read_mostly;
-static int ip_vs_conn_tab_mask __read_mostly;
+
+struct ip_vs_conn_htable {
+	unsigned int		mask;
+	struct hlist_head	buckets[];
+};
 
 /*
- *  Connection hash table: for input and output packets lookups of IPVS
+ *  Connection hash table: for input and output packets lookups of IPVS.
+ *  While the table is resized, ip_vs_conn_tab_new is the table being
+ *  filled, see ip_vs_conn_tab_resize().
  */
-static struct hlist_head *ip_vs_conn_tab __read_mostly;
+static struct ip_vs_conn_htable __rcu *ip_vs_conn_tab __read_mostly;
+static struct ip_vs_conn_htable __rcu *ip_vs_conn_tab_new;
+
+/* number of hashed connections, in all netns */
+static atomic_t ip_vs_conn_tab_count = ATOMIC_INIT(0);
+static unsigned int ip_vs_conn_tab_resizes;
+
+static DEFINE_MUTEX(ip_vs_conn_resize_mutex);
+static void ip_vs_conn_resize_work_fn(struct work_struct *work);
+static DECLARE_WORK(ip_vs_conn_resize_work, ip_vs_conn_resize_work_fn);
 
 /*  SLAB cache for IPVS connections */
 static struct kmem_cache *ip_vs_conn_cachep __read_mostly;
@@ -72,12 +96,18 @@ static atomic_t ip_vs_conn_no_cport_cnt = ATOMIC_INIT(0);
 static unsigned int ip_vs_conn_rnd __read_mostly;
 
 /*
- *  Fine locking granularity for big connection hash table
+ *  Fine locking granularity for big connection hash table.
+ *  Lock groups are selected by the low bits of the unmasked hash, so all
+ *  buckets of a group share these bits and a connection stays in the same
+ *  group whatever the table size.
  */
 #define CT_LOCKARRAY_BITS  5
 #define CT_LOCKARRAY_SIZE  (1<<CT_LOCKARRAY_BITS)
 #define CT_LOCKARRAY_MASK  (CT_LOCKARRAY_SIZE-1)
 
+/* group buckets moved per lock hold during resize */
+#define CT_RESIZE_CHUNK    128
+
 /* We need an addrstrlen that works with or without v6 */
 #ifdef CONFIG_IP_VS_IPV6
 #define IP_VS_ADDRSTRLEN INET6_ADDRSTRLEN
@@ -88,6 +118,8 @@ static unsigned int ip_vs_conn_rnd __read_mostly;
 struct ip_vs_aligned_lock
 {
 	spinlock_t	l;
+	seqcount_t	seq;	/* bumped while group buckets move */
+	unsigned int	moved;	/* group buckets moved to the new table */
 } __attribute__((__aligned__(SMP_CACHE_BYTES)));
 
 /* lock array for conn table */
@@ -104,6 +136,43 @@ static inline void ct_write_unlock_bh(unsigned int key)
 	spin_unlock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
 }
 
+static inline struct hlist_head *ct_bucket(struct ip_vs_conn_htable *t,
+					   unsigned int hash)
+{
+	return &t->buckets[hash & t->mask];
+}
+
+/* Bucket for a connection with @hash, called with its group lock held */
+static struct hlist_head *ct_locked_bucket(unsigned int hash)
+{
+	struct ip_vs_aligned_lock *lk =
+		&__ip_vs_conntbl_lock_array[hash & CT_LOCKARRAY_MASK];
+	struct ip_vs_conn_htable *t;
+
+	t = rcu_dereference_protected(ip_vs_conn_tab, 1);
+	if (((hash & t->mask) >> CT_LOCKARRAY_BITS) < lk->moved)
+		t = rcu_dereference_protected(ip_vs_conn_tab_new, 1);
+	return ct_bucket(t, hash);
+}
+
+static void ip_vs_conn_tab_inc(void)
+{
+	int n = atomic_inc_return(&ip_vs_conn_tab_count);
+
+	if (n > READ_ONCE(ip_vs_conn_tab_size) &&
+	    READ_ONCE(ip_vs_conn_tab_size) < (1 << ip_vs_conn_tab_max_bits))
+		schedule_work(&ip_vs_conn_resize_work);
+}
+
+static void ip_vs_conn_tab_dec(void)
+{
+	int n = atomic_dec_return(&ip_vs_conn_tab_count);
+
+	if (n < READ_ONCE(ip_vs_conn_tab_size) / 8 &&
+	    READ_ONCE(ip_vs_conn_tab_size) > (1 << ip_vs_conn_tab_bits))
+		schedule_work(&ip_vs_conn_resize_work);
+}
+
 static void ip_vs_conn_expire(struct timer_list *t);
 
 /*
@@ -115,13 +184,13 @@ static unsigned int ip_vs_conn_hashkey(struct netns_ipvs *ipvs, int af, unsigned
 {
 #ifdef CONFIG_IP_VS_IPV6
 	if (af == AF_INET6)
-		return (jhash_3words(jhash(addr, 16, ip_vs_conn_rnd),
+		return jhash_3words(jhash(addr, 16, ip_vs_conn_rnd),
 				    (__force u32)port, proto, ip_vs_conn_rnd) ^
-			((size_t)ipvs>>8)) & ip_vs_conn_tab_mask;
+			((size_t)ipvs>>8);
 #endif
-	return (jhash_3words((__force u32)addr->ip, (__force u32)port, proto,
+	return jhash_3words((__force u32)addr->ip, (__force u32)port, proto,
 			    ip_vs_conn_rnd) ^
-		((size_t)ipvs>>8)) & ip_vs_conn_tab_mask;
+		((size_t)ipvs>>8);
 }
 
 static unsigned int ip_vs_conn_hashkey_param(const struct ip_vs_conn_param *p,
@@ -131,8 +200,7 @@ static unsigned int ip_vs_conn_hashkey_param(const struct ip_vs_conn_param *p,
 	__be16 port;
 
 	if (p->pe_data && p->pe->hashkey_raw)
-		return p->pe->hashkey_raw(p, ip_vs_conn_rnd, inverse) &
-			ip_vs_conn_tab_mask;
+		return p->pe->hashkey_raw(p, ip_vs_conn_rnd, inverse);
 
 	if (likely(!inverse)) {
 		addr = p->caddr;
@@ -182,7 +250,7 @@ static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 	if (!(cp->flags & IP_VS_CONN_F_HASHED)) {
 		cp->flags |= IP_VS_CONN_F_HASHED;
 		refcount_inc(&cp->refcnt);
-		hlist_add_head_rcu(&cp->c_list, &ip_vs_conn_tab[hash]);
+		hlist_add_head_rcu(&cp->c_list, ct_locked_bucket(hash));
 		ret = 1;
 	} else {
 		pr_err("%s(): request for already hashed, called from %pS\n",
@@ -193,6 +261,9 @@ static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 	spin_unlock(&cp->lock);
 	ct_write_unlock_bh(hash);
 
+	if (ret)
+		ip_vs_conn_tab_inc();
+
 	return ret;
 }
 
@@ -223,6 +294,9 @@ static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 	spin_unlock(&cp->lock);
 	ct_write_unlock_bh(hash);
 
+	if (ret)
+		ip_vs_conn_tab_dec();
+
 	return ret;
 }
 
@@ -254,10 +328,68 @@ static inline bool ip_vs_conn_unlink(struct ip_vs_conn *cp)
 	spin_unlock(&cp->lock);
 	ct_write_unlock_bh(hash);
 
+	if (ret)
+		ip_vs_conn_tab_dec();
+
 	return ret;
 }
 
 
+/*
+ *  Lockless walk of the chain for @hash, in the current table and, while
+ *  it is resized, in the new one.  A miss is retried if buckets of the
+ *  lock group moved meanwhile.  Returns the first connection for which
+ *  @match() is true and a reference could be taken.
+ *  Called under rcu_read_lock().
+ */
+static __always_inline struct ip_vs_conn *
+ip_vs_conn_find(const struct ip_vs_conn_param *p, unsigned int hash,
+		bool (*match)(const struct ip_vs_conn *cp,
+			      const struct ip_vs_conn_param *p))
+{
+	struct ip_vs_aligned_lock *lk =
+		&__ip_vs_conntbl_lock_array[hash & CT_LOCKARRAY_MASK];
+	struct ip_vs_conn_htable *t, *nt;
+	struct ip_vs_conn *cp;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&lk->seq);
+		/* the new table is published before, and retired after,
+		 * the current one is switched
+		 */
+		nt = rcu_dereference(ip_vs_conn_tab_new);
+		smp_rmb();
+		t = rcu_dereference(ip_vs_conn_tab);
+
+		hlist_for_each_entry_rcu(cp, ct_bucket(t, hash), c_list) {
+			if (match(cp, p) && __ip_vs_conn_get(cp))
+				return cp;
+		}
+		if (nt && nt != t) {
+			hlist_for_each_entry_rcu(cp, ct_bucket(nt, hash),
+						 c_list) {
+				if (match(cp, p) && __ip_vs_conn_get(cp))
+					return cp;
+			}
+		}
+	} while (read_seqcount_retry(&lk->seq, seq));
+
+	return NULL;
+}
+
+static inline bool ip_vs_conn_in_match(const struct ip_vs_conn *cp,
+				       const struct ip_vs_conn_param *p)
+{
+	return p->cport == cp->cport && p->vport == cp->vport &&
+	       cp->af == p->af &&
+	       ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
+	       ip_vs_addr_equal(p->af, p->vaddr, &cp->vaddr) &&
+	       ((!p->cport) ^ (!(cp->flags & IP_VS_CONN_F_NO_CPORT))) &&
+	       p->protocol == cp->protocol &&
+	       cp->ipvs == p->ipvs;
+}
+
 /*
  *  Gets ip_vs_conn associated with supplied parameters in the ip_vs_conn_tab.
  *  Called for pkts coming from OUTside-to-INside.
@@ -273,26 +405,10 @@ __ip_vs_conn_in_get(const struct ip_vs_conn_param *p)
 	hash = ip_vs_conn_hashkey_param(p, false);
 
 	rcu_read_lock();
-
-	hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[hash], c_list) {
-		if (p->cport == cp->cport && p->vport == cp->vport &&
-		    cp->af == p->af &&
-		    ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
-		    ip_vs_addr_equal(p->af, p->vaddr, &cp->vaddr) &&
-		    ((!p->cport) ^ (!(cp->flags & IP_VS_CONN_F_NO_CPORT))) &&
-		    p->protocol == cp->protocol &&
-		    cp->ipvs == p->ipvs) {
-			if (!__ip_vs_conn_get(cp))
-				continue;
-			/* HIT */
-			rcu_read_unlock();
-			return cp;
-		}
-	}
-
+	cp = ip_vs_conn_find(p, hash, ip_vs_conn_in_match);
 	rcu_read_unlock();
 
-	return NULL;
+	return cp;
 }
 
 struct ip_vs_conn *ip_vs_conn_in_get(const struct ip_vs_conn_param *p)
@@ -350,6 +466,25 @@ ip_vs_conn_in_get_proto(struct netns_ipvs *ipvs, int af,
 }
 EXPORT_SYMBOL_GPL(ip_vs_conn_in_get_proto);
 
+static inline bool ip_vs_ct_in_match(const struct ip_vs_conn *cp,
+				     const struct ip_vs_conn_param *p)
+{
+	if (unlikely(p->pe_data && p->pe->ct_match))
+		return cp->ipvs == p->ipvs &&
+		       p->pe == cp->pe && p->pe->ct_match(p, cp);
+
+	return cp->af == p->af &&
+	       ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
+	       /* protocol should only be IPPROTO_IP if
+		* p->vaddr is a fwmark */
+	       ip_vs_addr_equal(p->protocol == IPPROTO_IP ? AF_UNSPEC :
+				p->af, p->vaddr, &cp->vaddr) &&
+	       p->vport == cp->vport && p->cport == cp->cport &&
+	       cp->flags & IP_VS_CONN_F_TEMPLATE &&
+	       p->protocol == cp->protocol &&
+	       cp->ipvs == p->ipvs;
+}
+
 /* Get reference to connection template */
 struct ip_vs_conn *ip_vs_ct_in_get(const struct ip_vs_conn_param *p)
 {
@@ -359,35 +494,7 @@ struct ip_vs_conn *ip_vs_ct_in_get(const struct ip_vs_conn_param *p)
 	hash = ip_vs_conn_hashkey_param(p, false);
 
 	rcu_read_lock();
-
-	hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[hash], c_list) {
-		if (unlikely(p->pe_data && p->pe->ct_match)) {
-			if (cp->ipvs != p->ipvs)
-				continue;
-			if (p->pe == cp->pe && p->pe->ct_match(p, cp)) {
-				if (__ip_vs_conn_get(cp))
-					goto out;
-			}
-			continue;
-		}
-
-		if (cp->af == p->af &&
-		    ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
-		    /* protocol should only be IPPROTO_IP if
-		     * p->vaddr is a fwmark */
-		    ip_vs_addr_equal(p->protocol == IPPROTO_IP ? AF_UNSPEC :
-				     p->af, p->vaddr, &cp->vaddr) &&
-		    p->vport == cp->vport && p->cport == cp->cport &&
-		    cp->flags & IP_VS_CONN_F_TEMPLATE &&
-		    p->protocol == cp->protocol &&
-		    cp->ipvs == p->ipvs) {
-			if (__ip_vs_conn_get(cp))
-				goto out;
-		}
-	}
-	cp = NULL;
-
-  out:
+	cp = ip_vs_conn_find(p, hash, ip_vs_ct_in_match);
 	rcu_read_unlock();
 
 	IP_VS_DBG_BUF(9, "template lookup/in %s %s:%d->%s:%d %s\n",
@@ -399,6 +506,17 @@ struct ip_vs_conn *ip_vs_ct_in_get(const struct ip_vs_conn_param *p)
 	return cp;
 }
 
+static inline bool ip_vs_conn_out_match(const struct ip_vs_conn *cp,
+					const struct ip_vs_conn_param *p)
+{
+	return p->vport == cp->cport && p->cport == cp->dport &&
+	       cp->af == p->af &&
+	       ip_vs_addr_equal(p->af, p->vaddr, &cp->caddr) &&
+	       ip_vs_addr_equal(p->af, p->caddr, &cp->daddr) &&
+	       p->protocol == cp->protocol &&
+	       cp->ipvs == p->ipvs;
+}
+
 /* Gets ip_vs_conn associated with supplied parameters in the ip_vs_conn_tab.
  * Called for pkts coming from inside-to-OUTside.
  *	p->caddr, p->cport: pkt source address (inside host)
@@ -406,7 +524,7 @@ struct ip_vs_conn *ip_vs_ct_in_get(const struct ip_vs_conn_param *p)
 struct ip_vs_conn *ip_vs_conn_out_get(const struct ip_vs_conn_param *p)
 {
 	unsigned int hash;
-	struct ip_vs_conn *cp, *ret=NULL;
+	struct ip_vs_conn *ret;
 
 	/*
 	 *	Check for "full" addressed entries
@@ -414,22 +532,7 @@ struct ip_vs_conn *ip_vs_conn_out_get(const struct ip_vs_conn_param *p)
 	hash = ip_vs_conn_hashkey_param(p, true);
 
 	rcu_read_lock();
-
-	hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[hash], c_list) {
-		if (p->vport == cp->cport && p->cport == cp->dport &&
-		    cp->af == p->af &&
-		    ip_vs_addr_equal(p->af, p->vaddr, &cp->caddr) &&
-		    ip_vs_addr_equal(p->af, p->caddr, &cp->daddr) &&
-		    p->protocol == cp->protocol &&
-		    cp->ipvs == p->ipvs) {
-			if (!__ip_vs_conn_get(cp))
-				continue;
-			/* HIT */
-			ret = cp;
-			break;
-		}
-	}
-
+	ret = ip_vs_conn_find(p, hash, ip_vs_conn_out_match);
 	rcu_read_unlock();
 
 	IP_VS_DBG_BUF(9, "lookup/out %s %s:%d->%s:%d %s\n",
@@ -1011,22 +1114,29 @@ ip_vs_conn_new(const struct ip_vs_conn_param *p, int dest_af,
 #ifdef CONFIG_PROC_FS
 struct ip_vs_iter_state {
 	struct seq_net_private	p;
-	struct hlist_head	*l;
+	unsigned int		bucket;
 };
 
+/* The table may be replaced whenever RCU is dropped, so the walk keeps a
+ * bucket index and can miss or repeat entries across a resize.
+ */
 static void *ip_vs_conn_array(struct seq_file *seq, loff_t pos)
 {
-	int idx;
-	struct ip_vs_conn *cp;
 	struct ip_vs_iter_state *iter = seq->private;
+	struct ip_vs_conn_htable *t;
+	struct ip_vs_conn *cp;
+	unsigned int idx;
 
-	for (idx = 0; idx < ip_vs_conn_tab_size; idx++) {
-		hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[idx], c_list) {
+	for (idx = 0; ; idx++) {
+		t = rcu_dereference(ip_vs_conn_tab);
+		if (idx > t->mask)
+			break;
+		hlist_for_each_entry_rcu(cp, &t->buckets[idx], c_list) {
 			/* __ip_vs_conn_get() is not needed by
 			 * ip_vs_conn_seq_show and ip_vs_conn_sync_seq_show
 			 */
 			if (pos-- == 0) {
-				iter->l = &ip_vs_conn_tab[idx];
+				iter->bucket = idx;
 				return cp;
 			}
 		}
@@ -1041,7 +1151,7 @@ static void *ip_vs_conn_seq_start(struct seq_file *seq, loff_t *pos)
 {
 	struct ip_vs_iter_state *iter = seq->private;
 
-	iter->l = NULL;
+	iter->bucket = 0;
 	rcu_read_lock();
 	return *pos ? ip_vs_conn_array(seq, *pos - 1) :SEQ_START_TOKEN;
 }
@@ -1050,9 +1160,9 @@ static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 {
 	struct ip_vs_conn *cp = v;
 	struct ip_vs_iter_state *iter = seq->private;
+	struct ip_vs_conn_htable *t;
 	struct hlist_node *e;
-	struct hlist_head *l = iter->l;
-	int idx;
+	unsigned int idx;
 
 	++*pos;
 	if (v == SEQ_START_TOKEN)
@@ -1063,15 +1173,18 @@ static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 	if (e)
 		return hlist_entry(e, struct ip_vs_conn, c_list);
 
-	idx = l - ip_vs_conn_tab;
-	while (++idx < ip_vs_conn_tab_size) {
-		hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[idx], c_list) {
-			iter->l = &ip_vs_conn_tab[idx];
+	idx = iter->bucket;
+	for (;;) {
+		t = rcu_dereference(ip_vs_conn_tab);
+		if (++idx > t->mask)
+			break;
+		hlist_for_each_entry_rcu(cp, &t->buckets[idx], c_list) {
+			iter->bucket = idx;
 			return cp;
 		}
 		cond_resched_rcu();
 	}
-	iter->l = NULL;
+	iter->bucket = 0;
 	return NULL;
 }
 
@@ -1273,9 +1386,10 @@ void ip_vs_random_dropentry(struct netns_ipvs *ipvs)
 	 * Randomly scan 1/32 of the whole table every second
 	 */
 	for (idx = 0; idx < (ip_vs_conn_tab_size>>5); idx++) {
-		unsigned int hash = prandom_u32() & ip_vs_conn_tab_mask;
+		struct ip_vs_conn_htable *t = rcu_dereference(ip_vs_conn_tab);
+		unsigned int hash = prandom_u32();
 
-		hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[hash], c_list) {
+		hlist_for_each_entry_rcu(cp, ct_bucket(t, hash), c_list) {
 			if (cp->ipvs != ipvs)
 				continue;
 			if (atomic_read(&cp->n_control))
@@ -1336,14 +1450,19 @@ void ip_vs_random_dropentry(struct netns_ipvs *ipvs)
  */
 static void ip_vs_conn_flush(struct netns_ipvs *ipvs)
 {
-	int idx;
+	unsigned int idx;
+	struct ip_vs_conn_htable *t;
 	struct ip_vs_conn *cp, *cp_c;
 
 flush_again:
 	rcu_read_lock();
-	for (idx = 0; idx < ip_vs_conn_tab_size; idx++) {
+	for (idx = 0; ; idx++) {
+		/* entries missed across a resize are found on next pass */
+		t = rcu_dereference(ip_vs_conn_tab);
+		if (idx > t->mask)
+			break;
 
-		hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[idx], c_list) {
+		hlist_for_each_entry_rcu(cp, &t->buckets[idx], c_list) {
 			if (cp->ipvs != ipvs)
 				continue;
 			/* As timers are expired in LIFO order, restart
@@ -1371,6 +1490,156 @@ static void ip_vs_conn_flush(struct netns_ipvs *ipvs)
 		goto flush_again;
 	}
 }
+static struct ip_vs_conn_htable *ip_vs_conn_tab_alloc(int bits)
+{
+	struct ip_vs_conn_htable *t;
+	unsigned int idx, size = 1U << bits;
+
+	t = kvmalloc(struct_size(t, buckets, size), GFP_KERNEL);
+	if (!t)
+		return NULL;
+
+	t->mask = size - 1;
+	for (idx = 0; idx < size; idx++)
+		INIT_HLIST_HEAD(&t->buckets[idx]);
+
+	return t;
+}
+
+/*
+ * Move all connections to a table of 1 << bits buckets.  Lock groups are
+ * moved CT_RESIZE_CHUNK buckets at a time: lk->moved tells writers which
+ * buckets of the group already live in the new table, and lk->seq makes
+ * lockless readers that raced with a move retry their lookup.
+ */
+static void ip_vs_conn_tab_resize(int bits)
+{
+	struct ip_vs_conn_htable *t, *nt;
+	unsigned int i;
+
+	lockdep_assert_held(&ip_vs_conn_resize_mutex);
+
+	nt = ip_vs_conn_tab_alloc(bits);
+	if (!nt)
+		return;
+
+	t = rcu_dereference_protected(ip_vs_conn_tab, 1);
+	rcu_assign_pointer(ip_vs_conn_tab_new, nt);
+
+	for (i = 0; i < CT_LOCKARRAY_SIZE; i++) {
+		struct ip_vs_aligned_lock *lk = &__ip_vs_conntbl_lock_array[i];
+		unsigned int b = i;
+
+		while (b <= t->mask) {
+			unsigned int n;
+
+			spin_lock_bh(&lk->l);
+			write_seqcount_begin(&lk->seq);
+			for (n = 0; n < CT_RESIZE_CHUNK && b <= t->mask; n++) {
+				struct ip_vs_conn *cp;
+				struct hlist_node *tmp;
+
+				hlist_for_each_entry_safe(cp, tmp,
+							  &t->buckets[b],
+							  c_list) {
+					unsigned int hash;
+
+					hash = ip_vs_conn_hashkey_conn(cp);
+					hlist_del_rcu(&cp->c_list);
+					hlist_add_head_rcu(&cp->c_list,
+							   ct_bucket(nt, hash));
+				}
+				b += CT_LOCKARRAY_SIZE;
+				lk->moved++;
+			}
+			write_seqcount_end(&lk->seq);
+			spin_unlock_bh(&lk->l);
+			cond_resched();
+		}
+	}
+
+	/* all groups moved, switch and retire the new table pointer */
+	rcu_assign_pointer(ip_vs_conn_tab, nt);
+	WRITE_ONCE(ip_vs_conn_tab_size, nt->mask + 1);
+	for (i = 0; i < CT_LOCKARRAY_SIZE; i++) {
+		spin_lock_bh(&__ip_vs_conntbl_lock_array[i].l);
+		__ip_vs_conntbl_lock_array[i].moved = 0;
+		spin_unlock_bh(&__ip_vs_conntbl_lock_array[i].l);
+	}
+	smp_wmb();
+	RCU_INIT_POINTER(ip_vs_conn_tab_new, NULL);
+	ip_vs_conn_tab_resizes++;
+
+	synchronize_rcu();
+	kvfree(t);
+}
+
+static void ip_vs_conn_resize_work_fn(struct work_struct *work)
+{
+	int count, bits, cur;
+
+	mutex_lock(&ip_vs_conn_resize_mutex);
+
+	cur = ilog2(ip_vs_conn_tab_size);
+	count = atomic_read(&ip_vs_conn_tab_count);
+	/* aim for a load factor of 1/2 */
+	bits = count ? ilog2(count) + 2 : 0;
+	bits = clamp(bits, ip_vs_conn_tab_bits, ip_vs_conn_tab_max_bits);
+
+	/* grow when above 1, shrink when below 1/8 */
+	if ((bits > cur && count > ip_vs_conn_tab_size) ||
+	    (bits < cur && count < ip_vs_conn_tab_size / 8)) {
+		IP_VS_DBG(2, "resizing connection table to %u buckets "
+			  "for %d connections\n", 1U << bits, count);
+		ip_vs_conn_tab_resize(bits);
+	}
+
+	mutex_unlock(&ip_vs_conn_resize_mutex);
+}
+
+#ifdef CONFIG_PROC_FS
+#define IP_VS_CONN_CHAIN_HIST	8
+
+static int ip_vs_conn_tab_stats_show(struct seq_file *seq, void *v)
+{
+	unsigned long hist[IP_VS_CONN_CHAIN_HIST + 1] = { 0 };
+	unsigned int idx, len, max_len = 0, size;
+	struct ip_vs_conn_htable *t;
+	struct ip_vs_conn *cp;
+
+	mutex_lock(&ip_vs_conn_resize_mutex);
+	rcu_read_lock();
+	t = rcu_dereference(ip_vs_conn_tab);
+	size = t->mask + 1;
+	for (idx = 0; idx <= t->mask; idx++) {
+		len = 0;
+		hlist_for_each_entry_rcu(cp, &t->buckets[idx], c_list)
+			len++;
+		hist[min_t(unsigned int, len, IP_VS_CONN_CHAIN_HIST)]++;
+		max_len = max(max_len, len);
+		if (!(idx & 1023))
+			cond_resched_rcu();
+	}
+	rcu_read_unlock();
+
+	seq_printf(seq, "Size: %u\n", size);
+	seq_printf(seq, "Min size: %u\n", 1U << ip_vs_conn_tab_bits);
+	seq_printf(seq, "Max size: %u\n", 1U << ip_vs_conn_tab_max_bits);
+	seq_printf(seq, "Connections: %d\n",
+		   atomic_read(&ip_vs_conn_tab_count));
+	seq_printf(seq, "Resizes: %u\n", ip_vs_conn_tab_resizes);
+	mutex_unlock(&ip_vs_conn_resize_mutex);
+
+	seq_printf(seq, "Longest chain: %u\n", max_len);
+	seq_puts(seq, "Chain length histogram:\n");
+	for (len = 0; len <= IP_VS_CONN_CHAIN_HIST; len++)
+		seq_printf(seq, "%s%u: %lu\n",
+			   len == IP_VS_CONN_CHAIN_HIST ? ">=" : "  ",
+			   len, hist[len]);
+	return 0;
+}
+#endif
+
 /*
  * per netns init and exit
  */
@@ -1388,11 +1657,19 @@ int __net_init ip_vs_conn_net_init(struct netns_ipvs *ipvs)
 			     &ip_vs_conn_sync_seq_ops,
 			     sizeof(struct ip_vs_iter_state)))
 		goto err_conn_sync;
+
+	/* the table is shared by all netns, show it in init_net only */
+	if (net_eq(ipvs->net, &init_net) &&
+	    !proc_create_single("ip_vs_conn_tab", 0, ipvs->net->proc_net,
+				ip_vs_conn_tab_stats_show))
+		goto err_conn_tab;
 #endif
 
 	return 0;
 
 #ifdef CONFIG_PROC_FS
+err_conn_tab:
+	remove_proc_entry("ip_vs_conn_sync", ipvs->net->proc_net);
 err_conn_sync:
 	remove_proc_entry("ip_vs_conn", ipvs->net->proc_net);
 err_conn:
@@ -1407,11 +1684,14 @@ void __net_exit ip_vs_conn_net_cleanup(struct netns_ipvs *ipvs)
 #ifdef CONFIG_PROC_FS
 	remove_proc_entry("ip_vs_conn", ipvs->net->proc_net);
 	remove_proc_entry("ip_vs_conn_sync", ipvs->net->proc_net);
+	if (net_eq(ipvs->net, &init_net))
+		remove_proc_entry("ip_vs_conn_tab", ipvs->net->proc_net);
 #endif
 }
 
 int __init ip_vs_conn_init(void)
 {
+	struct ip_vs_conn_htable *t;
 	int idx;
 
 	/* Compute size and mask */
@@ -1419,38 +1699,41 @@ int __init ip_vs_conn_init(void)
 		pr_info("conn_tab_bits not in [8, 20]. Using default value\n");
 		ip_vs_conn_tab_bits = CONFIG_IP_VS_TAB_BITS;
 	}
+	if (ip_vs_conn_tab_max_bits < ip_vs_conn_tab_bits ||
+	    ip_vs_conn_tab_max_bits > 27) {
+		pr_info("conn_tab_max_bits not in [conn_tab_bits, 27]. "
+			"Using conn_tab_bits\n");
+		ip_vs_conn_tab_max_bits = ip_vs_conn_tab_bits;
+	}
 	ip_vs_conn_tab_size = 1 << ip_vs_conn_tab_bits;
-	ip_vs_conn_tab_mask = ip_vs_conn_tab_size - 1;
 
 	/*
 	 * Allocate the connection hash table and initialize its list heads
 	 */
-	ip_vs_conn_tab = vmalloc(array_size(ip_vs_conn_tab_size,
-					    sizeof(*ip_vs_conn_tab)));
-	if (!ip_vs_conn_tab)
+	t = ip_vs_conn_tab_alloc(ip_vs_conn_tab_bits);
+	if (!t)
 		return -ENOMEM;
+	RCU_INIT_POINTER(ip_vs_conn_tab, t);
 
 	/* Allocate ip_vs_conn slab cache */
 	ip_vs_conn_cachep = kmem_cache_create("ip_vs_conn",
 					      sizeof(struct ip_vs_conn), 0,
 					      SLAB_HWCACHE_ALIGN, NULL);
 	if (!ip_vs_conn_cachep) {
-		vfree(ip_vs_conn_tab);
+		kvfree(t);
 		return -ENOMEM;
 	}
 
 	pr_info("Connection hash table configured "
-		"(size=%d, memory=%ldKbytes)\n",
-		ip_vs_conn_tab_size,
-		(long)(ip_vs_conn_tab_size*sizeof(*ip_vs_conn_tab))/1024);
+		"(size=%d, max=%d, memory=%ldKbytes)\n",
+		ip_vs_conn_tab_size, 1 << ip_vs_conn_tab_max_bits,
+		(long)(ip_vs_conn_tab_size*sizeof(struct hlist_head))/1024);
 	IP_VS_DBG(0, "Each connection entry needs %zd bytes at least\n",
 		  sizeof(struct ip_vs_conn));
 
-	for (idx = 0; idx < ip_vs_conn_tab_size; idx++)
-		INIT_HLIST_HEAD(&ip_vs_conn_tab[idx]);
-
 	for (idx = 0; idx < CT_LOCKARRAY_SIZE; idx++)  {
 		spin_lock_init(&__ip_vs_conntbl_lock_array[idx].l);
+		seqcount_init(&__ip_vs_conntbl_lock_array[idx].seq);
 	}
 
 	/* calculate the random value for connection hash */
@@ -1461,9 +1744,10 @@ int __init ip_vs_conn_init(void)
 
 void ip_vs_conn_cleanup(void)
 {
+	cancel_work_sync(&ip_vs_conn_resize_work);
 	/* Wait all ip_vs_conn_rcu_free() callbacks to complete */
 	rcu_barrier();
 	/* Release the empty cache */
 	kmem_cache_destroy(ip_vs_conn_cachep);
-	vfree(ip_vs_conn_tab);
+	kvfree(rcu_dereference_protected(ip_vs_conn_tab, 1));
 }
@@ -89,6 +89,7 @@
 #include <linux/errqueue.h>
 #include <linux/net_tstamp.h>
 #include <linux/percpu.h>
+#include <net/busy_poll.h>
 #ifdef CONFIG_INET
 #include <net/inet_common.h>
 #endif
@@ -202,6 +203,7 @@ static int prb_queue_frozen(struct tpacket_kbdq_core *);
 static void prb_open_block(struct tpacket_kbdq_core *,
 		struct tpacket_block_desc *);
 static void prb_retire_rx_blk_timer_expired(struct timer_list *);
+static void prb_retire_rx_queue_timer_expired(struct timer_list *);
 static void _prb_refresh_rx_retire_blk_timer(struct tpacket_kbdq_core *);
 static void prb_fill_rxhash(struct tpacket_kbdq_core *, struct tpacket3_hdr *);
 static void prb_clear_rxhash(struct tpacket_kbdq_core *,
@@ -504,6 +506,7 @@ static void prb_shutdown_retire_blk_timer(struct packet_sock *po,
 		struct sk_buff_head *rb_queue)
 {
 	struct tpacket_kbdq_core *pkc;
+	unsigned int i;
 
 	pkc = GET_PBDQC_FROM_RB(&po->rx_ring);
 
@@ -512,6 +515,26 @@ static void prb_shutdown_retire_blk_timer(struct packet_sock *po,
 	spin_unlock_bh(&rb_queue->lock);
 
 	prb_del_retire_blk_timer(pkc);
+
+	for (i = 0; i < pkc->nr_queues; i++) {
+		struct tpacket_kbdq_queue *q = &pkc->queues[i];
+
+		spin_lock_bh(&q->lock);
+		q->core.delete_blk_timer = 1;
+		spin_unlock_bh(&q->lock);
+
+		prb_del_retire_blk_timer(&q->core);
+
+		/* Keep the counters until they are read */
+		spin_lock_bh(&rb_queue->lock);
+		po->stats.stats3.tp_packets += q->stats.stats3.tp_packets;
+		po->stats.stats3.tp_drops += q->stats.stats3.tp_drops;
+		po->stats.stats3.tp_freeze_q_cnt += q->stats.stats3.tp_freeze_q_cnt;
+		spin_unlock_bh(&rb_queue->lock);
+	}
+	kfree(pkc->queues);
+	pkc->queues = NULL;
+	pkc->nr_queues = 0;
 }
 
 static void prb_setup_retire_blk_timer(struct packet_sock *po)
@@ -573,7 +596,53 @@ static void prb_init_ft_ops(struct tpacket_kbdq_core *p1,
 	p1->feature_req_word = req_u->req3.tp_feature_req_word;
 }
 
-static void init_prb_bdqc(struct packet_sock *po,
+/* Each queue gets at least this many blocks */
+#define PRB_MIN_QUEUE_BLOCKS	2
+
+static int prb_init_queues(struct packet_sock *po,
+			   struct tpacket_kbdq_core *p1)
+{
+	unsigned int nr, per_queue, i;
+
+	nr = min_t(unsigned int, nr_cpu_ids,
+		   p1->knum_blocks / PRB_MIN_QUEUE_BLOCKS);
+	nr = max(nr, 1U);
+
+	p1->queues = kcalloc(nr, sizeof(*p1->queues), GFP_KERNEL);
+	if (!p1->queues)
+		return -ENOMEM;
+	p1->nr_queues = nr;
+	per_queue = p1->knum_blocks / nr;
+
+	for (i = 0; i < nr; i++) {
+		struct tpacket_kbdq_queue *q = &p1->queues[i];
+		struct tpacket_kbdq_core *qc = &q->core;
+
+		spin_lock_init(&q->lock);
+		q->po = po;
+
+		qc->pkbdq = p1->pkbdq + i * per_queue;
+		qc->knum_blocks = i == nr - 1 ?
+				  p1->knum_blocks - i * per_queue : per_queue;
+		qc->knxt_seq_num = 1;
+		qc->kblk_size = p1->kblk_size;
+		qc->hdrlen = p1->hdrlen;
+		qc->version = p1->version;
+		qc->retire_blk_tov = p1->retire_blk_tov;
+		qc->tov_in_jiffies = p1->tov_in_jiffies;
+		qc->blk_sizeof_priv = p1->blk_sizeof_priv;
+		qc->max_frame_len = p1->max_frame_len;
+		qc->feature_req_word = p1->feature_req_word;
+		qc->stats = &q->stats;
+		timer_setup(&qc->retire_blk_timer,
+			    prb_retire_rx_queue_timer_expired, 0);
+		prb_open_block(qc, (struct tpacket_block_desc *)
+				   qc->pkbdq[0].buffer);
+	}
+	return 0;
+}
+
+static int init_prb_bdqc(struct packet_sock *po,
 			struct packet_ring_buffer *rb,
 			struct pgv *pg_vec,
 			union tpacket_req_u *req_u)
@@ -603,8 +672,12 @@ static void init_prb_bdqc(struct packet_sock *po,
 
 	p1->max_frame_len = p1->kblk_size - BLK_PLUS_PRIV(p1->blk_sizeof_priv);
 	prb_init_ft_ops(p1, req_u);
+	p1->stats = &po->stats;
 	prb_setup_retire_blk_timer(po);
+	if (p1->feature_req_word & TP_FT_REQ_PERCPU_BLK)
+		return prb_init_queues(po, p1);
 	prb_open_block(p1, pbd);
+	return 0;
 }
 
 /*  Do NOT update the last_blk_num first.
@@ -640,15 +713,14 @@ static void _prb_refresh_rx_retire_blk_timer(struct tpacket_kbdq_core *pkc)
  * prb_calc_retire_blk_tmo() calculates the tmo.
  *
  */
-static void prb_retire_rx_blk_timer_expired(struct timer_list *t)
+static void __prb_retire_rx_blk_timer_expired(struct packet_sock *po,
+					      struct tpacket_kbdq_core *pkc,
+					      spinlock_t *lock)
 {
-	struct packet_sock *po =
-		from_timer(po, t, rx_ring.prb_bdqc.retire_blk_timer);
-	struct tpacket_kbdq_core *pkc = GET_PBDQC_FROM_RB(&po->rx_ring);
 	unsigned int frozen;
 	struct tpacket_block_desc *pbd;
 
-	spin_lock(&po->sk.sk_receive_queue.lock);
+	spin_lock(lock);
 
 	frozen = prb_queue_frozen(pkc);
 	pbd = GET_CURR_PBLOCK_DESC_FROM_CORE(pkc);
@@ -711,7 +783,24 @@ static void prb_retire_rx_blk_timer_expired(struct timer_list *t)
 	_prb_refresh_rx_retire_blk_timer(pkc);
 
 out:
-	spin_unlock(&po->sk.sk_receive_queue.lock);
+	spin_unlock(lock);
+}
+
+static void prb_retire_rx_blk_timer_expired(struct timer_list *t)
+{
+	struct packet_sock *po =
+		from_timer(po, t, rx_ring.prb_bdqc.retire_blk_timer);
+
+	__prb_retire_rx_blk_timer_expired(po, GET_PBDQC_FROM_RB(&po->rx_ring),
+					  &po->sk.sk_receive_queue.lock);
+}
+
+static void prb_retire_rx_queue_timer_expired(struct timer_list *t)
+{
+	struct tpacket_kbdq_queue *q =
+		from_timer(q, t, core.retire_blk_timer);
+
+	__prb_retire_rx_blk_timer_expired(q->po, &q->core, &q->lock);
 }
 
 static void prb_flush_block(struct tpacket_kbdq_core *pkc1,
@@ -767,7 +856,7 @@ static void prb_close_block(struct tpacket_kbdq_core *pkc1,
 	struct tpacket_hdr_v1 *h1 = &pbd1->hdr.bh1;
 	struct sock *sk = &po->sk;
 
-	if (po->stats.stats3.tp_drops)
+	if (pkc1->stats->stats3.tp_drops)
 		status |= TP_STATUS_LOSING;
 
 	last_pkt = (struct tpacket3_hdr *)pkc1->prev;
@@ -875,7 +964,7 @@ static void prb_freeze_queue(struct tpacket_kbdq_core *pkc,
 				  struct packet_sock *po)
 {
 	pkc->reset_pending_on_curr_blk = 1;
-	po->stats.stats3.tp_freeze_q_cnt++;
+	pkc->stats->stats3.tp_freeze_q_cnt++;
 }
 
 #define TOTAL_PKT_LEN_INCL_ALIGN(length) (ALIGN((length), V3_ALIGNMENT))
@@ -948,10 +1037,9 @@ static int prb_queue_frozen(struct tpacket_kbdq_core *pkc)
 	return pkc->reset_pending_on_curr_blk;
 }
 
-static void prb_clear_blk_fill_status(struct packet_ring_buffer *rb)
+static void prb_clear_blk_fill_status(struct tpacket_kbdq_core *pkc)
 	__releases(&pkc->blk_fill_in_prog_lock)
 {
-	struct tpacket_kbdq_core *pkc  = GET_PBDQC_FROM_RB(rb);
 	atomic_dec(&pkc->blk_fill_in_prog);
 }
 
@@ -1011,18 +1099,19 @@ static void prb_fill_curr_block(char *curr,
 	prb_run_all_ft_ops(pkc, ppd);
 }
 
-/* Assumes caller has the sk->rx_queue.lock */
+/* Assumes caller has the sk->rx_queue.lock, or the lock of the queue
+ * pkc belongs to.
+ */
 static void *__packet_lookup_frame_in_block(struct packet_sock *po,
+					    struct tpacket_kbdq_core *pkc,
 					    struct sk_buff *skb,
 						int status,
 					    unsigned int len
 					    )
 {
-	struct tpacket_kbdq_core *pkc;
 	struct tpacket_block_desc *pbd;
 	char *curr, *end;
 
-	pkc = GET_PBDQC_FROM_RB(&po->rx_ring);
 	pbd = GET_CURR_PBLOCK_DESC_FROM_CORE(pkc);
 
 	/* Queue is frozen when user space is lagging behind */
@@ -1075,6 +1164,7 @@ static void *__packet_lookup_frame_in_block(struct packet_sock *po,
 }
 
 static void *packet_current_rx_frame(struct packet_sock *po,
+					    struct tpacket_kbdq_core *pkc,
 					    struct sk_buff *skb,
 					    int status, unsigned int len)
 {
@@ -1086,7 +1176,7 @@ static void *packet_current_rx_frame(struct packet_sock *po,
 					po->rx_ring.head, status);
 		return curr;
 	case TPACKET_V3:
-		return __packet_lookup_frame_in_block(po, skb, status, len);
+		return __packet_lookup_frame_in_block(po, pkc, skb, status, len);
 	default:
 		WARN(1, "TPACKET version not supported\n");
 		BUG();
@@ -1136,6 +1226,66 @@ static void *packet_previous_rx_frame(struct packet_sock *po,
 	return __prb_previous_block(po, rb, status);
 }
 
+/* Any CPU is fine from process context, softirqs fill the queue of the
+ * CPU they run on.
+ */
+static struct tpacket_kbdq_queue *prb_this_queue(struct tpacket_kbdq_core *pkc)
+{
+	return &pkc->queues[raw_smp_processor_id() % pkc->nr_queues];
+}
+
+static bool prb_queues_readable(struct tpacket_kbdq_core *pkc)
+{
+	unsigned int i;
+
+	for (i = 0; i < pkc->nr_queues; i++) {
+		struct tpacket_kbdq_core *qc = &pkc->queues[i].core;
+		unsigned int prev;
+
+		prev = qc->kactive_blk_num ? qc->kactive_blk_num - 1 :
+					     qc->knum_blocks - 1;
+		if (BLOCK_STATUS(GET_PBLOCK_DESC(qc, prev)) != TP_STATUS_KERNEL)
+			return true;
+	}
+	return false;
+}
+
+/* Do what the retire timer would do for each queue, now: hand partially
+ * filled blocks to user space and reopen the ones it gave back.
+ * BHs must be disabled.
+ */
+static void prb_retire_rx_queues(struct tpacket_kbdq_core *pkc)
+{
+	unsigned int i;
+
+	for (i = 0; i < pkc->nr_queues; i++) {
+		struct tpacket_kbdq_queue *q = &pkc->queues[i];
+		struct tpacket_kbdq_core *qc = &q->core;
+		struct tpacket_block_desc *pbd;
+
+		spin_lock(&q->lock);
+		pbd = GET_CURR_PBLOCK_DESC_FROM_CORE(qc);
+		if (qc->delete_blk_timer) {
+			/* ring is going away */
+		} else if (prb_queue_frozen(qc)) {
+			if (!prb_curr_blk_in_use(pbd))
+				prb_open_block(qc, pbd);
+		} else if (BLOCK_NUM_PKTS(pbd)) {
+			while (atomic_read(&qc->blk_fill_in_prog))
+				cpu_relax();
+			prb_retire_current_block(qc, q->po, TP_STATUS_BLK_TMO);
+			prb_dispatch_next_block(qc, q->po);
+		}
+		spin_unlock(&q->lock);
+	}
+}
+
+static bool packet_rx_queues(struct packet_sock *po)
+{
+	return po->rx_ring.pg_vec && po->tp_version == TPACKET_V3 &&
+	       po->rx_ring.prb_bdqc.queues;
+}
+
 static void packet_increment_rx_head(struct packet_sock *po,
 					    struct packet_ring_buffer *rb)
 {
@@ -1225,15 +1375,20 @@ static bool __tpacket_has_room(struct packet_sock *po, int pow_off)
 
 static bool __tpacket_v3_has_room(struct packet_sock *po, int pow_off)
 {
+	struct tpacket_kbdq_core *pkc = GET_PBDQC_FROM_RB(&po->rx_ring);
 	int idx, len;
 
-	len = po->rx_ring.prb_bdqc.knum_blocks;
-	idx = po->rx_ring.prb_bdqc.kactive_blk_num;
+	/* A fanout rollover decision is about the queue this CPU fills */
+	if (pkc->queues)
+		pkc = &prb_this_queue(pkc)->core;
+
+	len = pkc->knum_blocks;
+	idx = pkc->kactive_blk_num;
 	if (pow_off)
 		idx += len >> pow_off;
 	if (idx >= len)
 		idx -= len;
-	return prb_lookup_block(po, &po->rx_ring, idx, TP_STATUS_KERNEL);
+	return BLOCK_STATUS(GET_PBLOCK_DESC(pkc, idx)) == TP_STATUS_KERNEL;
 }
 
 static int __packet_rcv_has_room(struct packet_sock *po, struct sk_buff *skb)
@@ -1272,6 +1427,18 @@ static int packet_rcv_has_room(struct packet_sock *po, struct sk_buff *skb)
 	int ret;
 	bool has_room;
 
+	/* The queues are not covered by sk_receive_queue.lock, don't
+	 * serialize every fanout rollover check on it either.
+	 */
+	if (po->prot_hook.func == tpacket_rcv &&
+	    po->tp_version == TPACKET_V3 && po->rx_ring.prb_bdqc.queues) {
+		ret = __packet_rcv_has_room(po, skb);
+		has_room = ret == ROOM_NORMAL;
+		if (READ_ONCE(po->pressure) == has_room)
+			WRITE_ONCE(po->pressure, !has_room);
+		return ret;
+	}
+
 	spin_lock_bh(&po->sk.sk_receive_queue.lock);
 	ret = __packet_rcv_has_room(po, skb);
 	has_room = ret == ROOM_NORMAL;
@@ -2174,6 +2341,9 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 	bool is_drop_n_account = false;
 	unsigned int slot_id = 0;
 	bool do_vnet = false;
+	struct tpacket_kbdq_core *pkc = NULL;
+	union tpacket_stats_u *stats;
+	spinlock_t *rx_lock;
 
 	/* struct tpacket{2,3}_hdr is aligned to a multiple of TPACKET_ALIGNMENT.
 	 * We may add members to them until current aligned size without forcing
@@ -2191,6 +2361,19 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 	if (!net_eq(dev_net(dev), sock_net(sk)))
 		goto drop;
 
+	rx_lock = &sk->sk_receive_queue.lock;
+	stats = &po->stats;
+	if (po->tp_version == TPACKET_V3) {
+		pkc = GET_PBDQC_FROM_RB(&po->rx_ring);
+		if (pkc->queues) {
+			struct tpacket_kbdq_queue *q = prb_this_queue(pkc);
+
+			pkc = &q->core;
+			rx_lock = &q->lock;
+			stats = &q->stats;
+		}
+	}
+
 	if (dev->header_ops) {
 		if (sk->sk_type != SOCK_DGRAM)
 			skb_push(skb, skb->data - skb_mac_header(skb));
@@ -2206,6 +2389,8 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 	if (!res)
 		goto drop_n_restore;
 
+	sk_mark_napi_id_once(sk, skb);
+
 	if (skb->ip_summed == CHECKSUM_PARTIAL)
 		status |= TP_STATUS_CSUMNOTREADY;
 	else if (skb->pkt_type != PACKET_OUTGOING &&
@@ -2230,9 +2415,9 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 		macoff = netoff - maclen;
 	}
 	if (netoff > USHRT_MAX) {
-		spin_lock(&sk->sk_receive_queue.lock);
-		po->stats.stats1.tp_drops++;
-		spin_unlock(&sk->sk_receive_queue.lock);
+		spin_lock(rx_lock);
+		stats->stats1.tp_drops++;
+		spin_unlock(rx_lock);
 		goto drop_n_restore;
 	}
 	if (po->tp_version <= TPACKET_V2) {
@@ -2271,8 +2456,8 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 			do_vnet = false;
 		}
 	}
-	spin_lock(&sk->sk_receive_queue.lock);
-	h.raw = packet_current_rx_frame(po, skb,
+	spin_lock(rx_lock);
+	h.raw = packet_current_rx_frame(po, pkc, skb,
 					TP_STATUS_KERNEL, (macoff+snaplen));
 	if (!h.raw)
 		goto drop_n_account;
@@ -2289,7 +2474,7 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 				    sizeof(struct virtio_net_hdr),
 				    vio_le(), true, 0)) {
 		if (po->tp_version == TPACKET_V3)
-			prb_clear_blk_fill_status(&po->rx_ring);
+			prb_clear_blk_fill_status(pkc);
 		goto drop_n_account;
 	}
 
@@ -2301,16 +2486,16 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 	 * Anyways, moving it for V1/V2 only as V3 doesn't need this
 	 * at packet level.
 	 */
-		if (po->stats.stats1.tp_drops)
+		if (stats->stats1.tp_drops)
 			status |= TP_STATUS_LOSING;
 	}
 
-	po->stats.stats1.tp_packets++;
+	stats->stats1.tp_packets++;
 	if (copy_skb) {
 		status |= TP_STATUS_COPY;
 		__skb_queue_tail(&sk->sk_receive_queue, copy_skb);
 	}
-	spin_unlock(&sk->sk_receive_queue.lock);
+	spin_unlock(rx_lock);
 
 	skb_copy_bits(skb, 0, h.raw + macoff, snaplen);
 
@@ -2398,7 +2583,7 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 		spin_unlock(&sk->sk_receive_queue.lock);
 		sk->sk_data_ready(sk);
 	} else if (po->tp_version == TPACKET_V3) {
-		prb_clear_blk_fill_status(&po->rx_ring);
+		prb_clear_blk_fill_status(pkc);
 	}
 
 drop_n_restore:
@@ -2415,8 +2600,8 @@ static int tpacket_rcv(struct sk_buff *skb, struct net_device *dev,
 
 drop_n_account:
 	is_drop_n_account = true;
-	po->stats.stats1.tp_drops++;
-	spin_unlock(&sk->sk_receive_queue.lock);
+	stats->stats1.tp_drops++;
+	spin_unlock(rx_lock);
 
 	sk->sk_data_ready(sk);
 	kfree_skb(copy_skb);
@@ -3359,6 +3544,14 @@ static int packet_recvmsg(struct socket *sock, struct msghdr *msg, size_t len,
 		goto out;
 	}
 
+	/* With per-CPU ring queues, recvmsg() flushes the open blocks */
+	if (pkt_sk(sk)->tp_version == TPACKET_V3) {
+		spin_lock_bh(&sk->sk_receive_queue.lock);
+		if (packet_rx_queues(pkt_sk(sk)))
+			prb_retire_rx_queues(GET_PBDQC_FROM_RB(&pkt_sk(sk)->rx_ring));
+		spin_unlock_bh(&sk->sk_receive_queue.lock);
+	}
+
 	/*
 	 *	Call the generic datagram receiver. This handles all sorts
 	 *	of horrible races and re-entrancy so we can forget about it
@@ -3957,6 +4150,21 @@ static int packet_getsockopt(struct socket *sock, int level, int optname,
 		spin_lock_bh(&sk->sk_receive_queue.lock);
 		memcpy(&st, &po->stats, sizeof(st));
 		memset(&po->stats, 0, sizeof(po->stats));
+		if (packet_rx_queues(po)) {
+			struct tpacket_kbdq_core *pkc = GET_PBDQC_FROM_RB(&po->rx_ring);
+			unsigned int i;
+
+			for (i = 0; i < pkc->nr_queues; i++) {
+				struct tpacket_kbdq_queue *q = &pkc->queues[i];
+
+				spin_lock(&q->lock);
+				st.stats3.tp_packets += q->stats.stats3.tp_packets;
+				st.stats3.tp_drops += q->stats.stats3.tp_drops;
+				st.stats3.tp_freeze_q_cnt += q->stats.stats3.tp_freeze_q_cnt;
+				memset(&q->stats, 0, sizeof(q->stats));
+				spin_unlock(&q->lock);
+			}
+		}
 		spin_unlock_bh(&sk->sk_receive_queue.lock);
 
 		if (po->tp_version == TPACKET_V3) {
@@ -3982,6 +4190,11 @@ static int packet_getsockopt(struct socket *sock, int level, int optname,
 	case PACKET_VERSION:
 		val = po->tp_version;
 		break;
+	case PACKET_RX_RING_QUEUES:
+		spin_lock_bh(&sk->sk_receive_queue.lock);
+		val = packet_rx_queues(po) ? po->rx_ring.prb_bdqc.nr_queues : 0;
+		spin_unlock_bh(&sk->sk_receive_queue.lock);
+		break;
 	case PACKET_HDRLEN:
 		if (len > sizeof(int))
 			len = sizeof(int);
@@ -4181,7 +4394,15 @@ static __poll_t packet_poll(struct file *file, struct socket *sock,
 	__poll_t mask = datagram_poll(file, sock, wait);
 
 	spin_lock_bh(&sk->sk_receive_queue.lock);
-	if (po->rx_ring.pg_vec) {
+	if (packet_rx_queues(po)) {
+		struct tpacket_kbdq_core *pkc = GET_PBDQC_FROM_RB(&po->rx_ring);
+
+		/* Busy polling: don't let a block wait for the timer */
+		if (!prb_queues_readable(pkc))
+			prb_retire_rx_queues(pkc);
+		if (prb_queues_readable(pkc))
+			mask |= EPOLLIN | EPOLLRDNORM;
+	} else if (po->rx_ring.pg_vec) {
 		if (!packet_previous_rx_frame(po, &po->rx_ring,
 			TP_STATUS_KERNEL))
 			mask |= EPOLLIN | EPOLLRDNORM;
@@ -4374,7 +4595,9 @@ static int packet_set_ring(struct sock *sk, union tpacket_req_u *req_u,
 		case TPACKET_V3:
 			/* Block transmit is not supported yet */
 			if (!tx_ring) {
-				init_prb_bdqc(po, rb, pg_vec, req_u);
+				err = init_prb_bdqc(po, rb, pg_vec, req_u);
+				if (err)
+					goto out_free_pg_vec;
 			} else {
 				struct tpacket_req3 *req3 = &req_u->req3;
 
@@ -13,6 +13,8 @@ struct packet_mclist {
 	unsigned char		addr[MAX_ADDR_LEN];
 };
 
+struct tpacket_kbdq_queue;
+
 /* kbdq - kernel block descriptor queue */
 struct tpacket_kbdq_core {
 	struct pgv	*pkbdq;
@@ -50,8 +52,26 @@ struct tpacket_kbdq_core {
 
 	/* timer to retire an outstanding block */
 	struct timer_list retire_blk_timer;
+
+	union tpacket_stats_u	*stats;
+
+	/* TP_FT_REQ_PERCPU_BLK: the ring is only used for its geometry,
+	 * blocks are handed out by the queues.
+	 */
+	struct tpacket_kbdq_queue *queues;
+	unsigned int	nr_queues;
 };
 
+/* A slice of the V3 ring owned by a set of CPUs, with its own lock
+ * instead of sk_receive_queue.lock.
+ */
+struct tpacket_kbdq_queue {
+	spinlock_t		lock;
+	union tpacket_stats_u	stats;
+	struct packet_sock	*po;
+	struct tpacket_kbdq_core core;
+} ____cacheline_aligned_in_smp;
+
 struct pgv {
 	char *buffer;
 };
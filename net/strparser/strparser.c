@@ -29,6 +29,9 @@
 
 static struct workqueue_struct *strp_wq;
 
+/* Most messages batched for rcv_msgs before they are passed up */
+#define STRP_BATCH_MAX	64
+
 struct _strp_msg {
 	/* Internal cb structure. struct strp_msg must be first for passing
 	 * to upper layer.
@@ -95,6 +98,15 @@ static inline int strp_peek_len(struct strparser *strp)
 	return INT_MAX;
 }
 
+/* Pass batched messages to the upper layer. Lower socket lock held */
+static void strp_rcv_batch(struct strparser *strp)
+{
+	if (unlikely(strp->paused) || skb_queue_empty(&strp->rcv_batch))
+		return;
+
+	strp->cb.rcv_msgs(strp, &strp->rcv_batch);
+}
+
 /* Lower socket lock held */
 static int __strp_recv(read_descriptor_t *desc, struct sk_buff *orig_skb,
 		       unsigned int orig_offset, size_t orig_len,
@@ -108,6 +120,9 @@ static int __strp_recv(read_descriptor_t *desc, struct sk_buff *orig_skb,
 	int err;
 	bool cloned_orig = false;
 
+	/* Messages left over from before a pause go first */
+	strp_rcv_batch(strp);
+
 	if (strp->paused)
 		return 0;
 
@@ -312,7 +327,14 @@ static int __strp_recv(read_descriptor_t *desc, struct sk_buff *orig_skb,
 		STRP_STATS_INCR(strp->stats.msgs);
 
 		/* Give skb to upper layer */
-		strp->cb.rcv_msg(strp, head);
+		if (strp->cb.rcv_msgs) {
+			__skb_queue_tail(&strp->rcv_batch, head);
+			if (skb_queue_len(&strp->rcv_batch) < STRP_BATCH_MAX)
+				continue;
+			strp_rcv_batch(strp);
+		} else {
+			strp->cb.rcv_msg(strp, head);
+		}
 
 		if (unlikely(strp->paused)) {
 			/* Upper layer paused strp */
@@ -323,6 +345,8 @@ static int __strp_recv(read_descriptor_t *desc, struct sk_buff *orig_skb,
 	if (cloned_orig)
 		kfree_skb(orig_skb);
 
+	strp_rcv_batch(strp);
+
 	STRP_STATS_ADD(strp->stats.bytes, eaten);
 
 	return eaten;
@@ -368,8 +392,11 @@ static int strp_read_sock(struct strparser *strp)
 	desc.error = 0;
 	desc.count = 1; /* give more than one skb per call */
 
+	strp_rcv_batch(strp);
+
 	/* sk should be locked here, so okay to do read_sock */
-	sock->ops->read_sock(strp->sk, &desc, strp_recv);
+	if (!strp->paused)
+		sock->ops->read_sock(strp->sk, &desc, strp_recv);
 
 	desc.error = strp->cb.read_sock_done(strp, desc.error);
 
@@ -455,7 +482,7 @@ int strp_init(struct strparser *strp, struct sock *sk,
 	      const struct strp_callbacks *cb)
 {
 
-	if (!cb || !cb->rcv_msg || !cb->parse_msg)
+	if (!cb || !(cb->rcv_msg || cb->rcv_msgs) || !cb->parse_msg)
 		return -EINVAL;
 
 	/* The sk (sock) arg determines the mode of the stream parser.
@@ -481,10 +508,12 @@ int strp_init(struct strparser *strp, struct sock *sk,
 	strp->cb.lock = cb->lock ? : strp_sock_lock;
 	strp->cb.unlock = cb->unlock ? : strp_sock_unlock;
 	strp->cb.rcv_msg = cb->rcv_msg;
+	strp->cb.rcv_msgs = cb->rcv_msgs;
 	strp->cb.parse_msg = cb->parse_msg;
 	strp->cb.read_sock_done = cb->read_sock_done ? : default_read_sock_done;
 	strp->cb.abort_parser = cb->abort_parser ? : strp_abort_strp;
 
+	__skb_queue_head_init(&strp->rcv_batch);
 	INIT_DELAYED_WORK(&strp->msg_timer_work, strp_msg_timeout);
 	INIT_WORK(&strp->work, strp_work);
 
@@ -497,7 +526,7 @@ void __strp_unpause(struct strparser *strp)
 {
 	strp->paused = 0;
 
-	if (strp->need_bytes) {
+	if (strp->need_bytes && skb_queue_empty(&strp->rcv_batch)) {
 		if (strp_peek_len(strp) < strp->need_bytes)
 			return;
 	}
@@ -530,6 +559,8 @@ void strp_done(struct strparser *strp)
 		kfree_skb(strp->skb_head);
 		strp->skb_head = NULL;
 	}
+
+	__skb_queue_purge(&strp->rcv_batch);
 }
 EXPORT_SYMBOL_GPL(strp_done);
 
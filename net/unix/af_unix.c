@@ -529,6 +529,7 @@ static void unix_release_sock(struct sock *sk, int embrion)
 	struct path path;
 	struct sock *skpair;
 	struct sk_buff *skb;
+	bool gc;
 	int state;
 
 	unix_remove_socket(sk);
@@ -576,6 +577,10 @@ static void unix_release_sock(struct sock *sk, int embrion)
 		kfree_skb(skb);
 	}
 
+	/* The collector keeps sk until it has seen it leave flight */
+	gc = READ_ONCE(u->gc_vertex) ||
+	     test_bit(UNIX_GC_MARKED, &u->gc_flags);
+
 	if (path.dentry)
 		path_put(&path);
 
@@ -594,7 +599,7 @@ static void unix_release_sock(struct sock *sk, int embrion)
 	 *	  What the above comment does talk about? --ANK(980817)
 	 */
 
-	if (unix_tot_inflight)
+	if (unix_tot_inflight || gc)
 		unix_gc();		/* Garbage collect fds */
 }
 
@@ -1415,6 +1420,9 @@ static int unix_stream_connect(struct socket *sock, struct sockaddr *uaddr,
 	__skb_queue_tail(&other->sk_receive_queue, skb);
 	spin_unlock(&other->sk_receive_queue.lock);
 	unix_state_unlock(other);
+	/* fds already sent to the embryo are now held by the listener */
+	if (READ_ONCE(unix_tot_inflight))
+		unix_gc_mark(unix_sk(other));
 	other->sk_data_ready(other);
 	sock_put(other);
 	return 0;
@@ -1493,6 +1501,9 @@ static int unix_accept(struct socket *sock, struct socket *newsock, int flags,
 	tsk = skb->sk;
 	skb_free_datagram(sk, skb);
 	wake_up_interruptible(&unix_sk(sk)->peer_wait);
+	/* fds queued on tsk are no longer held by the listener */
+	if (READ_ONCE(unix_tot_inflight))
+		unix_gc_mark(unix_sk(sk));
 
 	/* attach accepted sock to socket */
 	unix_state_lock(tsk);
@@ -1842,6 +1853,8 @@ static int unix_dgram_sendmsg(struct socket *sock, struct msghdr *msg,
 		__net_timestamp(skb);
 	maybe_add_creds(skb, sock, other);
 	skb_queue_tail(&other->sk_receive_queue, skb);
+	if (scm.fp)
+		unix_gc_queued_fds(other);
 	unix_state_unlock(other);
 	other->sk_data_ready(other);
 	sock_put(other);
@@ -1866,6 +1879,70 @@ static int unix_dgram_sendmsg(struct socket *sock, struct msghdr *msg,
  */
 #define UNIX_SKB_FRAGS_SZ (PAGE_SIZE << get_order(32768))
 
+/* Writes up to this size are appended to the last skb queued to the peer
+ * when it has room, and get an skb with room for more writes otherwise.
+ */
+#define UNIX_SKB_APPEND_MAX	SKB_WITH_OVERHEAD(1024)
+
+/* Append a small write to the skb at the tail of the peer's receive
+ * queue. Returns the number of bytes appended, 0 when the tail cannot
+ * take them, or an error.
+ */
+static int unix_stream_append(struct sock *sk, struct sock *other,
+			      struct msghdr *msg, int size,
+			      struct scm_cookie *scm)
+{
+	struct unix_sock *ou = unix_sk(other);
+	struct sk_buff *tail;
+	int err = 0;
+
+	/* readers of other hold iolock while they use an skb */
+	if (!mutex_trylock(&ou->iolock))
+		return 0;
+
+	unix_state_lock(other);
+	if (sock_flag(other, SOCK_DEAD) ||
+	    (other->sk_shutdown & RCV_SHUTDOWN)) {
+		err = -EPIPE;
+		goto out_unlock;
+	}
+	tail = skb_peek_tail(&other->sk_receive_queue);
+	if (!tail || tail->sk != sk || UNIXCB(tail).fp ||
+	    skb_is_nonlinear(tail) || skb_tailroom(tail) < size ||
+	    !unix_skb_scm_eq(tail, scm))
+		goto out_unlock;
+	/* the queue may be purged once other is dead */
+	skb_get(tail);
+	unix_state_unlock(other);
+
+	if (!copy_from_iter_full(skb_tail_pointer(tail), size,
+				 &msg->msg_iter)) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	unix_state_lock(other);
+	if (sock_flag(other, SOCK_DEAD) ||
+	    (other->sk_shutdown & RCV_SHUTDOWN)) {
+		err = -EPIPE;
+	} else {
+		skb_put(tail, size);
+		err = size;
+	}
+	unix_state_unlock(other);
+out:
+	consume_skb(tail);
+	mutex_unlock(&ou->iolock);
+	if (err > 0)
+		other->sk_data_ready(other);
+	return err;
+
+out_unlock:
+	unix_state_unlock(other);
+	mutex_unlock(&ou->iolock);
+	return err;
+}
+
 static int unix_stream_sendmsg(struct socket *sock, struct msghdr *msg,
 			       size_t len)
 {
@@ -1876,6 +1953,7 @@ static int unix_stream_sendmsg(struct socket *sock, struct msghdr *msg,
 	int sent = 0;
 	struct scm_cookie scm;
 	bool fds_sent = false;
+	bool fds;
 	int data_len;
 
 	wait_for_unix_gc();
@@ -1903,6 +1981,19 @@ static int unix_stream_sendmsg(struct socket *sock, struct msghdr *msg,
 	while (sent < len) {
 		size = len - sent;
 
+		/* Small writes: fill the skb the peer has not read yet */
+		if (size <= UNIX_SKB_APPEND_MAX && (!scm.fp || fds_sent)) {
+			err = unix_stream_append(sk, other, msg, size, &scm);
+			if (err == -EPIPE)
+				goto pipe_err;
+			if (err < 0)
+				goto out_err;
+			if (err > 0) {
+				sent += err;
+				continue;
+			}
+		}
+
 		/* Keep two messages in the pipe so it schedules better */
 		size = min_t(int, size, (sk->sk_sndbuf >> 1) - 64);
 
@@ -1913,7 +2004,11 @@ static int unix_stream_sendmsg(struct socket *sock, struct msghdr *msg,
 
 		data_len = min_t(size_t, size, PAGE_ALIGN(data_len));
 
-		skb = sock_alloc_send_pskb(sk, size - data_len, data_len,
+		/* leave room for the next small writes to be appended */
+		skb = sock_alloc_send_pskb(sk,
+					   size <= UNIX_SKB_APPEND_MAX ?
+					   UNIX_SKB_APPEND_MAX :
+					   size - data_len, data_len,
 					   msg->msg_flags & MSG_DONTWAIT, &err,
 					   get_order(UNIX_SKB_FRAGS_SZ));
 		if (!skb)
@@ -1943,7 +2038,10 @@ static int unix_stream_sendmsg(struct socket *sock, struct msghdr *msg,
 			goto pipe_err_free;
 
 		maybe_add_creds(skb, sock, other);
+		fds = UNIXCB(skb).fp;
 		skb_queue_tail(&other->sk_receive_queue, skb);
+		if (fds)
+			unix_gc_queued_fds(other);
 		unix_state_unlock(other);
 		other->sk_data_ready(other);
 		sent += size;
@@ -2972,6 +3070,7 @@ static void __exit af_unix_exit(void)
 	sock_unregister(PF_UNIX);
 	proto_unregister(&unix_proto);
 	unregister_pernet_subsys(&unix_net_ops);
+	unix_gc_exit();
 }
 
 /* Earlier than device_initcall() so that other drivers invoking
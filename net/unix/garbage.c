@@ -66,6 +66,10 @@
  *		Reimplement with a cycle collecting algorithm. This should
  *		solve several problems with the previous code, like being racy
  *		wrt receive and holding up unrelated socket operations.
+ *
+ *		Run from a work item on a graph of the in-flight sockets
+ *		that is only updated where sockets were marked as changed,
+ *		mostly without holding unix_gc_lock.
  */
 
 #include <linux/kernel.h>
@@ -80,6 +84,10 @@
 #include <linux/proc_fs.h>
 #include <linux/mutex.h>
 #include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
 
 #include <net/sock.h>
 #include <net/af_unix.h>
@@ -91,7 +99,9 @@
 /* Internal data structures and random procedures: */
 
 static LIST_HEAD(gc_candidates);
-static DECLARE_WAIT_QUEUE_HEAD(unix_gc_wait);
+
+static void unix_gc_work_fn(struct work_struct *work);
+static DECLARE_WORK(unix_gc_work, unix_gc_work_fn);
 
 static void scan_inflight(struct sock *x, void (*func)(struct unix_sock *),
 			  struct sk_buff_head *hitlist)
@@ -179,22 +189,580 @@ static void inc_inflight(struct unix_sock *usk)
 	atomic_long_inc(&usk->inflight);
 }
 
-static void inc_inflight_move_tail(struct unix_sock *u)
+/* The in-flight graph.
+ *
+ * Every in-flight socket is a vertex.  A socket whose file sits in the
+ * receive queue of another in-flight socket (or of an embryo queued on
+ * an in-flight listener) is held by it, and each (holder, held) pair is
+ * an edge counting those fds.  The graph and its strongly connected
+ * components are kept from one run to the next and only updated where
+ * something changed.
+ *
+ * Changes are reported with unix_gc_mark(): a socket is marked when it
+ * enters or leaves flight, and when an skb carrying fds is queued on
+ * it.  An fd only leaves a queue by leaving flight, so the edges of an
+ * unmarked holder are still right, except for edges to marked sockets,
+ * whose holders are rescanned.  Fds sent to an embryo are held by its
+ * listener, which the sender does not know, so they make the next run
+ * rescan every in-flight listener.
+ *
+ * Components can only merge or split downstream of a socket whose
+ * references changed.  So the marked sockets, everything they hold and
+ * every component met on the way form the region that is recomputed
+ * with Tarjan's algorithm; the rest of the graph keeps its components.
+ *
+ * A component is "closed" when all the references to its members come
+ * from in-flight sockets and every holding component is closed as
+ * well.  Only closed components can turn into garbage without being
+ * marked: the last user reference going away is an fput() the
+ * collector is not told about.  So each run checks the members of the
+ * closed components, which are kept in topological order, and the
+ * components found dead are verified with the trial deletion of the
+ * original algorithm, restricted to them, before anything is purged.
+ *
+ * Only checking the closed components and purging is done under
+ * unix_gc_lock.  The graph holds a reference on every vertex, so a
+ * socket that left flight stays around until the run handling its
+ * mark, see unix_release_sock().
+ */
+struct unix_vertex {
+	struct unix_sock	*u;
+	struct list_head	entry;		/* unix_vertices */
+	struct list_head	out;		/* edges to the sockets held */
+	struct list_head	in;		/* edges from the holders */
+	unsigned long		nr_in;		/* fds held by other vertices */
+	struct unix_scc		*scc;
+	struct list_head	scc_entry;
+
+	/* Only used while updating the graph */
+	struct list_head	rescan;
+	struct list_head	region;
+	struct list_head	stack;
+	struct list_head	*next_in;
+	struct unix_vertex	*parent;
+	struct unix_edge	*edge;		/* from the holder being scanned */
+	unsigned int		index;
+	unsigned int		lowlink;
+	bool			external;
+};
+
+struct unix_edge {
+	struct unix_vertex	*holder;
+	struct unix_vertex	*v;
+	struct list_head	out_entry;
+	struct list_head	in_entry;
+	unsigned long		count;
+	unsigned long		found;
+};
+
+struct unix_scc {
+	struct list_head	members;
+	struct list_head	entry;		/* unix_closed_sccs */
+	bool			closed;
+	bool			dead;
+};
+
+struct unix_graph_update {
+	struct list_head	rescan;
+	struct list_head	region;
+	struct list_head	stack;
+	unsigned int		index;
+};
+
+/* Only touched from unix_gc_work */
+static LIST_HEAD(unix_vertices);
+static LIST_HEAD(unix_closed_sccs);
+static struct sock **unix_scan_buf;
+static unsigned int unix_scan_size;
+
+/* Set when fds were sent to an embryo, see unix_gc_queued_fds() */
+static bool unix_rescan_listeners;
+
+#define UNIX_SCAN_MIN_SIZE	64
+
+static void unix_vertex_rescan(struct unix_graph_update *up,
+			       struct unix_vertex *v)
+{
+	if (list_empty(&v->rescan))
+		list_add_tail(&v->rescan, &up->rescan);
+}
+
+static void unix_vertex_region(struct unix_graph_update *up,
+			       struct unix_vertex *v)
+{
+	if (list_empty(&v->region))
+		list_add_tail(&v->region, &up->region);
+}
+
+static struct unix_vertex *unix_vertex_get(struct unix_graph_update *up,
+					   struct unix_sock *u)
+{
+	struct unix_vertex *v = u->gc_vertex;
+
+	if (v)
+		return v;
+
+	v = kzalloc(sizeof(*v), GFP_KERNEL);
+	if (!v)
+		return NULL;
+
+	sock_hold(&u->sk);
+	v->u = u;
+	INIT_LIST_HEAD(&v->out);
+	INIT_LIST_HEAD(&v->in);
+	INIT_LIST_HEAD(&v->scc_entry);
+	INIT_LIST_HEAD(&v->rescan);
+	INIT_LIST_HEAD(&v->region);
+	INIT_LIST_HEAD(&v->stack);
+	list_add_tail(&v->entry, &unix_vertices);
+	WRITE_ONCE(u->gc_vertex, v);
+
+	unix_vertex_rescan(up, v);
+	unix_vertex_region(up, v);
+	return v;
+}
+
+static void unix_edge_del(struct unix_edge *e)
+{
+	e->v->nr_in -= e->count;
+	list_del(&e->out_entry);
+	list_del(&e->in_entry);
+	kfree(e);
+}
+
+/* Put the members of @scc back into the region, or just free it. */
+static void unix_scc_del(struct unix_graph_update *up, struct unix_scc *scc)
+{
+	struct unix_vertex *v, *next;
+
+	list_for_each_entry_safe(v, next, &scc->members, scc_entry) {
+		list_del_init(&v->scc_entry);
+		v->scc = NULL;
+		if (up)
+			unix_vertex_region(up, v);
+	}
+	list_del(&scc->entry);
+	kfree(scc);
+}
+
+/* The socket left flight: it holds nothing and nothing holds it. */
+static void unix_vertex_del(struct unix_graph_update *up,
+			    struct unix_vertex *v)
+{
+	struct unix_edge *e, *next;
+
+	if (v->scc)
+		unix_scc_del(up, v->scc);
+
+	list_for_each_entry_safe(e, next, &v->out, out_entry) {
+		if (up)
+			unix_vertex_region(up, e->v);
+		unix_edge_del(e);
+	}
+	list_for_each_entry_safe(e, next, &v->in, in_entry)
+		unix_edge_del(e);
+
+	list_del(&v->entry);
+	list_del(&v->rescan);
+	list_del(&v->region);
+	WRITE_ONCE(v->u->gc_vertex, NULL);
+	sock_put(&v->u->sk);
+	kfree(v);
+}
+
+/* Collect the sockets passed in @x's queue, with a reference each.
+ * Returns false when they did not fit in unix_scan_buf.
+ */
+static bool unix_scan_queue(struct sock *x, unsigned int *nr, int subclass)
+{
+	struct sk_buff *skb;
+	bool fits = true;
+
+	spin_lock_nested(&x->sk_receive_queue.lock, subclass);
+	skb_queue_walk(&x->sk_receive_queue, skb) {
+		struct scm_fp_list *fpl = UNIXCB(skb).fp;
+		int i;
+
+		if (!fpl)
+			continue;
+
+		for (i = 0; i < fpl->count; i++) {
+			struct sock *sk = unix_get_socket(fpl->fp[i]);
+
+			if (!sk)
+				continue;
+			if (*nr >= unix_scan_size) {
+				fits = false;
+				goto out;
+			}
+			sock_hold(sk);
+			unix_scan_buf[(*nr)++] = sk;
+		}
+	}
+out:
+	spin_unlock(&x->sk_receive_queue.lock);
+	return fits;
+}
+
+static bool unix_scan(struct sock *x, unsigned int *nr)
+{
+	struct sk_buff *skb;
+	bool fits = true;
+
+	if (x->sk_state != TCP_LISTEN)
+		return unix_scan_queue(x, nr, 0);
+
+	/* Same as in scan_children(): fds queued on an embryo are held
+	 * by the listener it is queued on.  The embryo's queue lock nests
+	 * inside the listener's, nothing takes them the other way round.
+	 */
+	spin_lock(&x->sk_receive_queue.lock);
+	skb_queue_walk(&x->sk_receive_queue, skb) {
+		fits = unix_scan_queue(skb->sk, nr, SINGLE_DEPTH_NESTING);
+		if (!fits)
+			break;
+	}
+	spin_unlock(&x->sk_receive_queue.lock);
+	return fits;
+}
+
+static void unix_scan_put(unsigned int nr)
+{
+	while (nr)
+		sock_put(unix_scan_buf[--nr]);
+}
+
+/* Find the sockets @v holds now and update its edges to them. */
+static void unix_vertex_scan(struct unix_graph_update *up,
+			     struct unix_vertex *v)
+{
+	struct unix_edge *e, *next;
+	unsigned int nr = 0, i;
+
+	while (!unix_scan(&v->u->sk, &nr)) {
+		unsigned int size = max_t(unsigned int, UNIX_SCAN_MIN_SIZE,
+					  unix_scan_size * 2);
+		struct sock **buf;
+
+		unix_scan_put(nr);
+		nr = 0;
+
+		buf = kvmalloc_array(size, sizeof(*buf), GFP_KERNEL);
+		if (!buf) {
+			/* Keep the old edges, retried on the next unix_gc() */
+			unix_gc_mark(v->u);
+			return;
+		}
+		kvfree(unix_scan_buf);
+		unix_scan_buf = buf;
+		unix_scan_size = size;
+	}
+
+	list_for_each_entry(e, &v->out, out_entry) {
+		e->found = 0;
+		e->v->edge = e;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct unix_sock *u = unix_sk(unix_scan_buf[i]);
+		struct unix_vertex *w = unix_vertex_get(up, u);
+
+		if (w && !w->edge) {
+			e = kzalloc(sizeof(*e), GFP_KERNEL);
+			if (e) {
+				e->holder = v;
+				e->v = w;
+				list_add_tail(&e->out_entry, &v->out);
+				list_add_tail(&e->in_entry, &w->in);
+				w->edge = e;
+			}
+		}
+		if (!w || !w->edge) {
+			/* Under-counted, so w is not collected for now */
+			unix_gc_mark(v->u);
+			unix_gc_mark(u);
+			continue;
+		}
+		w->edge->found++;
+	}
+	unix_scan_put(nr);
+
+	list_for_each_entry_safe(e, next, &v->out, out_entry) {
+		e->v->edge = NULL;
+		if (e->found == e->count)
+			continue;
+
+		unix_vertex_region(up, e->v);
+		e->v->nr_in += e->found - e->count;
+		e->count = e->found;
+		if (!e->count)
+			unix_edge_del(e);
+	}
+}
+
+/* Pick up the marks and rescan what they invalidated. */
+static void unix_graph_rescan(struct unix_graph_update *up)
+{
+	struct llist_node *marked = llist_del_all(&unix_gc_marked);
+	struct unix_sock *u, *next;
+	struct unix_vertex *v;
+	struct unix_edge *e;
+
+	llist_for_each_entry_safe(u, next, marked, gc_node) {
+		/* Marks made from here on are picked up by the next run */
+		smp_mb__before_atomic();
+		clear_bit(UNIX_GC_MARKED, &u->gc_flags);
+		smp_mb__after_atomic();
+
+		v = u->gc_vertex;
+		if (!atomic_long_read(&u->inflight)) {
+			if (v)
+				unix_vertex_del(up, v);
+		} else {
+			v = unix_vertex_get(up, u);
+			if (!v) {
+				unix_gc_mark(u);
+			} else {
+				unix_vertex_rescan(up, v);
+				unix_vertex_region(up, v);
+				list_for_each_entry(e, &v->in, in_entry)
+					unix_vertex_rescan(up, e->holder);
+			}
+		}
+		sock_put(&u->sk);
+	}
+
+	/* A listener queued on after this is seen by the scan below */
+	if (READ_ONCE(unix_rescan_listeners)) {
+		WRITE_ONCE(unix_rescan_listeners, false);
+		smp_mb();
+		list_for_each_entry(v, &unix_vertices, entry)
+			if (v->u->sk.sk_state == TCP_LISTEN)
+				unix_vertex_rescan(up, v);
+	}
+
+	while (!list_empty(&up->rescan)) {
+		v = list_first_entry(&up->rescan, struct unix_vertex, rescan);
+		list_del_init(&v->rescan);
+		unix_vertex_scan(up, v);
+	}
+}
+
+static void unix_scc_add(struct unix_graph_update *up, struct unix_vertex *root)
+{
+	struct unix_scc *scc = kmalloc(sizeof(*scc), GFP_KERNEL);
+	struct unix_vertex *v;
+	struct unix_edge *e;
+
+	if (scc) {
+		INIT_LIST_HEAD(&scc->members);
+		INIT_LIST_HEAD(&scc->entry);
+		scc->closed = true;
+		scc->dead = false;
+	}
+
+	do {
+		v = list_first_entry(&up->stack, struct unix_vertex, stack);
+		list_del_init(&v->stack);
+		if (scc) {
+			v->scc = scc;
+			list_add_tail(&v->scc_entry, &scc->members);
+		} else {
+			/* Left without a component, i.e. open, until redone */
+			unix_gc_mark(v->u);
+		}
+	} while (v != root);
+
+	if (!scc)
+		return;
+
+	/* Holding components were emitted first, so they are settled. */
+	list_for_each_entry(v, &scc->members, scc_entry) {
+		if (v->external) {
+			scc->closed = false;
+			break;
+		}
+		list_for_each_entry(e, &v->in, in_entry) {
+			struct unix_scc *hs = e->holder->scc;
+
+			if (hs != scc && (!hs || !hs->closed)) {
+				scc->closed = false;
+				break;
+			}
+		}
+		if (!scc->closed)
+			break;
+	}
+
+	/* Nothing outside the region is held by the region, so the
+	 * topological order holds when appending.
+	 */
+	if (scc->closed)
+		list_add_tail(&scc->entry, &unix_closed_sccs);
+}
+
+static void unix_tarjan_push(struct unix_graph_update *up,
+			     struct unix_vertex *v, struct unix_vertex *parent)
+{
+	v->index = v->lowlink = up->index++;
+	v->next_in = v->in.next;
+	v->parent = parent;
+	list_add(&v->stack, &up->stack);
+}
+
+/* Tarjan's algorithm over the region, following the holders so that a
+ * component is emitted after all the components holding it.
+ */
+static void unix_region_tarjan(struct unix_graph_update *up)
 {
-	atomic_long_inc(&u->inflight);
-	/* If this still might be part of a cycle, move it to the end
-	 * of the list, so that it's checked even if it was already
-	 * passed over
+	struct unix_vertex *root, *v;
+
+	list_for_each_entry(v, &up->region, region) {
+		v->index = 0;
+		v->external = v->nr_in < atomic_long_read(&v->u->inflight);
+	}
+
+	up->index = 1;
+	list_for_each_entry(root, &up->region, region) {
+		if (root->index)
+			continue;
+
+		unix_tarjan_push(up, root, NULL);
+		v = root;
+		while (v) {
+			struct unix_vertex *parent;
+
+			if (v->next_in != &v->in) {
+				struct unix_edge *e;
+				struct unix_vertex *w;
+
+				e = list_entry(v->next_in, struct unix_edge,
+					       in_entry);
+				v->next_in = v->next_in->next;
+				w = e->holder;
+
+				/* Outside the region the components stand */
+				if (list_empty(&w->region))
+					continue;
+
+				if (!w->index) {
+					unix_tarjan_push(up, w, v);
+					v = w;
+				} else if (!list_empty(&w->stack)) {
+					v->lowlink = min(v->lowlink, w->index);
+				}
+				continue;
+			}
+
+			if (v->lowlink == v->index)
+				unix_scc_add(up, v);
+
+			parent = v->parent;
+			if (parent)
+				parent->lowlink = min(parent->lowlink,
+						      v->lowlink);
+			v = parent;
+		}
+	}
+}
+
+static void unix_graph_update(void)
+{
+	struct unix_graph_update up = {
+		.rescan = LIST_HEAD_INIT(up.rescan),
+		.region = LIST_HEAD_INIT(up.region),
+		.stack = LIST_HEAD_INIT(up.stack),
+	};
+	struct unix_vertex *v, *next;
+	struct unix_edge *e;
+
+	unix_graph_rescan(&up);
+
+	/* Grow the region to everything downstream of it and to whole
+	 * components, the list is walked while it is extended.
 	 */
-	if (test_bit(UNIX_GC_MAYBE_CYCLE, &u->gc_flags))
-		list_move_tail(&u->link, &gc_candidates);
+	list_for_each_entry(v, &up.region, region) {
+		list_for_each_entry(e, &v->out, out_entry)
+			unix_vertex_region(&up, e->v);
+		if (v->scc)
+			unix_scc_del(&up, v->scc);
+	}
+
+	unix_region_tarjan(&up);
+
+	list_for_each_entry_safe(v, next, &up.region, region)
+		list_del_init(&v->region);
+}
+
+/* Move the members of the dead components to gc_candidates. */
+static bool unix_graph_select(void)
+{
+	struct unix_scc *scc;
+	bool found = false;
+
+	list_for_each_entry(scc, &unix_closed_sccs, entry) {
+		struct unix_vertex *v;
+		struct unix_edge *e;
+
+		scc->dead = true;
+		list_for_each_entry(v, &scc->members, scc_entry) {
+			struct unix_sock *u = v->u;
+			long inflight_refs = atomic_long_read(&u->inflight);
+			long total_refs;
+
+			/* Left flight, its mark is still pending */
+			if (!inflight_refs) {
+				scc->dead = false;
+				break;
+			}
+
+			total_refs = file_count(u->sk.sk_socket->file);
+			BUG_ON(total_refs < inflight_refs);
+			if (total_refs != inflight_refs) {
+				scc->dead = false;
+				break;
+			}
+			list_for_each_entry(e, &v->in, in_entry) {
+				struct unix_scc *hs = e->holder->scc;
+
+				if (hs != scc && (!hs || !hs->dead)) {
+					scc->dead = false;
+					break;
+				}
+			}
+			if (!scc->dead)
+				break;
+		}
+		if (!scc->dead)
+			continue;
+
+		list_for_each_entry(v, &scc->members, scc_entry) {
+			list_move_tail(&v->u->link, &gc_candidates);
+			set_bit(UNIX_GC_CANDIDATE, &v->u->gc_flags);
+		}
+		found = true;
+	}
+	return found;
+}
+
+/* Called after queueing an skb that carries fds on @other. */
+void unix_gc_queued_fds(struct sock *other)
+{
+	/* An embryo's fds are held by its listener */
+	if (!READ_ONCE(other->sk_socket))
+		WRITE_ONCE(unix_rescan_listeners, true);
+	else
+		unix_gc_mark(unix_sk(other));
 }
 
 static bool gc_in_progress;
 #define UNIX_INFLIGHT_TRIGGER_GC 16000
+#define UNIX_INFLIGHT_SANE_USER (SCM_MAX_FD * 8)
 
 void wait_for_unix_gc(void)
 {
+	struct user_struct *user = current_user();
+
 	/* If number of inflight sockets is insane,
 	 * force a garbage collect right now.
 	 * Paired with the WRITE_ONCE() in unix_inflight(),
@@ -203,103 +771,83 @@ void wait_for_unix_gc(void)
 	if (READ_ONCE(unix_tot_inflight) > UNIX_INFLIGHT_TRIGGER_GC &&
 	    !READ_ONCE(gc_in_progress))
 		unix_gc();
-	wait_event(unix_gc_wait, gc_in_progress == false);
+
+	/* Only throttle the users that keep lots of fds in flight
+	 * themselves, everybody else goes on while the collector runs.
+	 */
+	if (READ_ONCE(gc_in_progress) &&
+	    READ_ONCE(user->unix_inflight) > UNIX_INFLIGHT_SANE_USER)
+		flush_work(&unix_gc_work);
 }
 
 /* The external entry point: unix_gc() */
 void unix_gc(void)
 {
-	struct unix_sock *u;
-	struct unix_sock *next;
+	/* Paired with READ_ONCE() in wait_for_unix_gc(). */
+	WRITE_ONCE(gc_in_progress, true);
+	queue_work(system_unbound_wq, &unix_gc_work);
+}
+
+static void unix_gc_work_fn(struct work_struct *work)
+{
 	struct sk_buff_head hitlist;
-	struct list_head cursor;
-	LIST_HEAD(not_cycle_list);
+	struct unix_sock *u;
+	bool retried = false, stale = false;
+
+retry:
+	unix_graph_update();
 
 	spin_lock(&unix_gc_lock);
 
-	/* Avoid a recursive GC. */
-	if (gc_in_progress)
+	if (!unix_graph_select())
 		goto out;
 
-	/* Paired with READ_ONCE() in wait_for_unix_gc(). */
-	WRITE_ONCE(gc_in_progress, true);
-
-	/* First, select candidates for garbage collection.  Only
-	 * in-flight sockets are considered, and from those only ones
-	 * which don't have any external reference.
+	/* Holding unix_gc_lock keeps the candidates from being
+	 * detached, and hence from gaining an external reference.
+	 * Since there are no possible receivers, all buffers
+	 * currently on the candidates' queues stay there, and new
+	 * ones can only come from non candidates, which are
+	 * ignored by scan_inflight().
 	 *
-	 * Holding unix_gc_lock will protect these candidates from
-	 * being detached, and hence from gaining an external
-	 * reference.  Since there are no possible receivers, all
-	 * buffers currently on the candidates' queues stay there
-	 * during the garbage collection.
-	 *
-	 * We also know that no new candidate can be added onto the
-	 * receive queues.  Other, non candidate sockets _can_ be
-	 * added to queue, so we must make sure only to touch
-	 * candidates.
-	 */
-	list_for_each_entry_safe(u, next, &gc_inflight_list, link) {
-		long total_refs;
-		long inflight_refs;
-
-		total_refs = file_count(u->sk.sk_socket->file);
-		inflight_refs = atomic_long_read(&u->inflight);
-
-		BUG_ON(inflight_refs < 1);
-		BUG_ON(total_refs < inflight_refs);
-		if (total_refs == inflight_refs) {
-			list_move_tail(&u->link, &gc_candidates);
-			__set_bit(UNIX_GC_CANDIDATE, &u->gc_flags);
-			__set_bit(UNIX_GC_MAYBE_CYCLE, &u->gc_flags);
-		}
-	}
-
-	/* Now remove all internal in-flight reference to children of
-	 * the candidates.
+	 * Make sure that every reference to a candidate really comes
+	 * from another candidate before killing anything.
 	 */
 	list_for_each_entry(u, &gc_candidates, link)
 		scan_children(&u->sk, dec_inflight, NULL);
 
-	/* Restore the references for children of all candidates,
-	 * which have remaining references.  Do this recursively, so
-	 * only those remain, which form cyclic references.
-	 *
-	 * Use a "cursor" link, to make the list traversal safe, even
-	 * though elements might be moved about.
-	 */
-	list_add(&cursor, &gc_candidates);
-	while (cursor.next != &gc_candidates) {
-		u = list_entry(cursor.next, struct unix_sock, link);
-
-		/* Move cursor to after the current position. */
-		list_move(&cursor, &u->link);
-
+	list_for_each_entry(u, &gc_candidates, link) {
 		if (atomic_long_read(&u->inflight) > 0) {
-			list_move_tail(&u->link, &not_cycle_list);
-			__clear_bit(UNIX_GC_MAYBE_CYCLE, &u->gc_flags);
-			scan_children(&u->sk, inc_inflight_move_tail, NULL);
+			stale = true;
+			break;
 		}
 	}
-	list_del(&cursor);
 
-	/* Now gc_candidates contains only garbage.  Restore original
-	 * inflight counters for these as well, and remove the skbuffs
+	if (stale) {
+		list_for_each_entry(u, &gc_candidates, link)
+			scan_children(&u->sk, inc_inflight, NULL);
+		while (!list_empty(&gc_candidates)) {
+			u = list_entry(gc_candidates.next, struct unix_sock, link);
+			clear_bit(UNIX_GC_CANDIDATE, &u->gc_flags);
+			list_move_tail(&u->link, &gc_inflight_list);
+			/* rescan them and whoever holds them */
+			unix_gc_mark(u);
+		}
+		if (retried)
+			goto out;
+		spin_unlock(&unix_gc_lock);
+		retried = true;
+		stale = false;
+		goto retry;
+	}
+
+	/* gc_candidates contains only garbage.  Restore original
+	 * inflight counters for these, and remove the skbuffs
 	 * which are creating the cycle(s).
 	 */
 	skb_queue_head_init(&hitlist);
 	list_for_each_entry(u, &gc_candidates, link)
 		scan_children(&u->sk, inc_inflight, &hitlist);
 
-	/* not_cycle_list contains those sockets which do not make up a
-	 * cycle.  Restore these to the inflight list.
-	 */
-	while (!list_empty(&not_cycle_list)) {
-		u = list_entry(not_cycle_list.next, struct unix_sock, link);
-		__clear_bit(UNIX_GC_CANDIDATE, &u->gc_flags);
-		list_move_tail(&u->link, &gc_inflight_list);
-	}
-
 	spin_unlock(&unix_gc_lock);
 
 	/* Here we are. Hitlist is filled. Die. */
@@ -310,11 +858,31 @@ void unix_gc(void)
 	/* All candidates should have been detached by now. */
 	BUG_ON(!list_empty(&gc_candidates));
 
+ out:
 	/* Paired with READ_ONCE() in wait_for_unix_gc(). */
 	WRITE_ONCE(gc_in_progress, false);
 
-	wake_up(&unix_gc_wait);
-
- out:
 	spin_unlock(&unix_gc_lock);
 }
+
+void unix_gc_exit(void)
+{
+	struct llist_node *marked;
+	struct unix_vertex *v, *next;
+	struct unix_sock *u, *tmp;
+
+	flush_work(&unix_gc_work);
+
+	marked = llist_del_all(&unix_gc_marked);
+	llist_for_each_entry_safe(u, tmp, marked, gc_node) {
+		clear_bit(UNIX_GC_MARKED, &u->gc_flags);
+		sock_put(&u->sk);
+	}
+
+	list_for_each_entry_safe(v, next, &unix_vertices, entry)
+		unix_vertex_del(NULL, v);
+
+	kvfree(unix_scan_buf);
+	unix_scan_buf = NULL;
+	unix_scan_size = 0;
+}
@@ -20,6 +20,9 @@ EXPORT_SYMBOL(gc_inflight_list);
 DEFINE_SPINLOCK(unix_gc_lock);
 EXPORT_SYMBOL(unix_gc_lock);
 
+LLIST_HEAD(unix_gc_marked);
+EXPORT_SYMBOL(unix_gc_marked);
+
 struct sock *unix_get_socket(struct file *filp)
 {
 	struct sock *u_sock = NULL;
@@ -38,6 +41,19 @@ struct sock *unix_get_socket(struct file *filp)
 }
 EXPORT_SYMBOL(unix_get_socket);
 
+/* Tell the collector that the references to @u, or the sockets @u
+ * holds, changed.  @u is kept until the collector has seen the mark.
+ */
+void unix_gc_mark(struct unix_sock *u)
+{
+	if (test_and_set_bit(UNIX_GC_MARKED, &u->gc_flags))
+		return;
+
+	sock_hold(&u->sk);
+	llist_add(&u->gc_node, &unix_gc_marked);
+}
+EXPORT_SYMBOL(unix_gc_mark);
+
 /* Keep the number of times in flight count for the file
  * descriptor if it is for an AF_UNIX socket.
  */
@@ -58,6 +74,7 @@ void unix_inflight(struct user_struct *user, struct file *fp)
 		}
 		/* Paired with READ_ONCE() in wait_for_unix_gc() */
 		WRITE_ONCE(unix_tot_inflight, unix_tot_inflight + 1);
+		unix_gc_mark(u);
 	}
 	user->unix_inflight++;
 	spin_unlock(&unix_gc_lock);
@@ -79,6 +96,7 @@ void unix_notinflight(struct user_struct *user, struct file *fp)
 			list_del_init(&u->link);
 		/* Paired with READ_ONCE() in wait_for_unix_gc() */
 		WRITE_ONCE(unix_tot_inflight, unix_tot_inflight - 1);
+		unix_gc_mark(u);
 	}
 	user->unix_inflight--;
 	spin_unlock(&unix_gc_lock);
@@ -3,6 +3,10 @@
 
 extern struct list_head gc_inflight_list;
 extern spinlock_t unix_gc_lock;
+extern struct llist_head unix_gc_marked;
+
+void unix_gc_mark(struct unix_sock *u);
+void unix_gc_queued_fds(struct sock *other);
 
 int unix_attach_fds(struct scm_cookie *scm, struct sk_buff *skb);
 void unix_detach_fds(struct scm_cookie *scm, struct sk_buff *skb);
@@ -26,6 +26,7 @@
 #include <linux/cache.h>
 #include <linux/cpu.h>
 #include <linux/audit.h>
+#include <linux/inetdevice.h>
 #include <net/dst.h>
 #include <net/flow.h>
 #include <net/xfrm.h>
@@ -271,6 +272,7 @@ struct xfrm_policy *xfrm_policy_alloc(struct net *net, gfp_t gfp)
 		INIT_LIST_HEAD(&policy->walk.all);
 		INIT_HLIST_NODE(&policy->bydst);
 		INIT_HLIST_NODE(&policy->byidx);
+		INIT_HLIST_NODE(&policy->bydst_inexact_list);
 		rwlock_init(&policy->lock);
 		refcount_set(&policy->refcnt, 1);
 		skb_queue_head_init(&policy->polq.hold_queue);
@@ -390,6 +392,270 @@ static struct hlist_head *policy_hash_direct(struct net *net,
 		     lockdep_is_held(&net->xfrm.xfrm_policy_lock)) + hash;
 }
 
+/*
+ * Policies that are too inexact for the bydst hash are additionally kept in
+ * bins keyed by (family, prefix lengths, masked addresses), in an rbtree
+ * per direction.  A lookup masks the flow addresses once per distinct
+ * prefix length class and searches the tree, instead of matching every
+ * inexact policy.  Each bin chain is sorted by priority and insertion
+ * order (pos), and the winner across bins is picked by the same order, so
+ * the result is the one the linear policy_inexact walk would return.
+ *
+ * Readers run under RCU and retry on net->xfrm.policy_inexact_seq; writers
+ * hold xfrm_policy_lock.
+ */
+struct xfrm_pol_inexact_key {
+	xfrm_address_t	daddr;
+	xfrm_address_t	saddr;
+	u16		family;
+	u8		dprefixlen;
+	u8		sprefixlen;
+};
+
+struct xfrm_pol_inexact_bin {
+	struct rb_node			node;
+	struct hlist_head		hhead;
+	struct xfrm_pol_inexact_key	k;
+	struct rcu_head			rcu;
+};
+
+struct xfrm_pol_inexact_class {
+	struct list_head	list;
+	unsigned int		nbins;
+	u16			family;
+	u8			dprefixlen;
+	u8			sprefixlen;
+	struct rcu_head		rcu;
+};
+
+static void xfrm_pol_inexact_addr_mask(xfrm_address_t *dst,
+				       const xfrm_address_t *src,
+				       u8 prefixlen, u16 family)
+{
+	switch (family) {
+	case AF_INET:
+		dst->a4 = src->a4 & inet_make_mask(min_t(u8, prefixlen, 32));
+		break;
+	case AF_INET6:
+		ipv6_addr_prefix(&dst->in6, &src->in6,
+				 min_t(u8, prefixlen, 128));
+		break;
+	}
+}
+
+static void xfrm_pol_inexact_key_init(struct xfrm_pol_inexact_key *k,
+				      const xfrm_address_t *daddr,
+				      const xfrm_address_t *saddr,
+				      u8 dprefixlen, u8 sprefixlen,
+				      u16 family)
+{
+	/* keys are compared with memcmp(), padding must be clear */
+	memset(k, 0, sizeof(*k));
+	k->family = family;
+	k->dprefixlen = dprefixlen;
+	k->sprefixlen = sprefixlen;
+	xfrm_pol_inexact_addr_mask(&k->daddr, daddr, dprefixlen, family);
+	xfrm_pol_inexact_addr_mask(&k->saddr, saddr, sprefixlen, family);
+}
+
+static struct xfrm_pol_inexact_bin *
+xfrm_pol_inexact_bin_find(struct rb_root *root,
+			  const struct xfrm_pol_inexact_key *k)
+{
+	struct rb_node *node = rcu_dereference_raw(root->rb_node);
+
+	while (node) {
+		struct xfrm_pol_inexact_bin *bin;
+		int delta;
+
+		bin = rb_entry(node, struct xfrm_pol_inexact_bin, node);
+		delta = memcmp(k, &bin->k, sizeof(*k));
+		if (delta < 0)
+			node = rcu_dereference_raw(node->rb_left);
+		else if (delta > 0)
+			node = rcu_dereference_raw(node->rb_right);
+		else
+			return bin;
+	}
+
+	return NULL;
+}
+
+static struct xfrm_pol_inexact_class *
+xfrm_pol_inexact_class_find(struct xfrm_policy_inexact *t,
+			    const struct xfrm_pol_inexact_key *k)
+{
+	struct xfrm_pol_inexact_class *c;
+
+	list_for_each_entry(c, &t->classes, list) {
+		if (c->family == k->family &&
+		    c->dprefixlen == k->dprefixlen &&
+		    c->sprefixlen == k->sprefixlen)
+			return c;
+	}
+
+	return NULL;
+}
+
+/* Returns true if @a is to be preferred over @b */
+static bool xfrm_pol_inexact_before(const struct xfrm_policy *a,
+				    const struct xfrm_policy *b)
+{
+	if (a->priority != b->priority)
+		return a->priority < b->priority;
+	return a->pos < b->pos;
+}
+
+static void xfrm_pol_inexact_chain_add(struct hlist_head *chain,
+				       struct xfrm_policy *policy)
+{
+	struct xfrm_policy *pol;
+	struct hlist_node *newpos = NULL;
+
+	hlist_for_each_entry(pol, chain, bydst_inexact_list) {
+		if (xfrm_pol_inexact_before(policy, pol))
+			break;
+		newpos = &pol->bydst_inexact_list;
+	}
+	if (newpos)
+		hlist_add_behind_rcu(&policy->bydst_inexact_list, newpos);
+	else
+		hlist_add_head_rcu(&policy->bydst_inexact_list, chain);
+}
+
+static struct xfrm_pol_inexact_bin *
+xfrm_pol_inexact_bin_get(struct xfrm_policy_inexact *t,
+			 const struct xfrm_pol_inexact_key *k)
+{
+	struct rb_node **p = &t->root.rb_node, *parent = NULL;
+	struct xfrm_pol_inexact_class *c;
+	struct xfrm_pol_inexact_bin *bin;
+
+	while (*p) {
+		int delta;
+
+		parent = *p;
+		bin = rb_entry(parent, struct xfrm_pol_inexact_bin, node);
+		delta = memcmp(k, &bin->k, sizeof(*k));
+		if (delta < 0)
+			p = &parent->rb_left;
+		else if (delta > 0)
+			p = &parent->rb_right;
+		else
+			return bin;
+	}
+
+	c = xfrm_pol_inexact_class_find(t, k);
+	if (!c) {
+		c = kzalloc(sizeof(*c), GFP_ATOMIC);
+		if (!c)
+			return NULL;
+		c->family = k->family;
+		c->dprefixlen = k->dprefixlen;
+		c->sprefixlen = k->sprefixlen;
+		list_add_tail_rcu(&c->list, &t->classes);
+	}
+
+	bin = kzalloc(sizeof(*bin), GFP_ATOMIC);
+	if (!bin) {
+		if (!c->nbins) {
+			list_del_rcu(&c->list);
+			kfree_rcu(c, rcu);
+		}
+		return NULL;
+	}
+	bin->k = *k;
+	INIT_HLIST_HEAD(&bin->hhead);
+	c->nbins++;
+
+	rb_link_node_rcu(&bin->node, parent, p);
+	rb_insert_color(&bin->node, &t->root);
+
+	return bin;
+}
+
+static void xfrm_pol_inexact_bin_put(struct xfrm_policy_inexact *t,
+				     struct xfrm_pol_inexact_bin *bin)
+{
+	struct xfrm_pol_inexact_class *c;
+
+	if (!hlist_empty(&bin->hhead))
+		return;
+
+	rb_erase(&bin->node, &t->root);
+	c = xfrm_pol_inexact_class_find(t, &bin->k);
+	if (!WARN_ON(!c) && !--c->nbins) {
+		list_del_rcu(&c->list);
+		kfree_rcu(c, rcu);
+	}
+	kfree_rcu(bin, rcu);
+}
+
+/* Caller holds xfrm_policy_lock and the policy_inexact_seq write side. */
+static void __xfrm_pol_inexact_insert(struct net *net,
+				      struct xfrm_policy *policy, int dir)
+{
+	struct xfrm_policy_inexact *t = &net->xfrm.policy_inexact_bins[dir];
+	const struct xfrm_selector *sel = &policy->selector;
+	struct xfrm_pol_inexact_bin *bin = NULL;
+	struct xfrm_pol_inexact_key k;
+
+	if (policy->family == AF_INET || policy->family == AF_INET6) {
+		xfrm_pol_inexact_key_init(&k, &sel->daddr, &sel->saddr,
+					  sel->prefixlen_d, sel->prefixlen_s,
+					  policy->family);
+		bin = xfrm_pol_inexact_bin_get(t, &k);
+	}
+
+	xfrm_pol_inexact_chain_add(bin ? &bin->hhead : &t->unbinned, policy);
+}
+
+static void xfrm_pol_inexact_insert(struct net *net,
+				    struct xfrm_policy *policy, int dir)
+{
+	write_seqcount_begin(&net->xfrm.policy_inexact_seq);
+	__xfrm_pol_inexact_insert(net, policy, dir);
+	write_seqcount_end(&net->xfrm.policy_inexact_seq);
+}
+
+static void xfrm_pol_inexact_unlink(struct net *net,
+				    struct xfrm_policy *pol, int dir)
+{
+	struct xfrm_policy_inexact *t = &net->xfrm.policy_inexact_bins[dir];
+	const struct xfrm_selector *sel = &pol->selector;
+	struct xfrm_pol_inexact_bin *bin;
+	struct xfrm_pol_inexact_key k;
+
+	write_seqcount_begin(&net->xfrm.policy_inexact_seq);
+	hlist_del_init_rcu(&pol->bydst_inexact_list);
+	if (pol->family == AF_INET || pol->family == AF_INET6) {
+		xfrm_pol_inexact_key_init(&k, &sel->daddr, &sel->saddr,
+					  sel->prefixlen_d, sel->prefixlen_s,
+					  pol->family);
+		bin = xfrm_pol_inexact_bin_find(&t->root, &k);
+		if (bin)
+			xfrm_pol_inexact_bin_put(t, bin);
+	}
+	write_seqcount_end(&net->xfrm.policy_inexact_seq);
+}
+
+/* Drop all bins; caller holds the policy_inexact_seq write side. */
+static void xfrm_pol_inexact_reset(struct xfrm_policy_inexact *t)
+{
+	struct xfrm_pol_inexact_class *c, *ctmp;
+	struct xfrm_pol_inexact_bin *bin, *btmp;
+
+	rbtree_postorder_for_each_entry_safe(bin, btmp, &t->root, node)
+		kfree_rcu(bin, rcu);
+	t->root = RB_ROOT;
+
+	list_for_each_entry_safe(c, ctmp, &t->classes, list) {
+		list_del_rcu(&c->list);
+		kfree_rcu(c, rcu);
+	}
+	INIT_HLIST_HEAD(&t->unbinned);
+}
+
 static void xfrm_dst_hash_transfer(struct net *net,
 				   struct hlist_head *list,
 				   struct hlist_head *ndsttable,
@@ -593,10 +859,12 @@ static void xfrm_hash_rebuild(struct work_struct *work)
 	} while (read_seqretry(&net->xfrm.policy_hthresh.lock, seq));
 
 	spin_lock_bh(&net->xfrm.xfrm_policy_lock);
+	write_seqcount_begin(&net->xfrm.policy_inexact_seq);
 
 	/* reset the bydst and inexact table in all directions */
 	for (dir = 0; dir < XFRM_POLICY_MAX; dir++) {
 		INIT_HLIST_HEAD(&net->xfrm.policy_inexact[dir]);
+		xfrm_pol_inexact_reset(&net->xfrm.policy_inexact_bins[dir]);
 		hmask = net->xfrm.policy_bydst[dir].hmask;
 		odst = net->xfrm.policy_bydst[dir].table;
 		for (i = hmask; i >= 0; i--)
@@ -623,10 +891,10 @@ static void xfrm_hash_rebuild(struct work_struct *work)
 			/* skip socket policies */
 			continue;
 		}
+		dir = xfrm_policy_id2dir(policy->index);
 		newpos = NULL;
 		chain = policy_hash_bysel(net, &policy->selector,
-					  policy->family,
-					  xfrm_policy_id2dir(policy->index));
+					  policy->family, dir);
 		hlist_for_each_entry(pol, chain, bydst) {
 			if (policy->priority >= pol->priority)
 				newpos = &pol->bydst;
@@ -637,8 +905,16 @@ static void xfrm_hash_rebuild(struct work_struct *work)
 			hlist_add_behind_rcu(&policy->bydst, newpos);
 		else
 			hlist_add_head_rcu(&policy->bydst, chain);
+
+		/* the old bins are gone, relink from scratch */
+		INIT_HLIST_NODE(&policy->bydst_inexact_list);
+		if (chain == &net->xfrm.policy_inexact[dir]) {
+			policy->pos = ++net->xfrm.policy_inexact_pos;
+			__xfrm_pol_inexact_insert(net, policy, dir);
+		}
 	}
 
+	write_seqcount_end(&net->xfrm.policy_inexact_seq);
 	spin_unlock_bh(&net->xfrm.xfrm_policy_lock);
 
 	mutex_unlock(&hash_resize_mutex);
@@ -770,6 +1046,14 @@ int xfrm_policy_insert(int dir, struct xfrm_policy *policy, int excl)
 		hlist_add_behind_rcu(&policy->bydst, newpos);
 	else
 		hlist_add_head_rcu(&policy->bydst, chain);
+	if (chain == &net->xfrm.policy_inexact[dir]) {
+		/* a replacement keeps its predecessor's place among equals */
+		if (delpol && delpol->priority == policy->priority)
+			policy->pos = delpol->pos;
+		else
+			policy->pos = ++net->xfrm.policy_inexact_pos;
+		xfrm_pol_inexact_insert(net, policy, dir);
+	}
 	__xfrm_policy_link(policy, dir);
 
 	/* After previous checking, family can either be AF_INET or AF_INET6 */
@@ -1079,6 +1363,81 @@ static int xfrm_policy_match(const struct xfrm_policy *pol,
 	return ret;
 }
 
+static void xfrm_pol_inexact_scan(struct hlist_head *chain,
+				  const struct flowi *fl, u8 type, u16 family,
+				  int dir, u32 if_id,
+				  const struct xfrm_policy *exact,
+				  struct xfrm_policy **best, int *best_err)
+{
+	struct xfrm_policy *pol;
+	int err;
+
+	hlist_for_each_entry_rcu(pol, chain, bydst_inexact_list) {
+		/* exact policies win ties */
+		if (exact && pol->priority >= exact->priority)
+			break;
+		if (*best && !xfrm_pol_inexact_before(pol, *best))
+			break;
+
+		err = xfrm_policy_match(pol, fl, type, family, dir, if_id);
+		if (err == -ESRCH)
+			continue;
+
+		*best = pol;
+		*best_err = err;
+		break;
+	}
+}
+
+/*
+ * Find the inexact policy matching @fl that precedes @exact, if any.
+ * Returns the policy, NULL, or an error pointer if the security check of
+ * the winning policy failed.  Called under rcu_read_lock().
+ */
+static struct xfrm_policy *
+xfrm_policy_inexact_lookup(struct net *net, u8 type, const struct flowi *fl,
+			   u16 family, u8 dir, u32 if_id,
+			   const xfrm_address_t *daddr,
+			   const xfrm_address_t *saddr,
+			   const struct xfrm_policy *exact)
+{
+	struct xfrm_policy_inexact *t = &net->xfrm.policy_inexact_bins[dir];
+	struct xfrm_pol_inexact_class *c;
+	struct xfrm_policy *best;
+	unsigned int seq;
+	int best_err;
+
+	do {
+		seq = read_seqcount_begin(&net->xfrm.policy_inexact_seq);
+		best = NULL;
+		best_err = 0;
+
+		xfrm_pol_inexact_scan(&t->unbinned, fl, type, family, dir,
+				      if_id, exact, &best, &best_err);
+
+		list_for_each_entry_rcu(c, &t->classes, list) {
+			struct xfrm_pol_inexact_bin *bin;
+			struct xfrm_pol_inexact_key k;
+
+			if (c->family != family)
+				continue;
+
+			xfrm_pol_inexact_key_init(&k, daddr, saddr,
+						  c->dprefixlen, c->sprefixlen,
+						  family);
+			bin = xfrm_pol_inexact_bin_find(&t->root, &k);
+			if (bin)
+				xfrm_pol_inexact_scan(&bin->hhead, fl, type,
+						      family, dir, if_id, exact,
+						      &best, &best_err);
+		}
+	} while (read_seqcount_retry(&net->xfrm.policy_inexact_seq, seq));
+
+	if (best_err)
+		return ERR_PTR(best_err);
+	return best;
+}
+
 static struct xfrm_policy *xfrm_policy_lookup_bytype(struct net *net, u8 type,
 						     const struct flowi *fl,
 						     u16 family, u8 dir,
@@ -1089,7 +1448,6 @@ static struct xfrm_policy *xfrm_policy_lookup_bytype(struct net *net, u8 type,
 	const xfrm_address_t *daddr, *saddr;
 	struct hlist_head *chain;
 	unsigned int sequence;
-	u32 priority;
 
 	daddr = xfrm_flowi_daddr(fl, family);
 	saddr = xfrm_flowi_saddr(fl, family);
@@ -1103,7 +1461,6 @@ static struct xfrm_policy *xfrm_policy_lookup_bytype(struct net *net, u8 type,
 		chain = policy_hash_direct(net, daddr, saddr, family, dir);
 	} while (read_seqcount_retry(&xfrm_policy_hash_generation, sequence));
 
-	priority = ~0U;
 	ret = NULL;
 	hlist_for_each_entry_rcu(pol, chain, bydst) {
 		err = xfrm_policy_match(pol, fl, type, family, dir, if_id);
@@ -1116,28 +1473,17 @@ static struct xfrm_policy *xfrm_policy_lookup_bytype(struct net *net, u8 type,
 			}
 		} else {
 			ret = pol;
-			priority = ret->priority;
 			break;
 		}
 	}
-	chain = &net->xfrm.policy_inexact[dir];
-	hlist_for_each_entry_rcu(pol, chain, bydst) {
-		if ((pol->priority >= priority) && ret)
-			break;
-
-		err = xfrm_policy_match(pol, fl, type, family, dir, if_id);
-		if (err) {
-			if (err == -ESRCH)
-				continue;
-			else {
-				ret = ERR_PTR(err);
-				goto fail;
-			}
-		} else {
-			ret = pol;
-			break;
-		}
+	pol = xfrm_policy_inexact_lookup(net, type, fl, family, dir, if_id,
+					 daddr, saddr, ret);
+	if (IS_ERR(pol)) {
+		ret = pol;
+		goto fail;
 	}
+	if (pol)
+		ret = pol;
 
 	if (read_seqcount_retry(&xfrm_policy_hash_generation, sequence))
 		goto retry;
@@ -1232,6 +1578,8 @@ static struct xfrm_policy *__xfrm_policy_unlink(struct xfrm_policy *pol,
 		hlist_del_rcu(&pol->bydst);
 		hlist_del(&pol->byidx);
 	}
+	if (!hlist_unhashed(&pol->bydst_inexact_list))
+		xfrm_pol_inexact_unlink(net, pol, dir);
 
 	list_del_init(&pol->walk.all);
 	net->xfrm.policy_count[dir]--;
@@ -2839,6 +3187,9 @@ static int __net_init xfrm_policy_init(struct net *net)
 		net->xfrm.policy_count[dir] = 0;
 		net->xfrm.policy_count[XFRM_POLICY_MAX + dir] = 0;
 		INIT_HLIST_HEAD(&net->xfrm.policy_inexact[dir]);
+		net->xfrm.policy_inexact_bins[dir].root = RB_ROOT;
+		INIT_LIST_HEAD(&net->xfrm.policy_inexact_bins[dir].classes);
+		INIT_HLIST_HEAD(&net->xfrm.policy_inexact_bins[dir].unbinned);
 
 		htab = &net->xfrm.policy_bydst[dir];
 		htab->table = xfrm_hash_alloc(sz);
@@ -2856,6 +3207,8 @@ static int __net_init xfrm_policy_init(struct net *net)
 	net->xfrm.policy_hthresh.rbits6 = 128;
 
 	seqlock_init(&net->xfrm.policy_hthresh.lock);
+	seqcount_init(&net->xfrm.policy_inexact_seq);
+	net->xfrm.policy_inexact_pos = 0;
 
 	INIT_LIST_HEAD(&net->xfrm.policy_all);
 	INIT_WORK(&net->xfrm.policy_hash_work, xfrm_hash_resize);
@@ -2891,6 +3244,7 @@ static void xfrm_policy_fini(struct net *net)
 		struct xfrm_policy_hash *htab;
 
 		WARN_ON(!hlist_empty(&net->xfrm.policy_inexact[dir]));
+		WARN_ON(!RB_EMPTY_ROOT(&net->xfrm.policy_inexact_bins[dir].root));
 
 		htab = &net->xfrm.policy_bydst[dir];
 		sz = (htab->hmask + 1) * sizeof(struct hlist_head);
@@ -0,0 +1,176 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# Check that inexact (prefix) xfrm policies keep their priority semantics
+# and measure per-packet policy lookup cost with many inexact policies.
+#
+# ns1 (10.0.1.1) <-veth-> ns2 (10.0.1.2)
+#
+# "allow" policies without templates let traffic pass untransformed and
+# "block" policies drop it, so plain ping tells which policy was selected.
+#
+# NPOL inexact policies that never match are installed for the benchmark,
+# which times "ping -f" from ns1 to ns2: every packet is sent on an
+# unconnected socket and goes through a policy lookup.
+
+ret=0
+nsuccess=0
+nfail=0
+
+NPOL=${NPOL:=5000}
+NPKT=${NPKT:=20000}
+
+log_test()
+{
+	local rc=$1
+	local expected=$2
+	local msg="$3"
+
+	if [ ${rc} -eq ${expected} ]; then
+		nsuccess=$((nsuccess+1))
+		printf "    TEST: %-50s  [ OK ]\n" "${msg}"
+	else
+		ret=1
+		nfail=$((nfail+1))
+		printf "    TEST: %-50s  [FAIL]\n" "${msg}"
+	fi
+}
+
+setup()
+{
+	set -e
+	ip netns add ns1
+	ip netns add ns2
+	ip -netns ns1 link set lo up
+	ip -netns ns2 link set lo up
+
+	ip link add veth0 netns ns1 type veth peer name veth0 netns ns2
+	ip -netns ns1 addr add 10.0.1.1/24 dev veth0
+	ip -netns ns2 addr add 10.0.1.2/24 dev veth0
+	ip -netns ns1 link set veth0 up
+	ip -netns ns2 link set veth0 up
+	set +e
+}
+
+cleanup()
+{
+	ip netns del ns1
+	ip netns del ns2
+}
+
+pol_add()
+{
+	ip -netns ns1 xfrm policy add dir out "$@"
+}
+
+pol_del()
+{
+	ip -netns ns1 xfrm policy delete dir out "$@"
+}
+
+ping_ok()
+{
+	ip netns exec ns1 ping -q -c 1 -W 1 10.0.1.2 > /dev/null 2>&1
+}
+
+priority_tests()
+{
+	echo "Inexact policy priority"
+
+	pol_add src 10.0.1.0/24 dst 10.0.0.0/16 priority 50 action allow
+	ping_ok
+	log_test $? 0 "allow via /16 destination"
+
+	pol_add src 10.0.0.0/8 dst 10.0.1.0/25 priority 10 action block
+	ping_ok
+	log_test $? 1 "lower priority value in other bin wins"
+
+	pol_add src 10.0.1.1/32 dst 10.0.1.0/24 priority 5 action allow
+	ping_ok
+	log_test $? 0 "lower priority value in third bin wins"
+
+	pol_del src 10.0.1.1/32 dst 10.0.1.0/24
+	ping_ok
+	log_test $? 1 "deleted policy no longer selected"
+
+	pol_del src 10.0.0.0/8 dst 10.0.1.0/25
+	ping_ok
+	log_test $? 0 "remaining policy selected after delete"
+
+	# equal priority: the policy installed first wins
+	pol_add src 0.0.0.0/0 dst 10.0.1.0/24 priority 20 action block
+	pol_add src 10.0.1.0/24 dst 10.0.1.2/31 priority 20 action allow
+	ping_ok
+	log_test $? 1 "equal priority, first installed wins"
+
+	# an exact policy wins over inexact ones of equal priority
+	pol_add src 10.0.1.1/32 dst 10.0.1.2/32 priority 20 action allow
+	ping_ok
+	log_test $? 0 "exact policy wins equal priority"
+
+	ip -netns ns1 xfrm policy flush
+}
+
+bench_ping()
+{
+	local start end
+
+	start=$(date +%s%N)
+	ip netns exec ns1 ping -q -f -c ${NPKT} 10.0.1.2 > /dev/null 2>&1
+	end=$(date +%s%N)
+
+	echo $(( (end - start) / 1000 ))
+}
+
+benchmark()
+{
+	local base t i j n=0
+
+	echo "Benchmark: ${NPKT} packets, ${NPOL} non-matching inexact policies"
+
+	base=$(bench_ping)
+	printf "    %-30s %10d us\n" "no policies:" ${base}
+
+	for i in $(seq 0 255); do
+		for j in $(seq 0 255); do
+			[ $n -ge ${NPOL} ] && break 2
+			echo "policy add dir out src 172.16.$i.0/24 dst 172.17.$j.0/24 action block"
+			n=$((n+1))
+		done
+	done | ip -netns ns1 -batch -
+	pol_add src 10.0.1.0/24 dst 10.0.1.0/24 priority 1000 action allow
+
+	t=$(bench_ping)
+	printf "    %-30s %10d us\n" "${NPOL} policies:" ${t}
+
+	ping_ok
+	log_test $? 0 "matching policy found among ${NPOL} others"
+
+	ip -netns ns1 xfrm policy flush
+}
+
+if [ "$(id -u)" -ne 0 ];then
+	echo "SKIP: Need root privileges"
+	exit 0
+fi
+
+if [ ! -x "$(command -v ip)" ]; then
+	echo "SKIP: Could not run test without ip tool"
+	exit 0
+fi
+
+ip -Version | grep -q iproute2 || {
+	echo "SKIP: Could not run test without iproute2"
+	exit 0
+}
+
+cleanup &> /dev/null
+setup
+priority_tests
+benchmark
+cleanup
+
+printf "\nTests passed: %3d\n" ${nsuccess}
+printf "Tests failed: %3d\n"   ${nfail}
+
+exit $ret
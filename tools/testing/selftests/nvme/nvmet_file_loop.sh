@@ -0,0 +1,265 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# Exercise file backed nvmet namespaces over the loop transport, so no
+# NVMe hardware is needed.
+#
+# A file on $BACKING_DIR is exported through nvme-loop once per I/O mode
+# (direct, queued_io, polled_io, buffered_io).  Each mode is checked with
+# a write/read-back compare and, if fio is installed, a short verified
+# random read/write run at queue depth $IODEPTH.  For polled_io that is
+# deeper than the one command per CPU it keeps outstanding, so the
+# commands queued behind it are covered too.  The host side latency
+# histograms under /sys/class/block/<disk>/stats are checked along the
+# way.
+#
+# BACKING_DIR should be on a real block device; on tmpfs O_DIRECT opens
+# fail, and every mode but buffered_io is reported as skipped.
+
+# Kselftest framework requirement - SKIP code is 4.
+ksft_skip=4
+
+BACKING_DIR=${BACKING_DIR:=/tmp}
+SIZE_MB=${SIZE_MB:=64}
+IODEPTH=${IODEPTH:=32}
+NQN=nvmet-file-loop-selftest
+CFG=/sys/kernel/config/nvmet
+
+ret=0
+nsuccess=0
+nfail=0
+nskip=0
+backing=""
+
+log_test()
+{
+	local rc=$1
+	local expected=$2
+	local msg="$3"
+
+	if [ ${rc} -eq ${expected} ]; then
+		nsuccess=$((nsuccess+1))
+		printf "    TEST: %-50s  [ OK ]\n" "${msg}"
+	else
+		ret=1
+		nfail=$((nfail+1))
+		printf "    TEST: %-50s  [FAIL]\n" "${msg}"
+	fi
+}
+
+# Block device to do I/O on: the multipath head (nvmeXnY under the
+# subsystem) if there is one, else the controller's namespace disk.
+ns_dev()
+{
+	local d dev
+
+	for d in /sys/class/nvme-subsystem/nvme-subsys* /sys/class/nvme/nvme*; do
+		[ "$(cat $d/subsysnqn 2>/dev/null)" = "$NQN" ] || continue
+		dev=$(ls -d $d/nvme*n1 2>/dev/null | xargs -r -n1 basename |
+		      grep -v 'c[0-9]*n' | head -1)
+		if [ -n "$dev" ]; then
+			echo $dev
+			return
+		fi
+	done
+}
+
+# Disk that carries the per-namespace stats: the per-path nvmeXcYnZ
+# disk with multipath, the same disk as ns_dev() without.
+ns_path_disk()
+{
+	local d
+
+	for d in /sys/class/nvme/nvme*; do
+		[ "$(cat $d/subsysnqn 2>/dev/null)" = "$NQN" ] || continue
+		ls -d $d/nvme*n1 2>/dev/null | head -1 | xargs -r basename
+		return
+	done
+}
+
+setup_subsys()
+{
+	mkdir $CFG/subsystems/$NQN || return 1
+	echo 1 > $CFG/subsystems/$NQN/attr_allow_any_host
+	mkdir $CFG/subsystems/$NQN/namespaces/1
+	echo -n $backing > $CFG/subsystems/$NQN/namespaces/1/device_path
+
+	mkdir -p $CFG/ports/1
+	echo loop > $CFG/ports/1/addr_trtype
+	ln -s $CFG/subsystems/$NQN $CFG/ports/1/subsystems/$NQN
+}
+
+cleanup()
+{
+	local d
+
+	for d in /sys/class/nvme/nvme*; do
+		[ "$(cat $d/subsysnqn 2>/dev/null)" = "$NQN" ] || continue
+		echo 1 > $d/delete_controller
+	done
+	rm -f $CFG/ports/1/subsystems/$NQN 2>/dev/null
+	rmdir $CFG/ports/1 2>/dev/null
+	echo 0 > $CFG/subsystems/$NQN/namespaces/1/enable 2>/dev/null
+	rmdir $CFG/subsystems/$NQN/namespaces/1 2>/dev/null
+	rmdir $CFG/subsystems/$NQN 2>/dev/null
+	[ -n "$backing" ] && rm -f $backing
+}
+
+# set_mode <buffered_io> <queued_io> <polled_io>
+set_mode()
+{
+	local ns=$CFG/subsystems/$NQN/namespaces/1
+
+	echo 0 > $ns/enable
+	# buffered_io is exclusive with the other two, clear them all first
+	echo 0 > $ns/buffered_io
+	echo 0 > $ns/queued_io
+	echo 0 > $ns/polled_io
+	echo $1 > $ns/buffered_io || return 1
+	echo $2 > $ns/queued_io || return 1
+	echo $3 > $ns/polled_io || return 1
+	echo 1 > $ns/enable
+}
+
+connect()
+{
+	local i dev
+
+	echo "transport=loop,nqn=$NQN" > /dev/nvme-fabrics || return 1
+	for i in $(seq 50); do
+		dev=$(ns_dev)
+		[ -n "$dev" ] && [ -b /dev/$dev ] && break
+		sleep 0.1
+	done
+	[ -n "$dev" ] || return 1
+	echo $dev
+}
+
+disconnect()
+{
+	local d
+
+	for d in /sys/class/nvme/nvme*; do
+		[ "$(cat $d/subsysnqn 2>/dev/null)" = "$NQN" ] || continue
+		echo 1 > $d/delete_controller
+	done
+}
+
+verify()
+{
+	local dev=$1
+	local pattern=$(mktemp)
+	local rc
+
+	dd if=/dev/urandom of=$pattern bs=1M count=4 2>/dev/null
+	dd if=$pattern of=/dev/$dev bs=1M oflag=direct 2>/dev/null &&
+	dd if=/dev/$dev bs=1M count=4 iflag=direct 2>/dev/null |
+		cmp -s - $pattern
+	rc=$?
+	rm -f $pattern
+	return $rc
+}
+
+# The 4 MiB written and read back by verify() must show up in the host
+# side latency histograms, and a reset must clear them again.
+check_latency()
+{
+	local stats=/sys/class/block/$(ns_path_disk)/stats
+	local n
+
+	[ -d $stats ] || return 1
+	n=$(awk '{ s += $2 } END { print s }' $stats/read_latency)
+	[ "$n" -gt 0 ] || return 1
+	n=$(awk '{ s += $2 } END { print s }' $stats/write_latency)
+	[ "$n" -gt 0 ] || return 1
+	[ -n "$(cat $stats/hw_queue_depth)" ] || return 1
+
+	echo 1 > $stats/latency_reset
+	n=$(awk '{ s += $2 } END { print s }' $stats/read_latency)
+	[ "$n" -eq 0 ]
+}
+
+log_skip()
+{
+	nskip=$((nskip+1))
+	printf "    TEST: %-50s  [SKIP]\n" "$1"
+}
+
+# Short functional run, not a benchmark: random 4k reads and writes
+# over 16 MiB, every block written is read back and checked.
+fio_verify()
+{
+	local dev=$1
+
+	fio --name=verify --filename=/dev/$dev --direct=1 \
+	    --ioengine=libaio --iodepth=$IODEPTH --bs=4k --rw=randrw \
+	    --size=16M --numjobs=1 --verify=crc32c --verify_fatal=1 \
+	    --output=/dev/null
+}
+
+run_mode()
+{
+	local name=$1
+	local dev
+
+	shift
+	if ! set_mode "$@" 2>/dev/null; then
+		log_skip "$name: namespace did not enable"
+		return
+	fi
+
+	dev=$(connect)
+	if [ -z "$dev" ]; then
+		log_test 1 0 "$name: connect over nvme-loop"
+		return
+	fi
+
+	verify $dev
+	log_test $? 0 "$name: write and read back"
+	check_latency
+	log_test $? 0 "$name: host latency histograms"
+	if command -v fio > /dev/null; then
+		fio_verify $dev
+		log_test $? 0 "$name: fio randrw verify, iodepth $IODEPTH"
+	else
+		log_skip "$name: fio randrw verify (no fio)"
+	fi
+	disconnect
+}
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "SKIP: need root privileges"
+	exit $ksft_skip
+fi
+
+modprobe nvme-loop 2>/dev/null
+mount -t configfs none /sys/kernel/config 2>/dev/null
+if [ ! -d $CFG ] || [ ! -c /dev/nvme-fabrics ]; then
+	echo "SKIP: nvmet or nvme-loop not available"
+	exit $ksft_skip
+fi
+
+backing=$(mktemp -p $BACKING_DIR nvmet-file.XXXXXX)
+truncate -s ${SIZE_MB}M $backing
+
+trap cleanup EXIT
+
+if ! setup_subsys; then
+	echo "SKIP: could not create nvmet subsystem"
+	exit $ksft_skip
+fi
+
+echo "nvmet file backend over nvme-loop, $SIZE_MB MiB:"
+run_mode direct 0 0 0
+run_mode queued_io 0 1 0
+run_mode polled_io 0 1 1
+run_mode buffered_io 1 0 0
+
+printf "\nTests passed: %3d\n" ${nsuccess}
+printf "Tests failed: %3d\n" ${nfail}
+printf "Tests skipped: %3d\n" ${nskip}
+
+if [ $ret -eq 0 ] && [ $nsuccess -eq 0 ]; then
+	exit $ksft_skip
+fi
+exit $ret